@@ -0,0 +1,32 @@
+#include "admission.h"
+
+void admission_init(admission_t* admission, uint64_t limit, int bulk_percent) {
+  admission->limit = limit;
+  admission->bulk_limit = limit * bulk_percent / 100;
+  admission->in_flight = 0;
+  admission->rejected = 0;
+}
+
+bool admission_admit(admission_t* admission, uint64_t cost, bool bulk) {
+  uint64_t in_flight;
+  uint64_t limit;
+
+  if (admission->limit == 0) return true;
+
+  in_flight = __atomic_load_n(&admission->in_flight, __ATOMIC_RELAXED);
+  limit = bulk ? admission->bulk_limit : admission->limit;
+  if (in_flight == 0 || in_flight + cost <= limit) {
+    return true;
+  }
+
+  admission->rejected++;
+  return false;
+}
+
+void admission_start(admission_t* admission) {
+  __atomic_add_fetch(&admission->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+void admission_finish(admission_t* admission) {
+  __atomic_sub_fetch(&admission->in_flight, 1, __ATOMIC_RELAXED);
+}
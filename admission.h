@@ -0,0 +1,31 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Admission control on the number of statements waiting on the driver.
+ * Requests are checked once, when their parameters are known, against the
+ * statements already in flight plus the ones they're about to issue. Bulk
+ * requests (multi-user, scans, ingest) are held to a lower limit so they're
+ * the first to be shed and single-user requests keep getting through. */
+typedef struct admission_s {
+  uint64_t limit; /* 0 disables admission control */
+  uint64_t bulk_limit;
+  uint64_t in_flight;
+  uint64_t rejected;
+} admission_t;
+
+void admission_init(admission_t* admission, uint64_t limit, int bulk_percent);
+
+/* A request that would be alone in flight is always admitted, however much
+ * it costs */
+bool admission_admit(admission_t* admission, uint64_t cost, bool bulk);
+
+/* Called as each statement is handed to the driver and when its future
+ * completes (from the driver's IO threads) */
+void admission_start(admission_t* admission);
+void admission_finish(admission_t* admission);
+
+#endif
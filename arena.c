@@ -0,0 +1,84 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 8
+
+typedef struct arena_block_s {
+  struct arena_block_s* next;
+  size_t capacity;
+  size_t used;
+  char data[];
+} arena_block_t;
+
+/*****************************************************************************/
+
+static arena_block_t* arena__block_new(size_t capacity, arena_block_t* next);
+
+/*****************************************************************************/
+
+arena_block_t* arena__block_new(size_t capacity, arena_block_t* next) {
+  arena_block_t* block = (arena_block_t*)malloc(sizeof(arena_block_t) + capacity);
+  block->next = next;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
+
+/*****************************************************************************/
+
+void arena_init(arena_t* arena, size_t size) {
+  arena->head = arena__block_new(size > 0 ? size : ARENA_DEFAULT_BLOCK_SIZE, NULL);
+  arena->used = 0;
+}
+
+void arena_destroy(arena_t* arena) {
+  arena_block_t* block = arena->head;
+  while (block) {
+    arena_block_t* next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+  arena->used = 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+  arena_block_t* block = arena->head;
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  if (block->used + size > block->capacity) {
+    size_t capacity = 2 * block->capacity;
+    if (capacity < size) capacity = size;
+    block = arena__block_new(capacity, block);
+    arena->head = block;
+  }
+
+  void* result = block->data + block->used;
+  block->used += size;
+  arena->used += size;
+  return result;
+}
+
+char* arena_copy(arena_t* arena, const char* data, size_t length) {
+  char* result = (char*)arena_alloc(arena, length);
+  memcpy(result, data, length);
+  return result;
+}
+
+void arena_reset(arena_t* arena) {
+  arena_block_t* block = arena->head;
+
+  /* Replace the chain with one block big enough for what this request used */
+  if (block->next) {
+    size_t capacity = block->capacity;
+    while (capacity < arena->used) capacity *= 2;
+    arena_destroy(arena);
+    block = arena__block_new(capacity, NULL);
+    arena->head = block;
+  }
+
+  block->used = 0;
+  arena->used = 0;
+}
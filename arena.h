@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE 4096
+
+struct arena_block_s;
+
+/* Bump allocator for things that live exactly as long as a request. Blocks
+ * added while a request runs are merged into a single block on reset so the
+ * steady state is one block and every allocation is a pointer bump. */
+typedef struct arena_s {
+  struct arena_block_s* head;
+  size_t used;
+} arena_t;
+
+void arena_init(arena_t* arena, size_t size);
+void arena_destroy(arena_t* arena);
+
+void* arena_alloc(arena_t* arena, size_t size);
+char* arena_copy(arena_t* arena, const char* data, size_t length);
+void arena_reset(arena_t* arena);
+
+#endif
@@ -0,0 +1,224 @@
+#ifdef BENCH_FASTERCGI_C
+/* Included back by fastercgi.h when built with BENCH_COMBINED_LAYOUT: the
+ * connection layout from before the libuv handles were split off. The
+ * handles are an array of one so conn->handles->pipe works for both. */
+typedef struct fcgi_connection_s {
+  struct fcgi_server_s* serv;
+  struct fcgi_connection_s* next_in_list;
+
+  bool in_free_list;
+  bool in_use;
+  bool is_closed;
+  bool is_paused;
+
+  bool stream_stdin;
+
+  fcgi_connection_handles_t handles[1];
+
+  void* data;
+
+  fcgi_buffer_t incoming_buf;
+  char* to_read;
+
+  int record_state;
+  size_t record_length;
+
+  char header_buf[FCGI_RECORD_HEADER_LENGTH];
+  uint8_t version;
+  uint8_t type;
+  uint16_t request_id;
+  uint16_t content_length;
+  uint8_t padding_length;
+
+  uint16_t role;
+  uint8_t flags;
+
+  uint32_t app_status;
+  uint16_t proto_status;
+
+  fcgi_write_req_t* free_list;
+
+  uint8_t protocol;
+  uint8_t http_state;
+  uint8_t http_minor_version;
+  bool http_response_started;
+  bool http_chunked;
+  uint64_t http_body_remaining;
+  fcgi_buffer_t http_pending;
+} fcgi_connection_t;
+#else
+#define BENCH_FASTERCGI_C
+
+/* Microbenchmark for the FastCGI record parser: requests are fed straight
+ * into fcgi__on_read() for many connections at once, in a shuffled order so
+ * each read lands on a connection whose state has likely left the cache.
+ * Build and run with "make bench", which also builds it against the old
+ * connection layout (BENCH_COMBINED_LAYOUT) to compare the two. */
+
+/* Only this file turns it into the header's define, http.c and logger.c
+ * are built with the same flags and keep the normal layout */
+#ifdef BENCH_COMBINED_LAYOUT
+#define FCGI_BENCH_COMBINED_LAYOUT
+#endif
+
+#include "fastercgi.c"
+
+#include <time.h>
+
+#define BENCH_ROUNDS_TOTAL (1 << 19)
+#define BENCH_REPETITIONS 9
+
+#ifdef BENCH_COMBINED_LAYOUT
+#define BENCH_LAYOUT "combined"
+#else
+#define BENCH_LAYOUT "split"
+#endif
+
+/*****************************************************************************/
+
+static void bench__append_record(fcgi_buffer_t* buf, int type, const char* content, size_t length);
+static void bench__append_param(fcgi_buffer_t* buf, const char* name, const char* value);
+static void bench__build_request(fcgi_buffer_t* buf);
+static void bench__handler(fcgi_connection_t* conn, int type);
+static uint64_t bench__now_ns(void);
+static void bench__run(fcgi_server_t* serv, const fcgi_buffer_t* request, int num_conns);
+
+
+/*****************************************************************************/
+
+void bench__append_record(fcgi_buffer_t* buf, int type, const char* content, size_t length) {
+  char header[FCGI_RECORD_HEADER_LENGTH];
+  size_t padding = (8 - (length % 8)) % 8;
+  char zeros[8] = { 0 };
+
+  header[0] = 1;
+  header[1] = (char)type;
+  header[2] = 0;
+  header[3] = 1;
+  header[4] = (char)((length >> 8) & 0xFF);
+  header[5] = (char)(length & 0xFF);
+  header[6] = (char)padding;
+  header[7] = 0;
+
+  fcgi_buffer_append(buf, header, FCGI_RECORD_HEADER_LENGTH);
+  fcgi_buffer_append(buf, content, length);
+  fcgi_buffer_append(buf, zeros, padding);
+}
+
+void bench__append_param(fcgi_buffer_t* buf, const char* name, const char* value) {
+  char lengths[2];
+  lengths[0] = (char)strlen(name);
+  lengths[1] = (char)strlen(value);
+  fcgi_buffer_append(buf, lengths, 2);
+  fcgi_buffer_append(buf, name, strlen(name));
+  fcgi_buffer_append(buf, value, strlen(value));
+}
+
+/* What nginx sends for a single user GET */
+void bench__build_request(fcgi_buffer_t* buf) {
+  char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+  fcgi_buffer_t params = { 0, 0, 0, NULL };
+
+  bench__append_param(&params, "QUERY_STRING", "format=json");
+  bench__append_param(&params, "REQUEST_METHOD", "GET");
+  bench__append_param(&params, "CONTENT_TYPE", "");
+  bench__append_param(&params, "CONTENT_LENGTH", "");
+  bench__append_param(&params, "SCRIPT_NAME", "/prepared-statements/users/user42");
+  bench__append_param(&params, "REQUEST_URI", "/prepared-statements/users/user42?format=json");
+  bench__append_param(&params, "DOCUMENT_URI", "/prepared-statements/users/user42");
+  bench__append_param(&params, "SERVER_PROTOCOL", "HTTP/1.1");
+  bench__append_param(&params, "REMOTE_ADDR", "127.0.0.1");
+  bench__append_param(&params, "REMOTE_PORT", "51234");
+  bench__append_param(&params, "SERVER_ADDR", "127.0.0.1");
+  bench__append_param(&params, "SERVER_PORT", "8080");
+  bench__append_param(&params, "HTTP_HOST", "localhost:8080");
+  bench__append_param(&params, "HTTP_ACCEPT", "*/*");
+
+  bench__append_record(buf, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+  bench__append_record(buf, FCGI_PARAMS, params.data, params.length);
+  bench__append_record(buf, FCGI_PARAMS, NULL, 0);
+  bench__append_record(buf, FCGI_STDIN, NULL, 0);
+
+  free(params.data);
+}
+
+void bench__handler(fcgi_connection_t* conn, int type) {
+  /* Nothing to do, only the parsing is measured */
+}
+
+uint64_t bench__now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench__run(fcgi_server_t* serv, const fcgi_buffer_t* request, int num_conns) {
+  int* order = (int*)malloc(num_conns * sizeof(int));
+  int rounds = BENCH_ROUNDS_TOTAL / num_conns;
+  uv_buf_t buf = uv_buf_init(request->data, request->length);
+  uint64_t best = UINT64_MAX;
+  int i;
+  int r;
+  int n;
+
+  for (i = 0; i < num_conns; ++i) {
+    order[i] = i;
+  }
+  for (i = num_conns - 1; i > 0; --i) {
+    int j = rand() % (i + 1);
+    int temp = order[i];
+    order[i] = order[j];
+    order[j] = temp;
+  }
+
+  /* Warm up so the incoming buffers are already grown */
+  for (i = 0; i < num_conns; ++i) {
+    fcgi__on_read((uv_stream_t*)&serv->conns[i].handles->pipe, request->length, &buf);
+  }
+
+  /* The fastest repetition is reported, the others were interrupted */
+  for (n = 0; n < BENCH_REPETITIONS; ++n) {
+    uint64_t start = bench__now_ns();
+    uint64_t elapsed;
+    for (r = 0; r < rounds; ++r) {
+      for (i = 0; i < num_conns; ++i) {
+        fcgi_connection_t* conn = &serv->conns[order[i]];
+        fcgi__on_read((uv_stream_t*)&conn->handles->pipe, request->length, &buf);
+      }
+    }
+    elapsed = bench__now_ns() - start;
+    if (elapsed < best) best = elapsed;
+  }
+
+  printf("%-8s %4d connections: %6.1f ns/request, %6.2f M requests/s\n",
+         BENCH_LAYOUT, num_conns,
+         (double)best / ((double)rounds * num_conns),
+         (double)rounds * num_conns * 1000.0 / (double)best);
+
+  free(order);
+}
+
+/*****************************************************************************/
+
+int main(int argc, char** argv) {
+  static fcgi_server_t serv;
+  fcgi_buffer_t request = { 0, 0, 0, NULL };
+  int num_conns;
+
+  fcgi_server_init(&serv);
+  serv.handler_cb = bench__handler;
+  bench__build_request(&request);
+
+  printf("%-8s sizeof(fcgi_connection_t) = %zu, request = %zu bytes\n",
+         BENCH_LAYOUT, sizeof(fcgi_connection_t), request.length);
+
+  for (num_conns = 1; num_conns <= FCGI_MAX_CONNECTIONS; num_conns *= 4) {
+    bench__run(&serv, &request, num_conns);
+  }
+
+  free(request.data);
+
+  return 0;
+}
+
+#endif /* BENCH_FASTERCGI_C */
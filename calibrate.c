@@ -0,0 +1,262 @@
+#include "calibrate.h"
+
+#include <uv.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CALIBRATE_CONCURRENCY 512
+#define CALIBRATE_WARMUP_REQUESTS 2000
+#define CALIBRATE_REQUESTS 50000
+
+/* Profiles whose p99 is further than this from the best p99 aren't picked
+ * no matter how much throughput they get */
+#define CALIBRATE_MAX_P99_RATIO 2
+
+static const int calibrate__connections[] = { 1, 2, 4, 8 };
+static const int calibrate__queue_sizes[] = { 1024, 8192, 32768 };
+
+#define CALIBRATE_COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+typedef struct calibrate_workload_s {
+  CassSession* session;
+  const CassPrepared* prepared;
+  const char* key;
+
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  int issued;
+  int completed;
+  int total;
+  int errors;
+  uint64_t* latencies;
+} calibrate_workload_t;
+
+typedef struct calibrate_request_s {
+  calibrate_workload_t* workload;
+  uint64_t start;
+} calibrate_request_t;
+
+typedef struct calibrate_result_s {
+  driver_config_t config;
+  double throughput;
+  uint64_t p99_us;
+} calibrate_result_t;
+
+/*****************************************************************************/
+
+static int calibrate__compare(const void* a, const void* b);
+
+static void calibrate__execute(calibrate_request_t* request);
+static void calibrate__on_future(CassFuture* future, void* data);
+static int calibrate__workload(calibrate_workload_t* workload, int total);
+
+static int calibrate__measure(const char* contact_points, const char* query, const char* key,
+                              calibrate_result_t* result);
+
+/*****************************************************************************/
+
+int calibrate__compare(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void calibrate__execute(calibrate_request_t* request) {
+  calibrate_workload_t* workload = request->workload;
+  CassStatement* statement = cass_prepared_bind(workload->prepared);
+  cass_statement_bind_string(statement, 0, cass_string_init(workload->key));
+  request->start = uv_hrtime();
+  CassFuture* future = cass_session_execute(workload->session, statement);
+  cass_future_set_callback(future, calibrate__on_future, request);
+  cass_future_free(future);
+  cass_statement_free(statement);
+}
+
+void calibrate__on_future(CassFuture* future, void* data) {
+  calibrate_request_t* request = (calibrate_request_t*)data;
+  calibrate_workload_t* workload = request->workload;
+  uint64_t latency = uv_hrtime() - request->start;
+  bool more = false;
+
+  uv_mutex_lock(&workload->mutex);
+  if (cass_future_error_code(future) != CASS_OK) {
+    workload->errors++;
+  }
+  workload->latencies[workload->completed++] = latency;
+  if (workload->issued < workload->total) {
+    workload->issued++;
+    more = true;
+  } else if (workload->completed == workload->total) {
+    uv_cond_signal(&workload->cond);
+  }
+  uv_mutex_unlock(&workload->mutex);
+
+  if (more) {
+    calibrate__execute(request);
+  }
+}
+
+/* Keeps CALIBRATE_CONCURRENCY requests in flight until "total" completed */
+int calibrate__workload(calibrate_workload_t* workload, int total) {
+  calibrate_request_t requests[CALIBRATE_CONCURRENCY];
+  int concurrency = total < CALIBRATE_CONCURRENCY ? total : CALIBRATE_CONCURRENCY;
+  int i;
+
+  workload->issued = concurrency;
+  workload->completed = 0;
+  workload->total = total;
+  workload->errors = 0;
+
+  for (i = 0; i < concurrency; ++i) {
+    requests[i].workload = workload;
+    calibrate__execute(&requests[i]);
+  }
+
+  uv_mutex_lock(&workload->mutex);
+  while (workload->completed < workload->total) {
+    uv_cond_wait(&workload->cond, &workload->mutex);
+  }
+  uv_mutex_unlock(&workload->mutex);
+
+  return workload->errors;
+}
+
+int calibrate__measure(const char* contact_points, const char* query, const char* key,
+                       calibrate_result_t* result) {
+  int rc = -1;
+  calibrate_workload_t workload;
+  CassCluster* cluster = cass_cluster_new();
+  CassSession* session = cass_session_new();
+  CassFuture* future;
+
+  cass_cluster_set_contact_points(cluster, contact_points);
+  driver_config_apply(&result->config, cluster);
+
+  future = cass_session_connect(session, cluster);
+  cass_future_wait(future);
+  if (cass_future_error_code(future) != CASS_OK) {
+    CassString error = cass_future_error_message(future);
+    fprintf(stderr, "Unable to connect: %.*s\n", (int)error.length, error.data);
+    cass_future_free(future);
+    goto done;
+  }
+  cass_future_free(future);
+
+  future = cass_session_prepare(session, cass_string_init(query));
+  cass_future_wait(future);
+  if (cass_future_error_code(future) != CASS_OK) {
+    CassString error = cass_future_error_message(future);
+    fprintf(stderr, "Query error: %.*s\n", (int)error.length, error.data);
+    cass_future_free(future);
+    goto close;
+  }
+
+  workload.session = session;
+  workload.prepared = cass_future_get_prepared(future);
+  workload.key = key;
+  workload.latencies = (uint64_t*)malloc(CALIBRATE_REQUESTS * sizeof(uint64_t));
+  uv_mutex_init(&workload.mutex);
+  uv_cond_init(&workload.cond);
+  cass_future_free(future);
+
+  calibrate__workload(&workload, CALIBRATE_WARMUP_REQUESTS);
+
+  uint64_t start = uv_hrtime();
+  int errors = calibrate__workload(&workload, CALIBRATE_REQUESTS);
+  uint64_t elapsed = uv_hrtime() - start;
+
+  if (errors > 0) {
+    fprintf(stderr, "%d of %d requests failed\n", errors, CALIBRATE_REQUESTS);
+  } else {
+    qsort(workload.latencies, CALIBRATE_REQUESTS, sizeof(uint64_t), calibrate__compare);
+    result->throughput = (double)CALIBRATE_REQUESTS * 1e9 / elapsed;
+    result->p99_us = workload.latencies[CALIBRATE_REQUESTS * 99 / 100] / 1000;
+    rc = 0;
+  }
+
+  uv_cond_destroy(&workload.cond);
+  uv_mutex_destroy(&workload.mutex);
+  free(workload.latencies);
+  cass_prepared_free(workload.prepared);
+
+close:
+  future = cass_session_close(session);
+  cass_future_wait(future);
+  cass_future_free(future);
+
+done:
+  cass_session_free(session);
+  cass_cluster_free(cluster);
+  return rc;
+}
+
+/*****************************************************************************/
+
+int calibrate_run(const char* contact_points, const driver_config_t* base,
+                  const char* query, const char* key, const char* output_path) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus > 0 ? (int)cpus : 1;
+  int threads, c, q;
+  int count = 0;
+  calibrate_result_t* results;
+  calibrate_result_t* best = NULL;
+  uint64_t best_p99_us = UINT64_MAX;
+
+  /* Thread counts are powers of two so there are at most 32 of them */
+  results = (calibrate_result_t*)malloc(32 * CALIBRATE_COUNT(calibrate__connections) *
+                                        CALIBRATE_COUNT(calibrate__queue_sizes) *
+                                        sizeof(calibrate_result_t));
+
+  printf("%8s %12s %10s %12s %10s\n", "threads", "connections", "queue", "req/s", "p99 (us)");
+
+  for (threads = 1; threads <= max_threads; threads *= 2) {
+    for (c = 0; c < CALIBRATE_COUNT(calibrate__connections); ++c) {
+      for (q = 0; q < CALIBRATE_COUNT(calibrate__queue_sizes); ++q) {
+        calibrate_result_t* result = &results[count];
+
+        result->config = *base;
+        result->config.num_threads_io = threads;
+        result->config.core_connections_per_host = calibrate__connections[c];
+        result->config.max_connections_per_host = 2 * calibrate__connections[c];
+        result->config.queue_size_io = calibrate__queue_sizes[q];
+        result->config.pending_requests_low_water_mark = calibrate__queue_sizes[q] / 2;
+        result->config.pending_requests_high_water_mark = calibrate__queue_sizes[q];
+
+        if (calibrate__measure(contact_points, query, key, result) != 0) continue;
+
+        printf("%8d %12d %10d %12.0f %10llu\n",
+               threads, calibrate__connections[c], calibrate__queue_sizes[q],
+               result->throughput, (unsigned long long)result->p99_us);
+        fflush(stdout);
+
+        if (result->p99_us < best_p99_us) best_p99_us = result->p99_us;
+        count++;
+      }
+    }
+  }
+
+  for (c = 0; c < count; ++c) {
+    calibrate_result_t* result = &results[c];
+    if (result->p99_us > CALIBRATE_MAX_P99_RATIO * best_p99_us) continue;
+    if (!best || result->throughput > best->throughput) {
+      best = result;
+    }
+  }
+
+  int rc = -1;
+  if (best) {
+    printf("Best: %d threads, %d connections, queue %d (%.0f req/s, p99 %llu us)\n",
+           best->config.num_threads_io, best->config.core_connections_per_host,
+           best->config.queue_size_io, best->throughput, (unsigned long long)best->p99_us);
+    rc = driver_config_save(&best->config, output_path);
+  } else {
+    fprintf(stderr, "No profile could be measured\n");
+  }
+
+  free(results);
+  return rc;
+}
@@ -0,0 +1,12 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include "driver_config.h"
+
+/* Runs a fixed workload ("query" bound to "key") against the cluster for
+ * every combination of IO threads, connections per host and queue size and
+ * saves the best one to "output_path". Returns 0 if a profile was written. */
+int calibrate_run(const char* contact_points, const driver_config_t* base,
+                  const char* query, const char* key, const char* output_path);
+
+#endif
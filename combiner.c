@@ -0,0 +1,102 @@
+#include "combiner.h"
+
+/*****************************************************************************/
+
+static void combiner__on_check(uv_check_t* check);
+static void combiner__on_timer(uv_timer_t* timer);
+static void combiner__flush_group(combiner_t* combiner, combiner_group_t* group);
+static void combiner__stop(combiner_t* combiner);
+
+/*****************************************************************************/
+
+void combiner__on_check(uv_check_t* check) {
+  combiner_flush((combiner_t*)check->data);
+}
+
+void combiner__on_timer(uv_timer_t* timer) {
+  combiner_flush((combiner_t*)timer->data);
+}
+
+void combiner__flush_group(combiner_t* combiner, combiner_group_t* group) {
+  combiner_item_t* items = group->head;
+  int count = group->count;
+
+  group->head = NULL;
+  group->tail = NULL;
+  group->count = 0;
+  combiner->pending -= count;
+
+  if (combiner->pending == 0) {
+    combiner__stop(combiner);
+  }
+
+  combiner->flush_cb(items, count);
+}
+
+void combiner__stop(combiner_t* combiner) {
+  if (combiner->window_us < 1000) {
+    uv_check_stop(&combiner->check);
+  } else {
+    uv_timer_stop(&combiner->timer);
+  }
+}
+
+/*****************************************************************************/
+
+void combiner_init(combiner_t* combiner, uv_loop_t* loop, uint64_t window_us,
+                   int max_items, int ranges, combiner_flush_cb flush_cb) {
+  int bits = 0;
+
+  while ((1 << bits) < ranges) bits++;
+
+  combiner->enabled = max_items > 0;
+  combiner->window_us = window_us;
+  combiner->max_items = max_items;
+  combiner->ranges = 1 << bits;
+  combiner->range_shift = 64 - bits;
+  combiner->groups = (combiner_group_t*)calloc(combiner->ranges, sizeof(combiner_group_t));
+  combiner->pending = 0;
+  combiner->flush_cb = flush_cb;
+
+  uv_timer_init(loop, &combiner->timer);
+  combiner->timer.data = combiner;
+  uv_check_init(loop, &combiner->check);
+  combiner->check.data = combiner;
+}
+
+void combiner_add(combiner_t* combiner, combiner_item_t* item, int64_t token) {
+  /* Ranges are counted from the start of the ring */
+  uint64_t offset = (uint64_t)token - (uint64_t)INT64_MIN;
+  combiner_group_t* group = &combiner->groups[combiner->ranges > 1 ? offset >> combiner->range_shift : 0];
+
+  item->next_in_list = NULL;
+  if (group->tail) {
+    group->tail->next_in_list = item;
+  } else {
+    group->head = item;
+  }
+  group->tail = item;
+  group->count++;
+
+  /* The window starts with the first write held */
+  if (combiner->pending++ == 0) {
+    if (combiner->window_us < 1000) {
+      uv_check_start(&combiner->check, combiner__on_check);
+    } else {
+      uv_timer_start(&combiner->timer, combiner__on_timer, (combiner->window_us + 999) / 1000, 0);
+    }
+  }
+
+  if (group->count >= combiner->max_items) {
+    combiner__flush_group(combiner, group);
+  }
+}
+
+void combiner_flush(combiner_t* combiner) {
+  int i;
+  for (i = 0; i < combiner->ranges && combiner->pending > 0; ++i) {
+    if (combiner->groups[i].count > 0) {
+      combiner__flush_group(combiner, &combiner->groups[i]);
+    }
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef COMBINER_H
+#define COMBINER_H
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct combiner_item_s {
+  struct combiner_item_s* next_in_list;
+} combiner_item_t;
+
+typedef struct combiner_group_s {
+  combiner_item_t* head;
+  combiner_item_t* tail;
+  int count;
+} combiner_group_t;
+
+/* Gets a group's items, oldest first. They're no longer the combiner's. */
+typedef void(*combiner_flush_cb)(combiner_item_t* items, int count);
+
+/* Holds writes for a short window and hands them over grouped by token
+ * range, so each group can go out as one batch. A group is flushed as soon
+ * as it's full and every group once the window is over. Loop thread only. */
+typedef struct combiner_s {
+  bool enabled;
+  uint64_t window_us; /* Under 1ms means until the end of the loop iteration */
+  int max_items;
+  int range_shift;
+  int ranges;
+  combiner_group_t* groups;
+  int pending;
+  combiner_flush_cb flush_cb;
+  uv_timer_t timer;
+  uv_check_t check;
+} combiner_t;
+
+/* The number of token ranges is rounded up to a power of two, "max_items"
+ * of 0 disables combining */
+void combiner_init(combiner_t* combiner, uv_loop_t* loop, uint64_t window_us,
+                   int max_items, int ranges, combiner_flush_cb flush_cb);
+
+void combiner_add(combiner_t* combiner, combiner_item_t* item, int64_t token);
+
+void combiner_flush(combiner_t* combiner);
+
+#endif
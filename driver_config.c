@@ -0,0 +1,153 @@
+#include "driver_config.h"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_NUM_THREADS_IO 4
+#define DEFAULT_QUEUE_SIZE_IO 10000
+#define DEFAULT_PENDING_REQUESTS_LOW_WATER_MARK 5000
+#define DEFAULT_PENDING_REQUESTS_HIGH_WATER_MARK 10000
+#define DEFAULT_CORE_CONNECTIONS_PER_HOST 1
+#define DEFAULT_MAX_CONNECTIONS_PER_HOST 2
+
+typedef struct driver_config_field_s {
+  const char* name;
+  size_t offset;
+} driver_config_field_t;
+
+static const driver_config_field_t driver_config__fields[] = {
+  { "num_threads_io", offsetof(driver_config_t, num_threads_io) },
+  { "queue_size_io", offsetof(driver_config_t, queue_size_io) },
+  { "pending_requests_low_water_mark", offsetof(driver_config_t, pending_requests_low_water_mark) },
+  { "pending_requests_high_water_mark", offsetof(driver_config_t, pending_requests_high_water_mark) },
+  { "core_connections_per_host", offsetof(driver_config_t, core_connections_per_host) },
+  { "max_connections_per_host", offsetof(driver_config_t, max_connections_per_host) },
+  { NULL, 0 }
+};
+
+/*****************************************************************************/
+
+static int* driver_config__field(driver_config_t* config, const driver_config_field_t* field);
+static char* driver_config__trim(char* str);
+
+/*****************************************************************************/
+
+int* driver_config__field(driver_config_t* config, const driver_config_field_t* field) {
+  return (int*)((char*)config + field->offset);
+}
+
+char* driver_config__trim(char* str) {
+  char* end;
+  while (isspace((unsigned char)*str)) str++;
+  end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1])) end--;
+  *end = '\0';
+  return str;
+}
+
+/*****************************************************************************/
+
+void driver_config_init_defaults(driver_config_t* config) {
+  config->num_threads_io = DEFAULT_NUM_THREADS_IO;
+  config->queue_size_io = DEFAULT_QUEUE_SIZE_IO;
+  config->pending_requests_low_water_mark = DEFAULT_PENDING_REQUESTS_LOW_WATER_MARK;
+  config->pending_requests_high_water_mark = DEFAULT_PENDING_REQUESTS_HIGH_WATER_MARK;
+  config->core_connections_per_host = DEFAULT_CORE_CONNECTIONS_PER_HOST;
+  config->max_connections_per_host = DEFAULT_MAX_CONNECTIONS_PER_HOST;
+}
+
+void driver_config_init_unset(driver_config_t* config) {
+  const driver_config_field_t* field;
+  for (field = driver_config__fields; field->name; ++field) {
+    *driver_config__field(config, field) = -1;
+  }
+}
+
+void driver_config_merge(driver_config_t* config, const driver_config_t* other) {
+  const driver_config_field_t* field;
+  for (field = driver_config__fields; field->name; ++field) {
+    int value = *driver_config__field((driver_config_t*)other, field);
+    if (value >= 0) {
+      *driver_config__field(config, field) = value;
+    }
+  }
+}
+
+bool driver_config_set(driver_config_t* config, const char* name, const char* value) {
+  const driver_config_field_t* field;
+  for (field = driver_config__fields; field->name; ++field) {
+    if (strcmp(field->name, name) == 0) {
+      *driver_config__field(config, field) = atoi(value);
+      return true;
+    }
+  }
+  return false;
+}
+
+int driver_config_load(driver_config_t* config, const char* path) {
+  char line[256];
+  int line_number = 0;
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Unable to open driver config \"%s\"\n", path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char* name = driver_config__trim(line);
+    char* value;
+
+    line_number++;
+
+    if (*name == '\0' || *name == '#') continue;
+
+    value = strchr(name, '=');
+    if (!value) {
+      fprintf(stderr, "%s:%d: Expected \"name = value\"\n", path, line_number);
+      fclose(file);
+      return -1;
+    }
+    *value++ = '\0';
+    name = driver_config__trim(name);
+    value = driver_config__trim(value);
+
+    if (!driver_config_set(config, name, value)) {
+      fprintf(stderr, "%s:%d: Unknown setting \"%s\"\n", path, line_number, name);
+      fclose(file);
+      return -1;
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
+
+int driver_config_save(const driver_config_t* config, const char* path) {
+  const driver_config_field_t* field;
+
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Unable to write driver config \"%s\"\n", path);
+    return -1;
+  }
+
+  for (field = driver_config__fields; field->name; ++field) {
+    fprintf(file, "%s = %d\n", field->name, *driver_config__field((driver_config_t*)config, field));
+  }
+
+  fclose(file);
+  return 0;
+}
+
+void driver_config_apply(const driver_config_t* config, CassCluster* cluster) {
+  cass_cluster_set_num_threads_io(cluster, config->num_threads_io);
+  cass_cluster_set_queue_size_io(cluster, config->queue_size_io);
+  cass_cluster_set_pending_requests_low_water_mark(cluster, config->pending_requests_low_water_mark);
+  cass_cluster_set_pending_requests_high_water_mark(cluster, config->pending_requests_high_water_mark);
+  cass_cluster_set_core_connections_per_host(cluster, config->core_connections_per_host);
+  cass_cluster_set_max_connections_per_host(cluster, config->max_connections_per_host);
+}
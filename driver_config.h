@@ -0,0 +1,33 @@
+#ifndef DRIVER_CONFIG_H
+#define DRIVER_CONFIG_H
+
+#include <cassandra.h>
+
+#include <stdbool.h>
+
+/* Driver pool settings, loaded from a "name = value" file and/or the command
+ * line. A negative value means "not set" so that partial configs can be
+ * merged on top of each other. */
+typedef struct driver_config_s {
+  int num_threads_io;
+  int queue_size_io;
+  int pending_requests_low_water_mark;
+  int pending_requests_high_water_mark;
+  int core_connections_per_host;
+  int max_connections_per_host;
+} driver_config_t;
+
+void driver_config_init_defaults(driver_config_t* config);
+void driver_config_init_unset(driver_config_t* config);
+
+/* Overrides the settings in "config" with every setting made in "other" */
+void driver_config_merge(driver_config_t* config, const driver_config_t* other);
+
+bool driver_config_set(driver_config_t* config, const char* name, const char* value);
+
+int driver_config_load(driver_config_t* config, const char* path);
+int driver_config_save(const driver_config_t* config, const char* path);
+
+void driver_config_apply(const driver_config_t* config, CassCluster* cluster);
+
+#endif
@@ -1,7 +1,10 @@
 #include "fastercgi.h"
+#include "http.h"
+#include "logger.h"
 
 #include <assert.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,12 +30,25 @@
 #define FCGI_WRITE_STATE_DATA_SENT 1
 #define FCGI_WRITE_STATE_EOS_SENT  2
 
+#define FCGI_HTTP_STATE_HEAD 0 /* Waiting for a request line and headers */
+#define FCGI_HTTP_STATE_BODY 1
+#define FCGI_HTTP_STATE_WAIT 2 /* Request read, its response isn't written yet */
+
+#ifndef FCGI_BENCH_COMBINED_LAYOUT
+_Static_assert(offsetof(fcgi_connection_t, app_status) <= FCGI_CACHE_LINE_SIZE,
+               "Everything fcgi__on_read() touches must fit in a cache line");
+#endif
+
 /*****************************************************************************/
 
 static void fcgi__on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
 static void fcgi__on_async(uv_async_t* async);
 static void fcgi__on_connection(uv_stream_t* stream, int status);
 static void fcgi__on_close(uv_handle_t* handle);
+static void fcgi__on_http_connection(uv_stream_t* stream, int status);
+static void fcgi__on_http_error_write(uv_write_t* write, int status);
+static void fcgi__on_http_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void fcgi__on_http_write(uv_write_t* write, int status);
 static void fcgi__on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 static void fcgi__on_signal(uv_signal_t* sig, int signum);
 static void fcgi__on_write(uv_write_t* write, int status);
@@ -42,6 +58,10 @@ static void fcgi__buffer_init(fcgi_buffer_t* buf);
 static void fcgi__connection_close(fcgi_connection_t* conn);
 static void fcgi__connection_init(fcgi_connection_t* conn, fcgi_server_t* serv);
 static void fcgi__connection_reset(fcgi_connection_t* conn);
+static size_t fcgi__http_consume(fcgi_connection_t* conn, const char* data, size_t length);
+static void fcgi__http_read(fcgi_connection_t* conn, const char* data, size_t length);
+static void fcgi__http_send_error(fcgi_connection_t* conn, int status);
+static void fcgi__http_write_request_send(fcgi_write_req_t* req);
 static fcgi_connection_t* fcgi__server_get_connection(fcgi_server_t* serv);
 static void fcgi__write_req_init(fcgi_write_req_t* req, fcgi_connection_t* conn);
 static void fcgi__write_req_reset(fcgi_write_req_t* req);
@@ -64,7 +84,7 @@ void fcgi__on_async(uv_async_t* async) {
 
 void fcgi__on_connection(uv_stream_t* stream, int status) {
   if (status < 0) {
-    fprintf(stderr, "Conenction error %s\n", uv_strerror(status));
+    LOGGER_WRITE("Conenction error %s\n", uv_strerror(status));
     return;
   }
 
@@ -76,25 +96,105 @@ void fcgi__on_connection(uv_stream_t* stream, int status) {
     return;
   }
 
-  uv_pipe_init(stream->loop, &conn->pipe, 0);
+  uv_pipe_init(stream->loop, &conn->handles->pipe, 0);
 
-  if (uv_accept(stream, (uv_stream_t*)&conn->pipe) == 0) {
+  if (uv_accept(stream, (uv_stream_t*)&conn->handles->pipe) == 0) {
+    conn->protocol = FCGI_PROTOCOL_FASTCGI;
     conn->is_closed = false;
+    conn->is_paused = false;
     conn->in_use = true;
-    uv_read_start((uv_stream_t*)&conn->pipe, fcgi__on_alloc, fcgi__on_read);
+    uv_read_start((uv_stream_t*)&conn->handles->pipe, fcgi__on_alloc, fcgi__on_read);
   } else {
-    uv_close((uv_handle_t*)&conn->pipe, fcgi__on_close);
+    uv_close((uv_handle_t*)&conn->handles->pipe, fcgi__on_close);
   }
 }
 
 void fcgi__on_close(uv_handle_t* handle) {
   fcgi_connection_t* conn = (fcgi_connection_t*)handle->data;
   conn->is_closed = true;
-  if (!conn->in_use && !conn->in_free_list) {
+  if (conn->in_use) {
+    /* Aborted or disconnected before the request ended, the handler has to
+     * let go of the connection before it's reused */
+    conn->serv->handler_cb(conn, FCGI_STATE_CLOSE);
+    conn->in_use = false;
+  }
+  if (!conn->in_free_list) {
     fcgi__connection_reset(conn);
   }
 }
 
+void fcgi__on_http_connection(uv_stream_t* stream, int status) {
+  if (status < 0) {
+    LOGGER_WRITE("Conenction error %s\n", uv_strerror(status));
+    return;
+  }
+
+  fcgi_connection_t* conn = fcgi__server_get_connection((fcgi_server_t*)stream->data);
+
+  if (!conn) {
+    fprintf(stderr, "No more connections available\n");
+    abort();
+    return;
+  }
+
+  uv_tcp_init(stream->loop, &conn->handles->tcp);
+  conn->handles->tcp.data = conn;
+
+  if (uv_accept(stream, (uv_stream_t*)&conn->handles->tcp) == 0) {
+    conn->protocol = FCGI_PROTOCOL_HTTP;
+    conn->is_closed = false;
+    conn->is_paused = false;
+    /* Only in use once a request arrives, idle keep-alive connections
+     * close without involving the handler */
+    conn->in_use = false;
+    uv_tcp_nodelay(&conn->handles->tcp, 1);
+    uv_read_start((uv_stream_t*)&conn->handles->tcp, fcgi__on_alloc, fcgi__on_http_read);
+  } else {
+    uv_close((uv_handle_t*)&conn->handles->tcp, fcgi__on_close);
+  }
+}
+
+void fcgi__on_http_error_write(uv_write_t* write, int status) {
+  fcgi_write_req_t* req = (fcgi_write_req_t*)write->data;
+  fcgi_connection_t* conn = req->conn;
+  fcgi__write_req_reset(req);
+  fcgi__connection_close(conn);
+}
+
+/* HTTP connections have their own read callback so fcgi__on_read() doesn't
+ * have to look at the protocol */
+void fcgi__on_http_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  fcgi_connection_t* conn = (fcgi_connection_t*)stream->data;
+
+  if (nread < 0) {
+    fcgi__connection_close(conn);
+    return;
+  }
+
+  fcgi__http_read(conn, buf->base, nread);
+}
+
+void fcgi__on_http_write(uv_write_t* write, int status) {
+  fcgi_write_req_t* req = (fcgi_write_req_t*)write->data;
+  fcgi_connection_t* conn = req->conn;
+  bool flush = req->flush;
+
+  fcgi__write_req_reset(req);
+
+  if (flush) {
+    conn->serv->handler_cb(conn, FCGI_STATE_FLUSH);
+    return;
+  }
+
+  conn->serv->handler_cb(conn, FCGI_STATE_WRITE);
+
+  /* Pipelined requests are only parsed once the previous response is out */
+  if (!conn->in_use && conn->http_state == FCGI_HTTP_STATE_WAIT) {
+    conn->http_state = FCGI_HTTP_STATE_HEAD;
+    fcgi__http_read(conn, NULL, 0);
+  }
+}
+
 void fcgi__on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
   fcgi_connection_t* conn = (fcgi_connection_t*)stream->data;
 
@@ -117,7 +217,6 @@ void fcgi__on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
     }
 
     if(conn->record_state == 0 && conn->record_length >= FCGI_RECORD_HEADER_LENGTH) {
-      conn->version = (uint8_t)conn->header_buf[0];
       conn->type = (uint8_t)conn->header_buf[1];
       conn->request_id = ((uint8_t)conn->header_buf[2] << 8) + (uint8_t)conn->header_buf[3];
       conn->content_length = ((uint8_t)conn->header_buf[4] << 8) + (uint8_t)conn->header_buf[5];
@@ -169,6 +268,8 @@ void fcgi__on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
           //printf("begin request\n");
           conn->role = (content[0] << 8) + content[1];
           conn->flags = content[2];
+          conn->stream_stdin = false;
+          conn->in_use = true;
           conn->serv->handler_cb(conn, FCGI_STATE_BEGIN);
           fcgi_buffer_reset(&conn->incoming_buf);
           break;
@@ -194,11 +295,14 @@ void fcgi__on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
             //printf("stdin done\n");
             conn->serv->handler_cb(conn, FCGI_STATE_STDIN);
             fcgi_buffer_reset(&conn->incoming_buf);
+          } else if (conn->stream_stdin) {
+            conn->serv->handler_cb(conn, FCGI_STATE_STDIN_DATA);
+            fcgi_buffer_reset(&conn->incoming_buf);
           }
           break;
 
         default:
-          fprintf(stderr, "Unhandled record type %d\n", (int)conn->type);
+          LOGGER_WRITE("Unhandled record type %d\n", (int)conn->type);
           fcgi_buffer_reset(&conn->incoming_buf);
           break;
       }
@@ -235,13 +339,16 @@ void fcgi__buffer_init(fcgi_buffer_t* buf) {
 }
 
 void fcgi__connection_close(fcgi_connection_t* conn) {
-  if (!uv_is_closing((uv_handle_t*)&conn->pipe)) {
-    uv_close((uv_handle_t*)&conn->pipe, fcgi__on_close);
+  if (!uv_is_closing((uv_handle_t*)&conn->handles->pipe)) {
+    uv_close((uv_handle_t*)&conn->handles->pipe, fcgi__on_close);
   }
 }
 
 void fcgi__connection_init(fcgi_connection_t* conn, fcgi_server_t* serv) {
   conn->serv = serv;
+#ifndef FCGI_BENCH_COMBINED_LAYOUT
+  conn->handles = &serv->handles[conn - serv->conns];
+#endif
 
   conn->next_in_list = conn->serv->free_list;
   conn->serv->free_list = conn;
@@ -249,6 +356,8 @@ void fcgi__connection_init(fcgi_connection_t* conn, fcgi_server_t* serv) {
   conn->in_free_list = true;
   conn->in_use = false;
   conn->is_closed = true;
+  conn->is_paused = false;
+  conn->stream_stdin = false;
 
   conn->data = NULL;
 
@@ -259,7 +368,6 @@ void fcgi__connection_init(fcgi_connection_t* conn, fcgi_server_t* serv) {
   conn->record_state = 0;
   conn->record_length = 0;
 
-  conn->version = 0;
   conn->type = 0;
   conn->request_id = 0;
   conn->content_length = 0;
@@ -273,10 +381,18 @@ void fcgi__connection_init(fcgi_connection_t* conn, fcgi_server_t* serv) {
 
   conn->free_list = NULL;
 
-  conn->pipe.data = conn;
-  uv_pipe_init(&serv->loop, &conn->pipe, 0);
-  conn->async.data = conn;
-  uv_async_init(&serv->loop, &conn->async, fcgi__on_async);
+  conn->protocol = FCGI_PROTOCOL_FASTCGI;
+  conn->http_state = FCGI_HTTP_STATE_HEAD;
+  conn->http_minor_version = 1;
+  conn->http_response_started = false;
+  conn->http_chunked = false;
+  conn->http_body_remaining = 0;
+  fcgi__buffer_init(&conn->http_pending);
+
+  conn->handles->pipe.data = conn;
+  uv_pipe_init(&serv->loop, &conn->handles->pipe, 0);
+  conn->handles->async.data = conn;
+  uv_async_init(&serv->loop, &conn->handles->async, fcgi__on_async);
 }
 
 void fcgi__connection_reset(fcgi_connection_t* conn) {
@@ -290,7 +406,6 @@ void fcgi__connection_reset(fcgi_connection_t* conn) {
   conn->record_state = 0;
   conn->record_length = 0;
 
-  conn->version = 1;
   conn->type = 0;
   conn->request_id = 0;
   conn->content_length = 0;
@@ -301,6 +416,198 @@ void fcgi__connection_reset(fcgi_connection_t* conn) {
 
   conn->app_status = 200;
   conn->proto_status = FCGI_REQUEST_COMPLETE;
+
+  conn->http_state = FCGI_HTTP_STATE_HEAD;
+  conn->http_response_started = false;
+  conn->http_chunked = false;
+  conn->http_body_remaining = 0;
+  fcgi_buffer_reset(&conn->http_pending);
+}
+
+/* Decodes requests into the same states a FastCGI connection goes through,
+ * the params are built from the request line and headers. Returns how much
+ * was used, the rest is kept until the current request is answered or more
+ * of the head arrives. */
+size_t fcgi__http_consume(fcgi_connection_t* conn, const char* data, size_t length) {
+  size_t consumed = 0;
+
+  while (!uv_is_closing((uv_handle_t*)&conn->handles->tcp)) {
+    if (conn->http_state == FCGI_HTTP_STATE_HEAD) {
+      http_request_t request;
+      ssize_t head_length;
+
+      if (consumed == length) break;
+
+      fcgi_buffer_reset(&conn->incoming_buf);
+      head_length = http_request_parse(&request, data + consumed, length - consumed, &conn->incoming_buf);
+      if (head_length <= 0) {
+        fcgi_buffer_reset(&conn->incoming_buf);
+        if (head_length < 0) {
+          fcgi__http_send_error(conn, request.error_status);
+          return length;
+        }
+        break;
+      }
+      consumed += head_length;
+
+      conn->role = FCGI_RESPONDER;
+      conn->flags = request.keep_alive ? FCGI_KEEP_CONN : 0;
+      conn->request_id = 1;
+      conn->stream_stdin = false;
+      conn->in_use = true;
+      conn->app_status = 200;
+      conn->proto_status = FCGI_REQUEST_COMPLETE;
+      conn->http_minor_version = (uint8_t)request.minor_version;
+      conn->http_response_started = false;
+      conn->http_chunked = false;
+      conn->http_body_remaining = request.content_length;
+      conn->http_state = FCGI_HTTP_STATE_BODY;
+
+      if (request.expect_continue && request.content_length > 0) {
+        uv_buf_t buf = uv_buf_init((char*)"HTTP/1.1 100 Continue\r\n\r\n", 25);
+        uv_try_write((uv_stream_t*)&conn->handles->tcp, &buf, 1);
+      }
+
+      /* The params are already in the incoming buffer for BEGIN, it has no
+       * body of its own like the FastCGI record */
+      conn->serv->handler_cb(conn, FCGI_STATE_BEGIN);
+      conn->serv->handler_cb(conn, FCGI_STATE_PARAMS);
+      fcgi_buffer_reset(&conn->incoming_buf);
+    }
+
+    if (conn->http_state == FCGI_HTTP_STATE_BODY) {
+      size_t to_copy = length - consumed;
+      if (to_copy > conn->http_body_remaining) to_copy = conn->http_body_remaining;
+
+      if (to_copy > 0) {
+        fcgi_buffer_append(&conn->incoming_buf, data + consumed, to_copy);
+        consumed += to_copy;
+        conn->http_body_remaining -= to_copy;
+        if (conn->stream_stdin) {
+          conn->serv->handler_cb(conn, FCGI_STATE_STDIN_DATA);
+          fcgi_buffer_reset(&conn->incoming_buf);
+        }
+      }
+
+      if (conn->http_body_remaining > 0) break;
+
+      conn->serv->handler_cb(conn, FCGI_STATE_STDIN);
+      fcgi_buffer_reset(&conn->incoming_buf);
+
+      /* It may have been answered before its body was read */
+      conn->http_state = conn->in_use ? FCGI_HTTP_STATE_WAIT : FCGI_HTTP_STATE_HEAD;
+    }
+
+    if (conn->http_state == FCGI_HTTP_STATE_WAIT) break;
+  }
+
+  return consumed;
+}
+
+/* Parses straight out of the read buffer when nothing is pending, only
+ * what's left over is copied */
+void fcgi__http_read(fcgi_connection_t* conn, const char* data, size_t length) {
+  fcgi_buffer_t* pending = &conn->http_pending;
+
+  if (pending->position < pending->length) {
+    if (length > 0) fcgi_buffer_append(pending, data, length);
+    pending->position += fcgi__http_consume(conn, pending->data + pending->position,
+                                            pending->length - pending->position);
+    if (pending->position == pending->length) fcgi_buffer_reset(pending);
+  } else {
+    size_t consumed = fcgi__http_consume(conn, data, length);
+    fcgi_buffer_reset(pending);
+    if (consumed < length) fcgi_buffer_append(pending, data + consumed, length - consumed);
+  }
+
+  /* Pipelined requests stay in the socket until the response is written */
+  if (conn->http_state == FCGI_HTTP_STATE_WAIT) {
+    fcgi_connection_pause(conn);
+  }
+}
+
+void fcgi__http_send_error(fcgi_connection_t* conn, int status) {
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+  uv_buf_t buf = uv_buf_init(req->to_write, http_error_response(req->to_write, sizeof(req->to_write), status));
+
+  /* Nothing more is read, the connection is closed once this is out */
+  conn->flags = 0;
+  conn->http_state = FCGI_HTTP_STATE_WAIT;
+  fcgi_connection_pause(conn);
+
+  if (uv_write(&req->req, (uv_stream_t*)&conn->handles->tcp, &buf, 1, fcgi__on_http_error_write) != 0) {
+    fcgi__write_req_reset(req);
+    fcgi__connection_close(conn);
+  }
+}
+
+/* Everything in the buffer goes out in one write. The status line, headers
+ * and chunk framing are written around the handler's data rather than
+ * copied together with it. */
+void fcgi__http_write_request_send(fcgi_write_req_t* req) {
+  fcgi_connection_t* conn = req->conn;
+  fcgi_buffer_t* buf = &req->outgoing_buf;
+  char* data = buf->data + buf->position;
+  size_t length = buf->length - buf->position;
+  size_t head_length = 0;
+  bool last = !req->flush;
+  uv_buf_t bufs[3];
+  unsigned int nbufs = 0;
+  int rc;
+
+  if (!conn->http_response_started) {
+    size_t cgi_length = http_cgi_headers_length(data, length);
+    int framing = HTTP_FRAMING_LENGTH;
+
+    /* The length is only known when the whole response is written at once */
+    if (!last) {
+      if (conn->http_minor_version >= 1) {
+        framing = HTTP_FRAMING_CHUNKED;
+      } else {
+        framing = HTTP_FRAMING_CLOSE;
+        conn->flags &= ~FCGI_KEEP_CONN;
+      }
+    }
+
+    head_length = http_response_head(req->to_write, sizeof(req->to_write), conn->app_status,
+                                     data, cgi_length, framing, length - cgi_length,
+                                     (conn->flags & FCGI_KEEP_CONN) != 0);
+    data += cgi_length;
+    length -= cgi_length;
+
+    conn->http_response_started = true;
+    conn->http_chunked = framing == HTTP_FRAMING_CHUNKED;
+  }
+
+  if (conn->http_chunked && length > 0) {
+    head_length += sprintf(req->to_write + head_length, "%zx\r\n", length);
+  }
+
+  if (head_length > 0) {
+    bufs[nbufs++] = uv_buf_init(req->to_write, head_length);
+  }
+  if (length > 0) {
+    bufs[nbufs++] = uv_buf_init(data, length);
+  }
+  if (conn->http_chunked) {
+    if (length > 0) {
+      bufs[nbufs++] = last ? uv_buf_init((char*)"\r\n0\r\n\r\n", 7) : uv_buf_init((char*)"\r\n", 2);
+    } else if (last) {
+      bufs[nbufs++] = uv_buf_init((char*)"0\r\n\r\n", 5);
+    }
+  }
+  if (nbufs == 0) {
+    /* Still completes through the callback, e.g. a flush with no data */
+    bufs[nbufs++] = uv_buf_init(req->to_write, 0);
+  }
+
+  buf->position = buf->length;
+
+  rc = uv_write(&req->req, (uv_stream_t*)&conn->handles->tcp, bufs, nbufs, fcgi__on_http_write);
+  if (rc != 0) {
+    LOGGER_WRITE("Write error %s\n", uv_strerror(rc));
+    fcgi__write_req_reset(req);
+  }
 }
 
 fcgi_connection_t* fcgi__server_get_connection(fcgi_server_t* serv) {
@@ -318,6 +625,7 @@ void fcgi__write_req_init(fcgi_write_req_t* req, fcgi_connection_t* conn) {
   req->conn->free_list = req;
 
   req->type = 0;
+  req->flush = false;
   fcgi__buffer_init(&req->outgoing_buf);
 
   req->req.data = req;
@@ -328,6 +636,7 @@ void fcgi__write_req_reset(fcgi_write_req_t* req) {
   req->conn->free_list = req;
 
   req->type = 0;
+  req->flush = false;
   fcgi_buffer_reset(&req->outgoing_buf);
 }
 
@@ -422,10 +731,21 @@ void fcgi_write_request_send(fcgi_write_req_t* req) {
   fcgi_buffer_t* buf = &req->outgoing_buf;
 
   if (req->conn->is_closed) {
-    if (!req->conn->in_free_list) {
-      fcgi__connection_reset(req->conn);
+    fcgi_connection_t* conn = req->conn;
+    bool flush = req->flush;
+    if (!conn->in_free_list) {
+      fcgi__connection_reset(conn);
     }
     fcgi__write_req_reset(req);
+    if (flush) {
+      /* Let the handler wind down whatever it is streaming */
+      conn->serv->handler_cb(conn, FCGI_STATE_FLUSH);
+    }
+    return;
+  }
+
+  if (req->conn->protocol == FCGI_PROTOCOL_HTTP) {
+    fcgi__http_write_request_send(req);
     return;
   }
 
@@ -433,7 +753,7 @@ void fcgi_write_request_send(fcgi_write_req_t* req) {
   if (remaining > 0) {
     size_t to_copy = FCGI_MAX_RECORD_CONTENT_LENGTH;
    if (remaining < to_copy) to_copy = remaining;
-    to_write[0] = req->conn->version;
+    to_write[0] = FCGI_VERSION_1;
     to_write[1] = req->type;
     to_write[2] = (req->conn->request_id >> 8) & 0xFF;
     to_write[3] = req->conn->request_id & 0x00FF;
@@ -445,13 +765,17 @@ void fcgi_write_request_send(fcgi_write_req_t* req) {
     buf->position += to_copy;
 
     uv_buf_t uvbuf = uv_buf_init(to_write, FCGI_RECORD_HEADER_LENGTH + to_copy);
-    int rc = uv_write(&req->req, (uv_stream_t*)&req->conn->pipe, &uvbuf, 1, fcgi__on_write);
+    int rc = uv_write(&req->req, (uv_stream_t*)&req->conn->handles->pipe, &uvbuf, 1, fcgi__on_write);
     if (rc != 0) {
-      fprintf(stderr, "Write error %s\n", uv_strerror(rc));
+      LOGGER_WRITE("Write error %s\n", uv_strerror(rc));
       fcgi__write_req_reset(req);
     }
+  } else if (req->flush) {
+    fcgi_connection_t* conn = req->conn;
+    fcgi__write_req_reset(req);
+    conn->serv->handler_cb(conn, FCGI_STATE_FLUSH);
   } else if(req->type == FCGI_STDOUT || req->type == FCGI_STDOUT) {
-    to_write[0] = req->conn->version;
+    to_write[0] = FCGI_VERSION_1;
     to_write[1] = req->type;
     to_write[2] = (req->conn->request_id >> 8) & 0xFF;
     to_write[3] = req->conn->request_id & 0x00FF;
@@ -460,9 +784,9 @@ void fcgi_write_request_send(fcgi_write_req_t* req) {
     to_write[6] = 0;
 
     uv_buf_t uvbuf = uv_buf_init(to_write, FCGI_RECORD_HEADER_LENGTH);
-    int rc = uv_write(&req->req, (uv_stream_t*)&req->conn->pipe, &uvbuf, 1, fcgi__on_write_end);
+    int rc = uv_write(&req->req, (uv_stream_t*)&req->conn->handles->pipe, &uvbuf, 1, fcgi__on_write_end);
     if (rc != 0) {
-      fprintf(stderr, "Write error %s\n", uv_strerror(rc));
+      LOGGER_WRITE("Write error %s\n", uv_strerror(rc));
       fcgi__write_req_reset(req);
     }
   } else if (req->type == FCGI_END_REQUEST) {
@@ -473,8 +797,30 @@ void fcgi_write_request_send(fcgi_write_req_t* req) {
   }
 }
 
+void fcgi_write_request_flush(fcgi_write_req_t* req) {
+  req->flush = true;
+  fcgi_write_request_send(req);
+}
+
 void fcgi_connection_notify(fcgi_connection_t* conn) {
-  uv_async_send(&conn->async);
+  uv_async_send(&conn->handles->async);
+}
+
+/* Records already read keep being delivered until the current read buffer
+ * is used up */
+void fcgi_connection_pause(fcgi_connection_t* conn) {
+  if (!conn->is_paused && !conn->is_closed) {
+    uv_read_stop((uv_stream_t*)&conn->handles->pipe);
+    conn->is_paused = true;
+  }
+}
+
+void fcgi_connection_resume(fcgi_connection_t* conn) {
+  if (conn->is_paused && !conn->is_closed) {
+    uv_read_start((uv_stream_t*)&conn->handles->pipe, fcgi__on_alloc,
+                  conn->protocol == FCGI_PROTOCOL_HTTP ? fcgi__on_http_read : fcgi__on_read);
+  }
+  conn->is_paused = false;
 }
 
 void fcgi_connection_end(fcgi_connection_t* conn) {
@@ -482,6 +828,17 @@ void fcgi_connection_end(fcgi_connection_t* conn) {
 
   conn->in_use = false;
 
+  /* The next request on this connection has to be read */
+  fcgi_connection_resume(conn);
+
+  if (conn->protocol == FCGI_PROTOCOL_HTTP) {
+    /* The response was framed as it was written, there's no end record */
+    if ((conn->flags & FCGI_KEEP_CONN) == 0) {
+      fcgi__connection_close(conn);
+    }
+    return;
+  }
+
   fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_END_REQUEST);
 
   to_write[0] = (conn->app_status >> 24) & 0x000000FF;
@@ -490,6 +847,10 @@ void fcgi_connection_end(fcgi_connection_t* conn) {
   to_write[3] = conn->app_status & 0x00000FF;
   to_write[4] = conn->proto_status;
 
+  /* For the next request, BEGIN_REQUEST doesn't set them */
+  conn->app_status = 200;
+  conn->proto_status = FCGI_REQUEST_COMPLETE;
+
   fcgi_buffer_append(&req->outgoing_buf, to_write, FCGI_END_REQUEST_LENGTH);
   fcgi_write_request_send(req);
 }
@@ -534,4 +895,31 @@ int fcgi_server_start(fcgi_server_t* serv, const char* path, fcgi_handler_cb han
   }
 
   uv_run(&serv->loop, UV_RUN_DEFAULT);
+
+  return 0;
+}
+
+int fcgi_server_listen_http(fcgi_server_t* serv, const char* address, int port) {
+  struct sockaddr_in addr;
+  int rc;
+
+  uv_tcp_init(&serv->loop, &serv->http);
+  serv->http.data = serv;
+
+  if ((rc = uv_ip4_addr(address, port, &addr)) != 0) {
+    fprintf(stderr, "Invalid HTTP address %s:%d\n", address, port);
+    return 1;
+  }
+
+  if ((rc = uv_tcp_bind(&serv->http, (const struct sockaddr*)&addr, 0)) != 0) {
+    fprintf(stderr, "HTTP bind error %s\n", uv_strerror(rc));
+    return 1;
+  }
+
+  if ((rc = uv_listen((uv_stream_t*)&serv->http, 128, fcgi__on_http_connection)) != 0) {
+    fprintf(stderr, "HTTP listen error %s\n", uv_strerror(rc));
+    return 1;
+  }
+
+  return 0;
 }
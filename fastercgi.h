@@ -10,6 +10,9 @@
 #define FCGI_MAX_CONNECTIONS 1024
 #define FCGI_RECORD_HEADER_LENGTH 8
 #define FCGI_MAX_RECORD_CONTENT_LENGTH (64 * 1024 - 1)
+#define FCGI_CACHE_LINE_SIZE 64
+
+#define FCGI_VERSION_1 1
 
 #define FCGI_BEGIN_REQUEST       1
 #define FCGI_ABORT_REQUEST       2
@@ -42,6 +45,12 @@
 #define FCGI_STATE_WRITE  5
 #define FCGI_STATE_NOTIFY 6
 #define FCGI_STATE_END    7
+#define FCGI_STATE_FLUSH  8
+#define FCGI_STATE_STDIN_DATA 9
+#define FCGI_STATE_CLOSE 10
+
+#define FCGI_PROTOCOL_FASTCGI 0
+#define FCGI_PROTOCOL_HTTP    1
 
 struct fcgi_server_s;
 
@@ -67,46 +76,80 @@ typedef struct fcgi_write_req_s {
   struct fcgi_write_req_s* next_in_list;
 
   int type;
+  bool flush;
   fcgi_buffer_t outgoing_buf;
   char to_write[FCGI_RECORD_HEADER_LENGTH + FCGI_MAX_RECORD_CONTENT_LENGTH];
 
   uv_write_t req;
 } fcgi_write_req_t;
 
-typedef struct fcgi_connection_s {
-  struct fcgi_server_s* serv;
-  struct fcgi_connection_s* next_in_list;
-
-  bool in_free_list;
-  bool in_use;
-  bool is_closed;
-
-  uv_pipe_t pipe;
+/* The libuv handles are large and only used when something is read or
+ * written, they're kept apart from the connection state so 1024 connections
+ * don't spread it over half a megabyte */
+typedef struct fcgi_connection_handles_s {
+  union {
+    uv_pipe_t pipe;
+    uv_tcp_t tcp; /* HTTP connections */
+  };
   uv_async_t async;
+} fcgi_connection_handles_t;
 
-  void* data;
+#ifndef FCGI_BENCH_COMBINED_LAYOUT
+typedef struct fcgi_connection_s {
+  /* Hot: every field fcgi__on_read() reads or writes, BEGIN_REQUEST
+   * included, is in the first cache line */
+  struct fcgi_server_s* serv;
 
   fcgi_buffer_t incoming_buf;
-  char* to_read;
-
-  int record_state;
-  size_t record_length;
 
+  uint32_t record_length;
   char header_buf[FCGI_RECORD_HEADER_LENGTH];
-  uint8_t version;
-  uint8_t type;
-  uint16_t request_id;
   uint16_t content_length;
-  uint8_t padding_length;
-
+  uint16_t request_id;
   uint16_t role;
+  uint8_t record_state;
+  uint8_t type;
+  uint8_t padding_length;
   uint8_t flags;
 
+  /* Set by the handler to get each STDIN record (FCGI_STATE_STDIN_DATA) as
+   * it arrives instead of the whole body at the end */
+  bool stream_stdin;
+  bool in_use;
+
+  /* Cold: the response status is reset once the previous request ended so
+   * reading the next one doesn't touch it */
   uint32_t app_status;
   uint16_t proto_status;
 
+  bool in_free_list;
+  bool is_closed;
+  bool is_paused;
+
+  struct fcgi_connection_s* next_in_list;
+
+  void* data;
+
+  char* to_read;
+
   fcgi_write_req_t* free_list;
-} fcgi_connection_t;
+
+  fcgi_connection_handles_t* handles;
+
+  /* HTTP connections are decoded into the same records and states as
+   * FastCGI ones, the handler doesn't know the difference */
+  uint8_t protocol;
+  uint8_t http_state;
+  uint8_t http_minor_version;
+  bool http_response_started;
+  bool http_chunked;
+  uint64_t http_body_remaining;
+  fcgi_buffer_t http_pending; /* Read but not parsed yet, e.g. pipelined requests */
+} __attribute__((aligned(FCGI_CACHE_LINE_SIZE))) fcgi_connection_t;
+#else
+/* "make bench" swaps in the old layout it compares against */
+#include "bench_fastercgi.c"
+#endif
 
 typedef void(*fcgi_handler_cb)(fcgi_connection_t* conn, int type);
 
@@ -114,11 +157,15 @@ typedef struct fcgi_server_s {
   uv_loop_t loop;
   uv_signal_t sig;
   uv_pipe_t pipe;
+  uv_tcp_t http;
 
   fcgi_handler_cb handler_cb;
   void* data;
 
   fcgi_connection_t conns[FCGI_MAX_CONNECTIONS];
+#ifndef FCGI_BENCH_COMBINED_LAYOUT
+  fcgi_connection_handles_t handles[FCGI_MAX_CONNECTIONS];
+#endif
   fcgi_connection_t* free_list;
 } fcgi_server_t;
 
@@ -130,11 +177,18 @@ bool fcgi_params_next(fcgi_params_t* params);
 
 fcgi_write_req_t* fcgi_connection_get_write_request(fcgi_connection_t* conn, int type);
 void fcgi_connection_notify(fcgi_connection_t* conn);
+void fcgi_connection_pause(fcgi_connection_t* conn);
+void fcgi_connection_resume(fcgi_connection_t* conn);
 void fcgi_connection_end(fcgi_connection_t* conn);
 
 void fcgi_write_request_send(fcgi_write_req_t* req);
+void fcgi_write_request_flush(fcgi_write_req_t* req);
 
 int fcgi_server_init(fcgi_server_t* serv);
 int fcgi_server_start(fcgi_server_t* serv, const char* path, fcgi_handler_cb handler_cb);
 
+/* Also accepts HTTP/1.1 connections on the address, must be called before
+ * fcgi_server_start() */
+int fcgi_server_listen_http(fcgi_server_t* serv, const char* address, int port);
+
 #endif
@@ -0,0 +1,120 @@
+#include "hedge.h"
+
+/* Delay used until there are enough samples for a meaningful p95 */
+#define HEDGE_DEFAULT_DELAY_MS 10
+#define HEDGE_MIN_SAMPLES 100
+
+/* The p95 is recomputed after this many new samples */
+#define HEDGE_RECOMPUTE_INTERVAL 256
+
+/* The histogram is halved past this many samples so it follows the cluster */
+#define HEDGE_HISTOGRAM_WINDOW (64 * 1024)
+
+#define HEDGE_MAX_TOKENS 10.0
+
+/*****************************************************************************/
+
+static int hedge__bucket(uint64_t latency_us);
+static uint64_t hedge__bucket_upper_us(int bucket);
+static void hedge__recompute(hedge_policy_t* policy, uint64_t total);
+
+/*****************************************************************************/
+
+int hedge__bucket(uint64_t latency_us) {
+  int log2;
+  int bucket;
+
+  if (latency_us < 4) return (int)latency_us;
+
+  log2 = 63 - __builtin_clzll(latency_us);
+  bucket = 4 * (log2 - 1) + (int)((latency_us >> (log2 - 2)) & 3);
+  return bucket < HEDGE_HISTOGRAM_BUCKETS ? bucket : HEDGE_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t hedge__bucket_upper_us(int bucket) {
+  int log2;
+
+  if (bucket < 4) return bucket + 1;
+
+  log2 = bucket / 4 + 1;
+  return ((uint64_t)(4 + bucket % 4 + 1)) << (log2 - 2);
+}
+
+void hedge__recompute(hedge_policy_t* policy, uint64_t total) {
+  uint64_t counts[HEDGE_HISTOGRAM_BUCKETS];
+  uint64_t sum = 0;
+  uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS; ++i) {
+    counts[i] = __atomic_load_n(&policy->counts[i], __ATOMIC_RELAXED);
+    sum += counts[i];
+  }
+
+  if (sum >= HEDGE_MIN_SAMPLES) {
+    for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen * 100 >= sum * 95) break;
+    }
+    /* uv timers have millisecond resolution, round up */
+    policy->delay_ms = (hedge__bucket_upper_us(i) + 999) / 1000;
+  }
+
+  if (total > HEDGE_HISTOGRAM_WINDOW) {
+    for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS; ++i) {
+      __atomic_sub_fetch(&policy->counts[i], counts[i] / 2, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&policy->total, total / 2, __ATOMIC_RELAXED);
+    total -= total / 2;
+  }
+
+  policy->delay_total = total;
+}
+
+/*****************************************************************************/
+
+void hedge_policy_init(hedge_policy_t* policy, bool enabled,
+                       uint64_t fixed_delay_ms, int budget_percent) {
+  int i;
+
+  policy->enabled = enabled;
+  policy->fixed_delay_ms = fixed_delay_ms;
+
+  for (i = 0; i < HEDGE_HISTOGRAM_BUCKETS; ++i) {
+    policy->counts[i] = 0;
+  }
+  policy->total = 0;
+  policy->delay_ms = fixed_delay_ms > 0 ? fixed_delay_ms : HEDGE_DEFAULT_DELAY_MS;
+  policy->delay_total = 0;
+
+  policy->budget = budget_percent / 100.0;
+  policy->tokens = HEDGE_MAX_TOKENS;
+}
+
+void hedge_policy_record(hedge_policy_t* policy, uint64_t latency_ns) {
+  if (policy->fixed_delay_ms > 0) return;
+  __atomic_add_fetch(&policy->counts[hedge__bucket(latency_ns / 1000)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&policy->total, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t hedge_policy_start(hedge_policy_t* policy) {
+  policy->tokens += policy->budget;
+  if (policy->tokens > HEDGE_MAX_TOKENS) {
+    policy->tokens = HEDGE_MAX_TOKENS;
+  }
+
+  if (policy->fixed_delay_ms == 0) {
+    uint64_t total = __atomic_load_n(&policy->total, __ATOMIC_RELAXED);
+    if (total - policy->delay_total >= HEDGE_RECOMPUTE_INTERVAL) {
+      hedge__recompute(policy, total);
+    }
+  }
+
+  return policy->delay_ms;
+}
+
+bool hedge_policy_acquire(hedge_policy_t* policy) {
+  if (policy->tokens < 1.0) return false;
+  policy->tokens -= 1.0;
+  return true;
+}
@@ -0,0 +1,38 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* 4 buckets per power of two of microseconds, up to ~16s */
+#define HEDGE_HISTOGRAM_BUCKETS 96
+
+/* When a read should be sent a second time and whether there's budget left
+ * to do so. Latencies are recorded from any thread, everything else is only
+ * used from the loop thread. */
+typedef struct hedge_policy_s {
+  bool enabled;
+  uint64_t fixed_delay_ms; /* 0 uses the observed p95 */
+
+  uint64_t counts[HEDGE_HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t delay_ms;
+  uint64_t delay_total;
+
+  /* Token bucket, every request adds "budget" tokens and a hedge takes one */
+  double budget;
+  double tokens;
+} hedge_policy_t;
+
+void hedge_policy_init(hedge_policy_t* policy, bool enabled,
+                       uint64_t fixed_delay_ms, int budget_percent);
+
+void hedge_policy_record(hedge_policy_t* policy, uint64_t latency_ns);
+
+/* Counts a request that could be hedged and returns the delay to use */
+uint64_t hedge_policy_start(hedge_policy_t* policy);
+
+/* Returns true if a hedge can be sent now, taking it out of the budget */
+bool hedge_policy_acquire(hedge_policy_t* policy);
+
+#endif
@@ -0,0 +1,337 @@
+#include "http.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_MAX_PARAM_NAME_LENGTH 128
+
+/*****************************************************************************/
+
+static void http__append_param(fcgi_buffer_t* params,
+                               const char* name, size_t name_length,
+                               const char* value, size_t value_length);
+static void http__append_length(fcgi_buffer_t* params, size_t length);
+static size_t http__head_length(const char* data, size_t length);
+static const char* http__line(const char* pos, const char* end, const char** next);
+static bool http__name_is(const char* name, size_t name_length, const char* expected);
+static bool http__has_token(const char* value, size_t value_length, const char* token);
+static void http__put(char* out, size_t capacity, size_t* pos, const char* data, size_t length);
+
+/*****************************************************************************/
+
+void http__append_length(fcgi_buffer_t* params, size_t length) {
+  if (length < 128) {
+    char byte = (char)length;
+    fcgi_buffer_append(params, &byte, 1);
+  } else {
+    char bytes[4];
+    bytes[0] = (char)(((length >> 24) & 0x7F) | 0x80);
+    bytes[1] = (char)((length >> 16) & 0xFF);
+    bytes[2] = (char)((length >> 8) & 0xFF);
+    bytes[3] = (char)(length & 0xFF);
+    fcgi_buffer_append(params, bytes, 4);
+  }
+}
+
+void http__append_param(fcgi_buffer_t* params,
+                        const char* name, size_t name_length,
+                        const char* value, size_t value_length) {
+  http__append_length(params, name_length);
+  http__append_length(params, value_length);
+  fcgi_buffer_append(params, name, name_length);
+  fcgi_buffer_append(params, value, value_length);
+}
+
+/* Up to and including the empty line, bare "\n" line endings are accepted */
+size_t http__head_length(const char* data, size_t length) {
+  size_t i;
+  for (i = 1; i < length; ++i) {
+    if (data[i] != '\n') continue;
+    if (data[i - 1] == '\n') return i + 1;
+    if (i >= 2 && data[i - 1] == '\r' && data[i - 2] == '\n') return i + 1;
+  }
+  return 0;
+}
+
+/* Returns the end of the line's content (before any "\r") and sets "next"
+ * to the start of the following one */
+const char* http__line(const char* pos, const char* end, const char** next) {
+  const char* eol = (const char*)memchr(pos, '\n', end - pos);
+  if (!eol) eol = end;
+  *next = eol < end ? eol + 1 : end;
+  if (eol > pos && eol[-1] == '\r') eol--;
+  return eol;
+}
+
+bool http__name_is(const char* name, size_t name_length, const char* expected) {
+  return strlen(expected) == name_length && strncasecmp(name, expected, name_length) == 0;
+}
+
+/* Comma separated, e.g. "Connection: keep-alive, Upgrade" */
+bool http__has_token(const char* value, size_t value_length, const char* token) {
+  size_t token_length = strlen(token);
+  const char* end = value + value_length;
+  const char* pos = value;
+
+  while (pos < end) {
+    const char* comma = (const char*)memchr(pos, ',', end - pos);
+    const char* token_end = comma ? comma : end;
+    while (pos < token_end && (*pos == ' ' || *pos == '\t')) pos++;
+    while (token_end > pos && (token_end[-1] == ' ' || token_end[-1] == '\t')) token_end--;
+    if ((size_t)(token_end - pos) == token_length &&
+        strncasecmp(pos, token, token_length) == 0) {
+      return true;
+    }
+    if (!comma) break;
+    pos = comma + 1;
+  }
+
+  return false;
+}
+
+/* Overflowing pushes "pos" past the capacity and keeps it there */
+void http__put(char* out, size_t capacity, size_t* pos, const char* data, size_t length) {
+  if (*pos + length > capacity) {
+    *pos = capacity + 1;
+    return;
+  }
+  memcpy(out + *pos, data, length);
+  *pos += length;
+}
+
+/*****************************************************************************/
+
+ssize_t http_request_parse(http_request_t* request, const char* data, size_t length,
+                           fcgi_buffer_t* params) {
+  size_t head_length = http__head_length(data, length);
+  const char* end = data + head_length;
+  const char* pos = data;
+  const char* next;
+  const char* eol;
+  const char* method;
+  const char* target;
+  const char* query;
+  size_t method_length;
+  size_t target_length;
+  bool has_content_length = false;
+
+  request->minor_version = 1;
+  request->keep_alive = true;
+  request->expect_continue = false;
+  request->content_length = 0;
+  request->error_status = 400;
+
+  if (head_length == 0 || head_length > HTTP_MAX_HEAD_LENGTH) {
+    if (head_length > HTTP_MAX_HEAD_LENGTH || length > HTTP_MAX_HEAD_LENGTH) {
+      request->error_status = 431;
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Empty lines before the request line are ignored */
+  while ((eol = http__line(pos, end, &next)) == pos && next < end) {
+    pos = next;
+  }
+
+  /* Request line: METHOD SP target SP HTTP/1.x */
+  method = pos;
+  while (pos < eol && *pos != ' ') pos++;
+  method_length = pos - method;
+  if (pos == eol || method_length == 0) return -1;
+  target = ++pos;
+  while (pos < eol && *pos != ' ') pos++;
+  target_length = pos - target;
+  if (pos == eol || target_length == 0) return -1;
+  pos++;
+
+  if (eol - pos != 8 || strncmp(pos, "HTTP/1.", 7) != 0 ||
+      (pos[7] != '0' && pos[7] != '1')) {
+    request->error_status = 505;
+    return -1;
+  }
+  request->minor_version = pos[7] - '0';
+  request->keep_alive = request->minor_version == 1;
+
+  query = (const char*)memchr(target, '?', target_length);
+
+  http__append_param(params, "REQUEST_METHOD", 14, method, method_length);
+  http__append_param(params, "REQUEST_URI", 11, target, target_length);
+  http__append_param(params, "DOCUMENT_URI", 12, target, query ? (size_t)(query - target) : target_length);
+  http__append_param(params, "QUERY_STRING", 12,
+                     query ? query + 1 : "", query ? (size_t)(target + target_length - query - 1) : 0);
+  http__append_param(params, "SERVER_PROTOCOL", 15, pos, 8);
+
+  for (pos = next; pos < end; pos = next) {
+    const char* name = pos;
+    const char* colon;
+    const char* value;
+    size_t name_length;
+    size_t value_length;
+
+    eol = http__line(pos, end, &next);
+    if (eol == pos) break; /* The empty line */
+
+    /* Folded header lines were deprecated, nothing should send them */
+    if (*pos == ' ' || *pos == '\t') return -1;
+
+    colon = (const char*)memchr(pos, ':', eol - pos);
+    if (!colon || colon == pos) return -1;
+    name_length = colon - name;
+
+    value = colon + 1;
+    while (value < eol && (*value == ' ' || *value == '\t')) value++;
+    value_length = eol - value;
+    while (value_length > 0 && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t')) {
+      value_length--;
+    }
+
+    if (http__name_is(name, name_length, "Content-Length")) {
+      uint64_t content_length = 0;
+      size_t i;
+      if (value_length == 0 || value_length > 18) return -1;
+      for (i = 0; i < value_length; ++i) {
+        if (!isdigit((unsigned char)value[i])) return -1;
+        content_length = content_length * 10 + (value[i] - '0');
+      }
+      if (has_content_length && content_length != request->content_length) return -1;
+      if (!has_content_length) {
+        http__append_param(params, "CONTENT_LENGTH", 14, value, value_length);
+      }
+      request->content_length = content_length;
+      has_content_length = true;
+    } else if (http__name_is(name, name_length, "Content-Type")) {
+      http__append_param(params, "CONTENT_TYPE", 12, value, value_length);
+    } else if (http__name_is(name, name_length, "Transfer-Encoding")) {
+      /* Only bodies with a Content-Length are read */
+      request->error_status = 411;
+      return -1;
+    } else {
+      char param_name[HTTP_MAX_PARAM_NAME_LENGTH];
+      size_t i;
+
+      if (http__name_is(name, name_length, "Connection")) {
+        if (http__has_token(value, value_length, "close")) {
+          request->keep_alive = false;
+        } else if (http__has_token(value, value_length, "keep-alive")) {
+          request->keep_alive = true;
+        }
+      } else if (http__name_is(name, name_length, "Expect")) {
+        request->expect_continue = http__has_token(value, value_length, "100-continue");
+      }
+
+      if (name_length + 5 > sizeof(param_name)) return -1;
+      memcpy(param_name, "HTTP_", 5);
+      for (i = 0; i < name_length; ++i) {
+        char c = name[i];
+        param_name[5 + i] = c == '-' ? '_' : (char)toupper((unsigned char)c);
+      }
+      http__append_param(params, param_name, name_length + 5, value, value_length);
+    }
+  }
+
+  return (ssize_t)head_length;
+}
+
+size_t http_cgi_headers_length(const char* data, size_t length) {
+  size_t head_length = http__head_length(data, length);
+  const char* colon;
+
+  /* A body that happens to contain an empty line isn't headers */
+  if (head_length == 0) return 0;
+  colon = (const char*)memchr(data, ':', head_length);
+  if (!colon || memchr(data, '\n', colon - data)) return 0;
+
+  return head_length;
+}
+
+size_t http_response_head(char* out, size_t capacity, int status,
+                          const char* cgi_headers, size_t cgi_headers_length,
+                          int framing, uint64_t content_length, bool keep_alive) {
+  const char* end = cgi_headers + cgi_headers_length;
+  const char* pos;
+  const char* next;
+  const char* status_line = NULL;
+  size_t status_line_length = 0;
+  size_t written = 0;
+  char temp[64];
+
+  for (pos = cgi_headers; pos < end; pos = next) {
+    const char* eol = http__line(pos, end, &next);
+    if (eol - pos > 7 && strncasecmp(pos, "Status:", 7) == 0) {
+      status_line = pos + 7;
+      while (status_line < eol && *status_line == ' ') status_line++;
+      status_line_length = eol - status_line;
+    }
+  }
+
+  http__put(out, capacity, &written, "HTTP/1.1 ", 9);
+  if (status_line) {
+    http__put(out, capacity, &written, status_line, status_line_length);
+  } else {
+    snprintf(temp, sizeof(temp), "%d %s", status, http_status_reason(status));
+    http__put(out, capacity, &written, temp, strlen(temp));
+  }
+  http__put(out, capacity, &written, "\r\n", 2);
+
+  /* Everything else the handler set is passed through except the headers
+   * that frame the response, those are decided here */
+  for (pos = cgi_headers; pos < end; pos = next) {
+    const char* eol = http__line(pos, end, &next);
+    const char* colon = (const char*)memchr(pos, ':', eol - pos);
+    size_t name_length;
+    if (!colon) continue;
+    name_length = colon - pos;
+    if (http__name_is(pos, name_length, "Status") ||
+        http__name_is(pos, name_length, "Content-Length") ||
+        http__name_is(pos, name_length, "Transfer-Encoding") ||
+        http__name_is(pos, name_length, "Connection")) {
+      continue;
+    }
+    http__put(out, capacity, &written, pos, eol - pos);
+    http__put(out, capacity, &written, "\r\n", 2);
+  }
+
+  if (framing == HTTP_FRAMING_LENGTH) {
+    snprintf(temp, sizeof(temp), "Content-Length: %llu\r\n", (unsigned long long)content_length);
+    http__put(out, capacity, &written, temp, strlen(temp));
+  } else if (framing == HTTP_FRAMING_CHUNKED) {
+    http__put(out, capacity, &written, "Transfer-Encoding: chunked\r\n", 28);
+  }
+  if (!keep_alive) {
+    http__put(out, capacity, &written, "Connection: close\r\n", 19);
+  }
+  http__put(out, capacity, &written, "\r\n", 2);
+
+  return written <= capacity ? written : 0;
+}
+
+size_t http_error_response(char* out, size_t capacity, int status) {
+  int written = snprintf(out, capacity,
+                         "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                         status, http_status_reason(status));
+  return written > 0 && (size_t)written < capacity ? (size_t)written : 0;
+}
+
+const char* http_status_reason(int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "fastercgi.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Longest request line and headers accepted, a request with more is
+ * answered with a 431 */
+#define HTTP_MAX_HEAD_LENGTH (8 * 1024)
+
+enum {
+  HTTP_FRAMING_LENGTH,  /* Content-Length, the whole body is written at once */
+  HTTP_FRAMING_CHUNKED, /* Streamed to an HTTP/1.1 client */
+  HTTP_FRAMING_CLOSE    /* Streamed to an HTTP/1.0 client, ends with the connection */
+};
+
+typedef struct http_request_s {
+  int minor_version;
+  bool keep_alive;
+  bool expect_continue;
+  uint64_t content_length;
+  int error_status; /* Status to answer with when the request is rejected */
+} http_request_t;
+
+/* Parses a request line and headers into the same FastCGI name-value pairs
+ * nginx would send (REQUEST_METHOD, REQUEST_URI, QUERY_STRING, CONTENT_TYPE,
+ * HTTP_* ...), appended to "params". Returns the length of the head once
+ * it's complete, 0 if more data is needed and -1 if the request can't be
+ * served. */
+ssize_t http_request_parse(http_request_t* request, const char* data, size_t length,
+                           fcgi_buffer_t* params);
+
+/* Length of the CGI headers ("Status: ...", "Content-Type: ...") the
+ * handler put in front of its response, including the empty line, or 0 if
+ * there are none */
+size_t http_cgi_headers_length(const char* data, size_t length);
+
+/* Writes the status line and headers of a response, taking the status from
+ * a CGI "Status:" header if there's one. Returns the length written or 0 if
+ * it doesn't fit. */
+size_t http_response_head(char* out, size_t capacity, int status,
+                          const char* cgi_headers, size_t cgi_headers_length,
+                          int framing, uint64_t content_length, bool keep_alive);
+
+/* A complete response without a body, for requests that never reach the
+ * handler */
+size_t http_error_response(char* out, size_t capacity, int status);
+
+const char* http_status_reason(int status);
+
+#endif
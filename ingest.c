@@ -0,0 +1,397 @@
+#include "ingest.h"
+
+#include <string.h>
+
+static const char* ingest__field_names[INGEST_FIELD_COUNT] = {
+  "username", "firstname", "lastname", "password"
+};
+
+typedef struct ingest_cursor_s {
+  const char* pos;
+  const char* end;
+} ingest_cursor_t;
+
+/*****************************************************************************/
+
+static void ingest__begin_row(ingest_parser_t* parser);
+static void ingest__set_field(ingest_parser_t* parser, int field, size_t offset);
+static const char* ingest__finish_row(ingest_parser_t* parser, ingest_row_t* row);
+static const char* ingest__find_row_end(ingest_parser_t* parser, const char* start, const char* end);
+
+static const char* ingest__parse_csv(ingest_parser_t* parser, const char* data, size_t length);
+
+static void ingest__skip_whitespace(ingest_cursor_t* cursor);
+static void ingest__append_utf8(fcgi_buffer_t* buf, uint32_t code_point);
+static int ingest__hex4(const char* pos, uint32_t* value);
+static const char* ingest__parse_json_string(ingest_cursor_t* cursor, fcgi_buffer_t* out);
+static const char* ingest__parse_json(ingest_parser_t* parser, const char* data, size_t length);
+
+/*****************************************************************************/
+
+void ingest__begin_row(ingest_parser_t* parser) {
+  int i;
+  fcgi_buffer_reset(&parser->scratch);
+  for (i = 0; i < INGEST_FIELD_COUNT; ++i) {
+    parser->present[i] = false;
+  }
+}
+
+/* The field is everything appended to scratch since "offset" */
+void ingest__set_field(ingest_parser_t* parser, int field, size_t offset) {
+  parser->offsets[field] = offset;
+  parser->lengths[field] = parser->scratch.length - offset;
+  parser->present[field] = true;
+}
+
+const char* ingest__finish_row(ingest_parser_t* parser, ingest_row_t* row) {
+  int i;
+
+  if (!parser->present[INGEST_FIELD_USERNAME] || parser->lengths[INGEST_FIELD_USERNAME] == 0) {
+    return "Missing username";
+  }
+
+  /* Only now that scratch won't move anymore */
+  for (i = 0; i < INGEST_FIELD_COUNT; ++i) {
+    if (parser->present[i]) {
+      row->fields[i] = cass_string_init2(parser->scratch.data + parser->offsets[i], parser->lengths[i]);
+    } else {
+      row->fields[i] = cass_string_init2("", 0);
+    }
+  }
+
+  return NULL;
+}
+
+/* Returns the newline that ends the row starting at "start" or NULL */
+const char* ingest__find_row_end(ingest_parser_t* parser, const char* start, const char* end) {
+  if (parser->format == INGEST_FORMAT_CSV) {
+    /* Quoted CSV fields can contain newlines */
+    bool quoted = false;
+    const char* pos;
+    for (pos = start; pos < end; ++pos) {
+      if (*pos == '"') {
+        quoted = !quoted;
+      } else if (*pos == '\n' && !quoted) {
+        return pos;
+      }
+    }
+    return NULL;
+  }
+  return (const char*)memchr(start, '\n', end - start);
+}
+
+const char* ingest__parse_csv(ingest_parser_t* parser, const char* data, size_t length) {
+  const char* pos = data;
+  const char* end = data + length;
+  int field = 0;
+
+  ingest__begin_row(parser);
+
+  for (;;) {
+    size_t offset = parser->scratch.length;
+
+    if (pos < end && *pos == '"') {
+      pos++;
+      for (;;) {
+        const char* quote = (const char*)memchr(pos, '"', end - pos);
+        if (!quote) return "Unterminated quoted field";
+        fcgi_buffer_append(&parser->scratch, pos, quote - pos);
+        pos = quote + 1;
+        if (pos < end && *pos == '"') {
+          fcgi_buffer_append(&parser->scratch, "\"", 1);
+          pos++;
+        } else {
+          break;
+        }
+      }
+      if (pos < end && *pos != ',') return "Unexpected character after a quoted field";
+    } else {
+      const char* comma = (const char*)memchr(pos, ',', end - pos);
+      const char* field_end = comma ? comma : end;
+      fcgi_buffer_append(&parser->scratch, pos, field_end - pos);
+      pos = field_end;
+    }
+
+    if (field >= INGEST_FIELD_COUNT) return "Too many fields";
+    ingest__set_field(parser, field++, offset);
+
+    if (pos == end) break;
+    pos++; /* ',' */
+  }
+
+  return NULL;
+}
+
+void ingest__skip_whitespace(ingest_cursor_t* cursor) {
+  while (cursor->pos < cursor->end &&
+         (*cursor->pos == ' ' || *cursor->pos == '\t' || *cursor->pos == '\r')) {
+    cursor->pos++;
+  }
+}
+
+void ingest__append_utf8(fcgi_buffer_t* buf, uint32_t code_point) {
+  char bytes[4];
+  if (code_point < 0x80) {
+    bytes[0] = (char)code_point;
+    fcgi_buffer_append(buf, bytes, 1);
+  } else if (code_point < 0x800) {
+    bytes[0] = (char)(0xC0 | (code_point >> 6));
+    bytes[1] = (char)(0x80 | (code_point & 0x3F));
+    fcgi_buffer_append(buf, bytes, 2);
+  } else if (code_point < 0x10000) {
+    bytes[0] = (char)(0xE0 | (code_point >> 12));
+    bytes[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    bytes[2] = (char)(0x80 | (code_point & 0x3F));
+    fcgi_buffer_append(buf, bytes, 3);
+  } else {
+    bytes[0] = (char)(0xF0 | (code_point >> 18));
+    bytes[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+    bytes[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    bytes[3] = (char)(0x80 | (code_point & 0x3F));
+    fcgi_buffer_append(buf, bytes, 4);
+  }
+}
+
+int ingest__hex4(const char* pos, uint32_t* value) {
+  int i;
+  *value = 0;
+  for (i = 0; i < 4; ++i) {
+    char c = pos[i];
+    *value <<= 4;
+    if (c >= '0' && c <= '9') *value |= c - '0';
+    else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+    else return -1;
+  }
+  return 0;
+}
+
+/* Unescapes the string at the cursor (which is on the opening quote) */
+const char* ingest__parse_json_string(ingest_cursor_t* cursor, fcgi_buffer_t* out) {
+  const char* pos = cursor->pos + 1;
+  const char* end = cursor->end;
+
+  while (pos < end) {
+    const char* run = pos;
+    while (pos < end && *pos != '"' && *pos != '\\') pos++;
+    fcgi_buffer_append(out, run, pos - run);
+
+    if (pos == end) break;
+
+    if (*pos == '"') {
+      cursor->pos = pos + 1;
+      return NULL;
+    }
+
+    if (++pos == end) break;
+    switch (*pos) {
+      case '"': fcgi_buffer_append(out, "\"", 1); break;
+      case '\\': fcgi_buffer_append(out, "\\", 1); break;
+      case '/': fcgi_buffer_append(out, "/", 1); break;
+      case 'b': fcgi_buffer_append(out, "\b", 1); break;
+      case 'f': fcgi_buffer_append(out, "\f", 1); break;
+      case 'n': fcgi_buffer_append(out, "\n", 1); break;
+      case 'r': fcgi_buffer_append(out, "\r", 1); break;
+      case 't': fcgi_buffer_append(out, "\t", 1); break;
+      case 'u':
+        {
+          uint32_t code_point;
+          if (end - pos < 5 || ingest__hex4(pos + 1, &code_point) != 0) {
+            return "Invalid \\u escape";
+          }
+          pos += 4;
+          if (code_point >= 0xD800 && code_point < 0xDC00) {
+            uint32_t low;
+            if (end - pos < 7 || pos[1] != '\\' || pos[2] != 'u' ||
+                ingest__hex4(pos + 3, &low) != 0 || low < 0xDC00 || low >= 0xE000) {
+              return "Invalid surrogate pair";
+            }
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+            pos += 6;
+          }
+          ingest__append_utf8(out, code_point);
+        }
+        break;
+      default:
+        return "Invalid escape";
+    }
+    pos++;
+  }
+
+  return "Unterminated string";
+}
+
+const char* ingest__parse_json(ingest_parser_t* parser, const char* data, size_t length) {
+  ingest_cursor_t cursor;
+  const char* error;
+
+  cursor.pos = data;
+  cursor.end = data + length;
+
+  ingest__begin_row(parser);
+
+  ingest__skip_whitespace(&cursor);
+  if (cursor.pos == cursor.end || *cursor.pos != '{') return "Expected an object";
+  cursor.pos++;
+
+  ingest__skip_whitespace(&cursor);
+  if (cursor.pos < cursor.end && *cursor.pos == '}') {
+    cursor.pos++;
+  } else {
+    for (;;) {
+      size_t key_offset = parser->scratch.length;
+      int field;
+
+      if (cursor.pos == cursor.end || *cursor.pos != '"') return "Expected a key";
+      error = ingest__parse_json_string(&cursor, &parser->scratch);
+      if (error) return error;
+
+      for (field = 0; field < INGEST_FIELD_COUNT; ++field) {
+        size_t key_length = parser->scratch.length - key_offset;
+        if (key_length == strlen(ingest__field_names[field]) &&
+            memcmp(parser->scratch.data + key_offset, ingest__field_names[field], key_length) == 0) {
+          break;
+        }
+      }
+      /* The key itself isn't needed anymore */
+      parser->scratch.length = key_offset;
+
+      ingest__skip_whitespace(&cursor);
+      if (cursor.pos == cursor.end || *cursor.pos != ':') return "Expected ':'";
+      cursor.pos++;
+      ingest__skip_whitespace(&cursor);
+
+      if (cursor.pos < cursor.end && *cursor.pos == '"') {
+        size_t offset = parser->scratch.length;
+        error = ingest__parse_json_string(&cursor, &parser->scratch);
+        if (error) return error;
+        if (field < INGEST_FIELD_COUNT) {
+          ingest__set_field(parser, field, offset);
+        } else {
+          parser->scratch.length = offset;
+        }
+      } else if (cursor.end - cursor.pos >= 4 && memcmp(cursor.pos, "null", 4) == 0) {
+        cursor.pos += 4;
+      } else {
+        return "Expected a string value";
+      }
+
+      ingest__skip_whitespace(&cursor);
+      if (cursor.pos < cursor.end && *cursor.pos == ',') {
+        cursor.pos++;
+        ingest__skip_whitespace(&cursor);
+      } else if (cursor.pos < cursor.end && *cursor.pos == '}') {
+        cursor.pos++;
+        break;
+      } else {
+        return "Expected ',' or '}'";
+      }
+    }
+  }
+
+  ingest__skip_whitespace(&cursor);
+  if (cursor.pos != cursor.end) return "Unexpected data after the object";
+
+  return NULL;
+}
+
+/*****************************************************************************/
+
+int ingest_parse_format(const char* content_type) {
+  return strstr(content_type, "csv") ? INGEST_FORMAT_CSV : INGEST_FORMAT_NDJSON;
+}
+
+void ingest_parser_init(ingest_parser_t* parser, int format) {
+  parser->pending.capacity = 0;
+  parser->pending.data = NULL;
+  parser->scratch.capacity = 0;
+  parser->scratch.data = NULL;
+  ingest_parser_reset(parser, format);
+}
+
+void ingest_parser_destroy(ingest_parser_t* parser) {
+  free(parser->pending.data);
+  free(parser->scratch.data);
+}
+
+void ingest_parser_reset(ingest_parser_t* parser, int format) {
+  parser->format = format;
+  parser->rows = 0;
+  parser->skipping = false;
+  fcgi_buffer_reset(&parser->pending);
+  fcgi_buffer_reset(&parser->scratch);
+}
+
+void ingest_parser_feed(ingest_parser_t* parser, const char* data, size_t length) {
+  fcgi_buffer_t* pending = &parser->pending;
+
+  /* Move what's left of a partial row to the front first */
+  if (pending->position > 0) {
+    memmove(pending->data, pending->data + pending->position, pending->length - pending->position);
+    pending->length -= pending->position;
+    pending->position = 0;
+  }
+
+  fcgi_buffer_append(pending, data, length);
+}
+
+size_t ingest_parser_buffered(const ingest_parser_t* parser) {
+  return parser->pending.length - parser->pending.position;
+}
+
+int ingest_parser_next(ingest_parser_t* parser, bool eof, ingest_row_t* row) {
+  fcgi_buffer_t* pending = &parser->pending;
+
+  for (;;) {
+    const char* start = pending->data + pending->position;
+    const char* end = pending->data + pending->length;
+    const char* row_end;
+    size_t row_length;
+    const char* error;
+
+    if (start == end) return INGEST_NEED_MORE;
+
+    row_end = ingest__find_row_end(parser, start, end);
+    if (!row_end) {
+      if (!eof) {
+        if ((size_t)(end - start) <= INGEST_MAX_ROW_LENGTH) {
+          return INGEST_NEED_MORE;
+        }
+        /* Drop it and everything up to the next line ending */
+        pending->position = pending->length;
+        parser->skipping = true;
+        row->number = ++parser->rows;
+        row->error = "Row too long";
+        return INGEST_ERROR;
+      }
+      row_end = end;
+    }
+
+    pending->position += row_end - start + (row_end < end ? 1 : 0);
+
+    if (parser->skipping) {
+      parser->skipping = false;
+      continue;
+    }
+
+    row_length = row_end - start;
+    if (row_length > 0 && start[row_length - 1] == '\r') row_length--;
+    if (row_length == 0) continue;
+
+    if (parser->format == INGEST_FORMAT_CSV) {
+      error = ingest__parse_csv(parser, start, row_length);
+      if (!error && parser->rows == 0 &&
+          parser->lengths[INGEST_FIELD_USERNAME] == strlen("username") &&
+          memcmp(parser->scratch.data + parser->offsets[INGEST_FIELD_USERNAME], "username", 8) == 0) {
+        continue; /* Header */
+      }
+    } else {
+      error = ingest__parse_json(parser, start, row_length);
+    }
+
+    row->number = ++parser->rows;
+    if (!error) error = ingest__finish_row(parser, row);
+    row->error = error;
+    return error ? INGEST_ERROR : INGEST_ROW;
+  }
+}
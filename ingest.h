@@ -0,0 +1,70 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "fastercgi.h"
+
+#include <cassandra.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Longest row that is buffered while waiting for the rest of it */
+#define INGEST_MAX_ROW_LENGTH (64 * 1024)
+
+enum {
+  INGEST_FORMAT_NDJSON,
+  INGEST_FORMAT_CSV
+};
+
+enum {
+  INGEST_FIELD_USERNAME,
+  INGEST_FIELD_FIRSTNAME,
+  INGEST_FIELD_LASTNAME,
+  INGEST_FIELD_PASSWORD,
+  INGEST_FIELD_COUNT
+};
+
+enum {
+  INGEST_NEED_MORE,
+  INGEST_ROW,
+  INGEST_ERROR
+};
+
+typedef struct ingest_row_s {
+  uint64_t number;
+  CassString fields[INGEST_FIELD_COUNT]; /* Valid until the next call */
+  const char* error;
+} ingest_row_t;
+
+/* Incremental parser for uploaded users, either one JSON object per line
+ * with string fields or CSV rows of username,firstname,lastname,password
+ * (a header row starting with "username" is skipped). Data is fed in as
+ * it arrives and rows come out as soon as they are complete. */
+typedef struct ingest_parser_s {
+  int format;
+  uint64_t rows;
+  bool skipping; /* Inside a row that was too long */
+  fcgi_buffer_t pending;
+  fcgi_buffer_t scratch;
+  size_t offsets[INGEST_FIELD_COUNT];
+  size_t lengths[INGEST_FIELD_COUNT];
+  bool present[INGEST_FIELD_COUNT];
+} ingest_parser_t;
+
+int ingest_parse_format(const char* content_type);
+
+void ingest_parser_init(ingest_parser_t* parser, int format);
+void ingest_parser_destroy(ingest_parser_t* parser);
+void ingest_parser_reset(ingest_parser_t* parser, int format);
+
+void ingest_parser_feed(ingest_parser_t* parser, const char* data, size_t length);
+
+/* Bytes that have been fed but not parsed yet */
+size_t ingest_parser_buffered(const ingest_parser_t* parser);
+
+/* Parses the next row, "eof" means no more data will be fed so a last row
+ * without a line ending is complete */
+int ingest_parser_next(ingest_parser_t* parser, bool eof, ingest_row_t* row);
+
+#endif
@@ -0,0 +1,263 @@
+#include "logger.h"
+
+#include <uv.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOGGER_DRAIN_BUFFER_SIZE (16 * 1024)
+
+typedef struct logger_entry_s {
+  uint64_t sequence;
+  size_t length;
+  char message[LOGGER_MESSAGE_LENGTH];
+} logger_entry_t;
+
+/* Bounded multi-producer queue with a single consumer: a cell's sequence
+ * equals the position it's free for and is one past it once the message is
+ * published */
+typedef struct logger_s {
+  logger_entry_t* entries;
+  uint64_t enqueue_position;
+  uint64_t dequeue_position;
+  uint64_t dropped;
+  logger_site_t* sites;
+  bool running;
+  bool stopping;
+  uv_thread_t thread;
+} logger_t;
+
+static logger_t logger__instance;
+
+/*****************************************************************************/
+
+static bool logger__admit(logger_site_t* site, uint64_t now, uint32_t* suppressed);
+static void logger__drain(logger_t* logger);
+static void logger__push(logger_t* logger, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+static void logger__register(logger_t* logger, logger_site_t* site);
+static void logger__run(void* arg);
+static void logger__summarize(logger_t* logger, uint64_t now);
+static void logger__vpush(logger_t* logger, const char* format, va_list args);
+static void logger__write_all(const char* data, size_t length);
+
+/*****************************************************************************/
+
+/* A site gets LOGGER_SITE_BURST messages per window. The first message of
+ * a new window also collects what the previous one suppressed. */
+bool logger__admit(logger_site_t* site, uint64_t now, uint32_t* suppressed) {
+  uint64_t start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+
+  *suppressed = 0;
+  if (now - start >= LOGGER_SITE_WINDOW_MS &&
+      __atomic_compare_exchange_n(&site->window_start, &start, now,
+                                  false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) <= LOGGER_SITE_BURST) {
+    return true;
+  }
+  __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+/* Messages are written out in as few writes as possible */
+void logger__drain(logger_t* logger) {
+  char out[LOGGER_DRAIN_BUFFER_SIZE];
+  size_t length = 0;
+  uint64_t dropped;
+
+  for (;;) {
+    uint64_t position = logger->dequeue_position;
+    logger_entry_t* entry = &logger->entries[position & (LOGGER_RING_ENTRIES - 1)];
+
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != position + 1) break;
+
+    if (length + entry->length > sizeof(out)) {
+      logger__write_all(out, length);
+      length = 0;
+    }
+    memcpy(out + length, entry->message, entry->length);
+    length += entry->length;
+
+    __atomic_store_n(&entry->sequence, position + LOGGER_RING_ENTRIES, __ATOMIC_RELEASE);
+    logger->dequeue_position = position + 1;
+  }
+
+  dropped = __atomic_exchange_n(&logger->dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0 && length + 128 <= sizeof(out)) {
+    length += snprintf(out + length, sizeof(out) - length,
+                       "%llu log messages dropped, the log ring was full\n",
+                       (unsigned long long)dropped);
+  }
+
+  if (length > 0) {
+    logger__write_all(out, length);
+  }
+}
+
+void logger__push(logger_t* logger, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  logger__vpush(logger, format, args);
+  va_end(args);
+}
+
+void logger__register(logger_t* logger, logger_site_t* site) {
+  if (__atomic_exchange_n(&site->registered, true, __ATOMIC_ACQ_REL)) return;
+
+  site->next_in_list = __atomic_load_n(&logger->sites, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&logger->sites, &site->next_in_list, site,
+                                      false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    /* next_in_list was updated with the current head */
+  }
+}
+
+void logger__run(void* arg) {
+  logger_t* logger = (logger_t*)arg;
+
+  for (;;) {
+    bool stopping = __atomic_load_n(&logger->stopping, __ATOMIC_ACQUIRE);
+    logger__summarize(logger, uv_hrtime() / 1000000);
+    logger__drain(logger);
+    if (stopping) break;
+    usleep(LOGGER_DRAIN_INTERVAL_MS * 1000);
+  }
+}
+
+/* Sites that went quiet still get their summary once the window is over */
+void logger__summarize(logger_t* logger, uint64_t now) {
+  logger_site_t* site = __atomic_load_n(&logger->sites, __ATOMIC_ACQUIRE);
+
+  for (; site; site = site->next_in_list) {
+    uint32_t suppressed;
+    if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) == 0) continue;
+    if (now - __atomic_load_n(&site->window_start, __ATOMIC_RELAXED) < LOGGER_SITE_WINDOW_MS) continue;
+    suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed > 0) {
+      logger__push(logger, "%s:%d: %u similar messages suppressed\n",
+                   site->file, site->line, suppressed);
+    }
+  }
+}
+
+/* Never waits, a message that doesn't fit is counted as dropped */
+void logger__vpush(logger_t* logger, const char* format, va_list args) {
+  uint64_t position = __atomic_load_n(&logger->enqueue_position, __ATOMIC_RELAXED);
+  logger_entry_t* entry;
+  int length;
+
+  for (;;) {
+    int64_t diff;
+    entry = &logger->entries[position & (LOGGER_RING_ENTRIES - 1)];
+    diff = (int64_t)__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) - (int64_t)position;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&logger->enqueue_position, &position, position + 1,
+                                      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_add_fetch(&logger->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      position = __atomic_load_n(&logger->enqueue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  length = vsnprintf(entry->message, LOGGER_MESSAGE_LENGTH, format, args);
+  if (length < 0) {
+    length = 0;
+  } else if (length >= LOGGER_MESSAGE_LENGTH) {
+    length = LOGGER_MESSAGE_LENGTH - 1;
+    entry->message[length - 1] = '\n';
+  }
+  entry->length = length;
+
+  __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+void logger__write_all(const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(STDERR_FILENO, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+/*****************************************************************************/
+
+int logger_start(void) {
+  logger_t* logger = &logger__instance;
+  uint64_t i;
+
+  if (logger->running) return 0;
+
+  logger->entries = (logger_entry_t*)malloc(LOGGER_RING_ENTRIES * sizeof(logger_entry_t));
+  if (!logger->entries) return -1;
+  for (i = 0; i < LOGGER_RING_ENTRIES; ++i) {
+    logger->entries[i].sequence = i;
+  }
+  logger->enqueue_position = 0;
+  logger->dequeue_position = 0;
+  logger->dropped = 0;
+  logger->stopping = false;
+
+  /* Whatever was printed directly shouldn't end up after queued messages */
+  fflush(stderr);
+
+  if (uv_thread_create(&logger->thread, logger__run, logger) != 0) {
+    free(logger->entries);
+    logger->entries = NULL;
+    return -1;
+  }
+  __atomic_store_n(&logger->running, true, __ATOMIC_RELEASE);
+
+  atexit(logger_stop);
+
+  return 0;
+}
+
+void logger_stop(void) {
+  logger_t* logger = &logger__instance;
+
+  if (!__atomic_exchange_n(&logger->running, false, __ATOMIC_ACQ_REL)) return;
+
+  __atomic_store_n(&logger->stopping, true, __ATOMIC_RELEASE);
+  uv_thread_join(&logger->thread);
+}
+
+void logger_write(logger_site_t* site, const char* format, ...) {
+  logger_t* logger = &logger__instance;
+  uint32_t suppressed;
+  va_list args;
+
+  if (!__atomic_load_n(&site->registered, __ATOMIC_RELAXED)) {
+    logger__register(logger, site);
+  }
+
+  if (!logger__admit(site, uv_hrtime() / 1000000, &suppressed)) return;
+
+  va_start(args, format);
+  if (__atomic_load_n(&logger->running, __ATOMIC_ACQUIRE)) {
+    if (suppressed > 0) {
+      logger__push(logger, "%s:%d: %u similar messages suppressed\n",
+                   site->file, site->line, suppressed);
+    }
+    logger__vpush(logger, format, args);
+  } else {
+    if (suppressed > 0) {
+      fprintf(stderr, "%s:%d: %u similar messages suppressed\n", site->file, site->line, suppressed);
+    }
+    vfprintf(stderr, format, args);
+  }
+  va_end(args);
+}
@@ -0,0 +1,46 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LOGGER_RING_ENTRIES 1024 /* Power of two */
+#define LOGGER_MESSAGE_LENGTH 512
+
+/* Each call site may log this many messages per window, the rest are only
+ * counted and reported in a summary line */
+#define LOGGER_SITE_BURST 10
+#define LOGGER_SITE_WINDOW_MS 1000
+
+#define LOGGER_DRAIN_INTERVAL_MS 10
+
+/* One per LOGGER_WRITE() call site, registered the first time it logs */
+typedef struct logger_site_s {
+  const char* file;
+  int line;
+  bool registered;
+  uint64_t window_start;
+  uint32_t count;
+  uint32_t suppressed;
+  struct logger_site_s* next_in_list;
+} logger_site_t;
+
+/* Logs to stderr from any thread without blocking on the write: messages
+ * are formatted into a lock-free ring and written out by a background
+ * thread. Before logger_start() (and after logger_stop()) it writes
+ * directly. */
+#define LOGGER_WRITE(...) do {                                         \
+  static logger_site_t logger__site = { __FILE__, __LINE__, false, 0, 0, 0, NULL }; \
+  logger_write(&logger__site, __VA_ARGS__);                           \
+} while (0)
+
+int logger_start(void);
+
+/* Writes out what's left in the ring, also registered with atexit() */
+void logger_stop(void);
+
+void logger_write(logger_site_t* site, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#endif
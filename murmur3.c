@@ -0,0 +1,96 @@
+#include "murmur3.h"
+
+#include <string.h>
+
+#define MURMUR3_C1 0x87c37b91114253d5ULL
+#define MURMUR3_C2 0x4cf5ad432745937fULL
+
+/*****************************************************************************/
+
+static uint64_t murmur3__rotl(uint64_t x, int r);
+static uint64_t murmur3__fmix(uint64_t k);
+static uint64_t murmur3__block(const char* data);
+
+/*****************************************************************************/
+
+uint64_t murmur3__rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t murmur3__fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/* Little-endian whatever the host is */
+uint64_t murmur3__block(const char* data) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  return (uint64_t)bytes[0] | ((uint64_t)bytes[1] << 8) |
+         ((uint64_t)bytes[2] << 16) | ((uint64_t)bytes[3] << 24) |
+         ((uint64_t)bytes[4] << 32) | ((uint64_t)bytes[5] << 40) |
+         ((uint64_t)bytes[6] << 48) | ((uint64_t)bytes[7] << 56);
+}
+
+/*****************************************************************************/
+
+int64_t murmur3_token(const char* key, size_t length) {
+  size_t blocks = length / 16;
+  const char* tail = key + blocks * 16;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  size_t i;
+
+  for (i = 0; i < blocks; ++i) {
+    k1 = murmur3__block(key + i * 16);
+    k2 = murmur3__block(key + i * 16 + 8);
+
+    k1 *= MURMUR3_C1; k1 = murmur3__rotl(k1, 31); k1 *= MURMUR3_C2; h1 ^= k1;
+    h1 = murmur3__rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= MURMUR3_C2; k2 = murmur3__rotl(k2, 33); k2 *= MURMUR3_C1; h2 ^= k2;
+    h2 = murmur3__rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  /* Cassandra reads the tail as signed bytes, every case falls through */
+  k1 = 0;
+  k2 = 0;
+  switch (length & 15) {
+    case 15: k2 ^= (uint64_t)(int64_t)(int8_t)tail[14] << 48;
+    case 14: k2 ^= (uint64_t)(int64_t)(int8_t)tail[13] << 40;
+    case 13: k2 ^= (uint64_t)(int64_t)(int8_t)tail[12] << 32;
+    case 12: k2 ^= (uint64_t)(int64_t)(int8_t)tail[11] << 24;
+    case 11: k2 ^= (uint64_t)(int64_t)(int8_t)tail[10] << 16;
+    case 10: k2 ^= (uint64_t)(int64_t)(int8_t)tail[9] << 8;
+    case 9:  k2 ^= (uint64_t)(int64_t)(int8_t)tail[8];
+      k2 *= MURMUR3_C2; k2 = murmur3__rotl(k2, 33); k2 *= MURMUR3_C1; h2 ^= k2;
+    case 8: k1 ^= (uint64_t)(int64_t)(int8_t)tail[7] << 56;
+    case 7: k1 ^= (uint64_t)(int64_t)(int8_t)tail[6] << 48;
+    case 6: k1 ^= (uint64_t)(int64_t)(int8_t)tail[5] << 40;
+    case 5: k1 ^= (uint64_t)(int64_t)(int8_t)tail[4] << 32;
+    case 4: k1 ^= (uint64_t)(int64_t)(int8_t)tail[3] << 24;
+    case 3: k1 ^= (uint64_t)(int64_t)(int8_t)tail[2] << 16;
+    case 2: k1 ^= (uint64_t)(int64_t)(int8_t)tail[1] << 8;
+    case 1: k1 ^= (uint64_t)(int64_t)(int8_t)tail[0];
+      k1 *= MURMUR3_C1; k1 = murmur3__rotl(k1, 31); k1 *= MURMUR3_C2; h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = murmur3__fmix(h1);
+  h2 = murmur3__fmix(h2);
+
+  h1 += h2;
+
+  /* The minimum is reserved for the ring's start */
+  return (int64_t)h1 == INT64_MIN ? INT64_MAX : (int64_t)h1;
+}
@@ -0,0 +1,12 @@
+#ifndef MURMUR3_H
+#define MURMUR3_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The token Cassandra's Murmur3Partitioner gives a partition key: the first
+ * half of its MurmurHash3 x64 128-bit hash. Like Cassandra the tail bytes
+ * are sign-extended. */
+int64_t murmur3_token(const char* key, size_t length);
+
+#endif
@@ -0,0 +1,245 @@
+#include "negative_cache.h"
+
+#include <string.h>
+
+#define NEGATIVE_CACHE_BITS_PER_ENTRY 16
+
+/*****************************************************************************/
+
+static uint64_t negative_cache__hash(const char* key, size_t key_length);
+static uint64_t negative_cache__now_ms();
+static size_t negative_cache__next_pow2(size_t n);
+
+static uint32_t* negative_cache__get_generation(negative_cache_t* cache, uint64_t hash);
+static negative_cache_block_t* negative_cache__get_block(negative_cache_t* cache, uint64_t hash);
+static bool negative_cache__bloom_contains(negative_cache_t* cache, uint64_t hash);
+static void negative_cache__bloom_add(negative_cache_t* cache, uint64_t hash);
+static void negative_cache__bloom_rebuild(negative_cache_t* cache);
+
+static negative_cache_entry_t* negative_cache__find(negative_cache_t* cache, uint64_t hash,
+                                                    const char* key, size_t key_length);
+
+/*****************************************************************************/
+
+uint64_t negative_cache__hash(const char* key, size_t key_length) {
+  /* FNV-1a, never 0 so that 0 can mark empty entries */
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t i;
+  for (i = 0; i < key_length; ++i) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash ? hash : 1;
+}
+
+uint64_t negative_cache__now_ms() {
+  return uv_hrtime() / 1000000;
+}
+
+size_t negative_cache__next_pow2(size_t n) {
+  size_t result = 1;
+  while (result < n) result <<= 1;
+  return result;
+}
+
+uint32_t* negative_cache__get_generation(negative_cache_t* cache, uint64_t hash) {
+  return &cache->generations[(hash >> 16) & (NEGATIVE_CACHE_GENERATIONS - 1)];
+}
+
+negative_cache_block_t* negative_cache__get_block(negative_cache_t* cache, uint64_t hash) {
+  return &cache->blocks[(hash >> 32) & cache->block_mask];
+}
+
+bool negative_cache__bloom_contains(negative_cache_t* cache, uint64_t hash) {
+  negative_cache_block_t* block = negative_cache__get_block(cache, hash);
+  uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+  int i;
+  for (i = 0; i < 8; ++i) {
+    uint64_t mask = 1ULL << ((bits >> (i * 6)) & 63);
+    if ((__atomic_load_n(&block->words[i], __ATOMIC_RELAXED) & mask) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void negative_cache__bloom_add(negative_cache_t* cache, uint64_t hash) {
+  negative_cache_block_t* block = negative_cache__get_block(cache, hash);
+  uint64_t bits = hash * 0x9E3779B97F4A7C15ULL;
+  int i;
+  for (i = 0; i < 8; ++i) {
+    uint64_t mask = 1ULL << ((bits >> (i * 6)) & 63);
+    __atomic_fetch_or(&block->words[i], mask, __ATOMIC_RELAXED);
+  }
+}
+
+/* Bloom filters can't forget so once as many keys as the table holds went
+ * through it's rebuilt from the live entries. The table can be full of live
+ * ones, they don't count towards the next rebuild or it would happen on
+ * nearly every put. Must be called with the mutex held. */
+void negative_cache__bloom_rebuild(negative_cache_t* cache) {
+  size_t i;
+  uint64_t now = negative_cache__now_ms();
+
+  for (i = 0; i <= cache->block_mask; ++i) {
+    int j;
+    for (j = 0; j < 8; ++j) {
+      __atomic_store_n(&cache->blocks[i].words[j], 0, __ATOMIC_RELAXED);
+    }
+  }
+
+  cache->additions = 0;
+  for (i = 0; i <= cache->entry_mask; ++i) {
+    negative_cache_entry_t* entry = &cache->entries[i];
+    if (entry->hash != 0 && entry->expires_at > now) {
+      negative_cache__bloom_add(cache, entry->hash);
+    }
+  }
+}
+
+negative_cache_entry_t* negative_cache__find(negative_cache_t* cache, uint64_t hash,
+                                             const char* key, size_t key_length) {
+  size_t i;
+  for (i = 0; i < NEGATIVE_CACHE_PROBE_LENGTH; ++i) {
+    negative_cache_entry_t* entry = &cache->entries[(hash + i) & cache->entry_mask];
+    if (entry->hash == hash &&
+        entry->key_length == key_length &&
+        memcmp(entry->key, key, key_length) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*****************************************************************************/
+
+int negative_cache_init(negative_cache_t* cache, size_t capacity, uint64_t ttl_ms) {
+  cache->enabled = capacity > 0;
+  cache->ttl_ms = ttl_ms;
+
+  if (!cache->enabled) return 0;
+
+  size_t entry_count = negative_cache__next_pow2(capacity);
+  if (entry_count < NEGATIVE_CACHE_PROBE_LENGTH) entry_count = NEGATIVE_CACHE_PROBE_LENGTH;
+
+  size_t block_count = negative_cache__next_pow2((entry_count * NEGATIVE_CACHE_BITS_PER_ENTRY) / 512);
+  if (block_count < 1) block_count = 1;
+
+  if (posix_memalign((void**)&cache->blocks, 64, block_count * sizeof(negative_cache_block_t)) != 0) {
+    cache->enabled = false;
+    return -1;
+  }
+  memset(cache->blocks, 0, block_count * sizeof(negative_cache_block_t));
+  cache->block_mask = block_count - 1;
+  cache->additions = 0;
+
+  uv_mutex_init(&cache->mutex);
+  cache->entries = (negative_cache_entry_t*)calloc(entry_count, sizeof(negative_cache_entry_t));
+  cache->entry_mask = entry_count - 1;
+  memset(cache->generations, 0, sizeof(cache->generations));
+
+  return 0;
+}
+
+void negative_cache_destroy(negative_cache_t* cache) {
+  if (!cache->enabled) return;
+  free(cache->blocks);
+  free(cache->entries);
+  uv_mutex_destroy(&cache->mutex);
+  cache->enabled = false;
+}
+
+bool negative_cache_contains(negative_cache_t* cache, const char* key, size_t key_length) {
+  if (!cache->enabled || key_length > NEGATIVE_CACHE_MAX_KEY_LENGTH) return false;
+
+  uint64_t hash = negative_cache__hash(key, key_length);
+  if (!negative_cache__bloom_contains(cache, hash)) {
+    return false;
+  }
+
+  bool found = false;
+
+  uv_mutex_lock(&cache->mutex);
+  negative_cache_entry_t* entry = negative_cache__find(cache, hash, key, key_length);
+  if (entry) {
+    if (entry->expires_at > negative_cache__now_ms()) {
+      found = true;
+    } else {
+      entry->hash = 0;
+    }
+  }
+  uv_mutex_unlock(&cache->mutex);
+
+  return found;
+}
+
+uint32_t negative_cache_generation(negative_cache_t* cache, const char* key, size_t key_length) {
+  if (!cache->enabled || key_length > NEGATIVE_CACHE_MAX_KEY_LENGTH) return 0;
+
+  uint64_t hash = negative_cache__hash(key, key_length);
+  return __atomic_load_n(negative_cache__get_generation(cache, hash), __ATOMIC_ACQUIRE);
+}
+
+void negative_cache_put(negative_cache_t* cache, const char* key, size_t key_length,
+                        uint32_t generation) {
+  if (!cache->enabled || key_length > NEGATIVE_CACHE_MAX_KEY_LENGTH) return;
+
+  uint64_t hash = negative_cache__hash(key, key_length);
+  uint64_t now = negative_cache__now_ms();
+  size_t i;
+
+  uv_mutex_lock(&cache->mutex);
+
+  /* An insert finished while the key was being looked up */
+  if (*negative_cache__get_generation(cache, hash) != generation) {
+    uv_mutex_unlock(&cache->mutex);
+    return;
+  }
+
+  /* Reuse the same key's entry, otherwise an empty or expired one, otherwise
+   * the one closest to expiring */
+  negative_cache_entry_t* entry = negative_cache__find(cache, hash, key, key_length);
+  for (i = 0; !entry && i < NEGATIVE_CACHE_PROBE_LENGTH; ++i) {
+    negative_cache_entry_t* candidate = &cache->entries[(hash + i) & cache->entry_mask];
+    if (candidate->hash == 0 || candidate->expires_at <= now) {
+      entry = candidate;
+    }
+  }
+  if (!entry) {
+    entry = &cache->entries[hash & cache->entry_mask];
+    for (i = 1; i < NEGATIVE_CACHE_PROBE_LENGTH; ++i) {
+      negative_cache_entry_t* candidate = &cache->entries[(hash + i) & cache->entry_mask];
+      if (candidate->expires_at < entry->expires_at) {
+        entry = candidate;
+      }
+    }
+  }
+
+  entry->hash = hash;
+  entry->expires_at = now + cache->ttl_ms;
+  entry->key_length = key_length;
+  memcpy(entry->key, key, key_length);
+
+  if (++cache->additions > cache->entry_mask + 1) {
+    negative_cache__bloom_rebuild(cache);
+  } else {
+    negative_cache__bloom_add(cache, hash);
+  }
+
+  uv_mutex_unlock(&cache->mutex);
+}
+
+void negative_cache_invalidate(negative_cache_t* cache, const char* key, size_t key_length) {
+  if (!cache->enabled || key_length > NEGATIVE_CACHE_MAX_KEY_LENGTH) return;
+
+  /* No Bloom filter shortcut here, it could be in the middle of a rebuild */
+  uint64_t hash = negative_cache__hash(key, key_length);
+
+  uv_mutex_lock(&cache->mutex);
+  negative_cache_entry_t* entry = negative_cache__find(cache, hash, key, key_length);
+  if (entry) {
+    entry->hash = 0;
+  }
+  __atomic_add_fetch(negative_cache__get_generation(cache, hash), 1, __ATOMIC_RELEASE);
+  uv_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,56 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NEGATIVE_CACHE_MAX_KEY_LENGTH 48
+#define NEGATIVE_CACHE_PROBE_LENGTH 8
+#define NEGATIVE_CACHE_GENERATIONS 1024
+
+typedef struct negative_cache_block_s {
+  uint64_t words[8];
+} __attribute__((aligned(64))) negative_cache_block_t;
+
+typedef struct negative_cache_entry_s {
+  uint64_t hash;
+  uint64_t expires_at;
+  uint8_t key_length;
+  char key[NEGATIVE_CACHE_MAX_KEY_LENGTH];
+} negative_cache_entry_t;
+
+/* Keys known not to exist. A blocked Bloom filter (one cache line per key)
+ * lets the common "not negative" case skip the lock entirely, the exact TTL
+ * set behind it is the authority and is what inserts invalidate. */
+typedef struct negative_cache_s {
+  bool enabled;
+  uint64_t ttl_ms;
+
+  negative_cache_block_t* blocks;
+  size_t block_mask;
+  size_t additions; /* Puts since the filter was last rebuilt */
+
+  uv_mutex_t mutex;
+  negative_cache_entry_t* entries;
+  size_t entry_mask;
+
+  /* Bumped by every invalidate, per group of keys, so a read that started
+   * before an insert can't put the key back once the insert is done */
+  uint32_t generations[NEGATIVE_CACHE_GENERATIONS];
+} negative_cache_t;
+
+int negative_cache_init(negative_cache_t* cache, size_t capacity, uint64_t ttl_ms);
+void negative_cache_destroy(negative_cache_t* cache);
+
+bool negative_cache_contains(negative_cache_t* cache, const char* key, size_t key_length);
+/* Read before the key is looked up in the cluster, the put is skipped if
+ * the key was invalidated since */
+uint32_t negative_cache_generation(negative_cache_t* cache, const char* key, size_t key_length);
+void negative_cache_put(negative_cache_t* cache, const char* key, size_t key_length,
+                        uint32_t generation);
+void negative_cache_invalidate(negative_cache_t* cache, const char* key, size_t key_length);
+
+#endif
@@ -0,0 +1,237 @@
+#include "placement.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define PLACEMENT_MAX_NODES 64
+
+/*****************************************************************************/
+
+static bool placement__parse_cpus(const char* str, cpu_set_t* cpus);
+static void placement__format_cpus(const cpu_set_t* cpus, char* str, size_t size);
+static int placement__first_cpu(const cpu_set_t* cpus);
+static int placement__cpu_node(int cpu);
+static bool placement__node_cpus(int node, cpu_set_t* cpus);
+static int placement__bind(const cpu_set_t* cpus, bool prefer_local);
+
+/*****************************************************************************/
+
+bool placement__parse_cpus(const char* str, cpu_set_t* cpus) {
+  const char* pos = str;
+
+  CPU_ZERO(cpus);
+  while (*pos != '\0' && *pos != '\n') {
+    char* end;
+    long first = strtol(pos, &end, 10);
+    long last = first;
+    long cpu;
+
+    if (end == pos || first < 0) return false;
+    pos = end;
+    if (*pos == '-') {
+      pos++;
+      last = strtol(pos, &end, 10);
+      if (end == pos || last < first) return false;
+      pos = end;
+    }
+    if (last >= CPU_SETSIZE) return false;
+
+    for (cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, cpus);
+    }
+
+    if (*pos == ',') pos++;
+  }
+
+  return CPU_COUNT(cpus) > 0;
+}
+
+void placement__format_cpus(const cpu_set_t* cpus, char* str, size_t size) {
+  size_t length = 0;
+  int cpu = 0;
+
+  str[0] = '\0';
+  while (cpu < CPU_SETSIZE) {
+    int last;
+
+    if (!CPU_ISSET(cpu, cpus)) {
+      cpu++;
+      continue;
+    }
+
+    last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) last++;
+
+    if (length < size) {
+      if (last == cpu) {
+        length += snprintf(str + length, size - length, "%s%d", length > 0 ? "," : "", cpu);
+      } else {
+        length += snprintf(str + length, size - length, "%s%d-%d", length > 0 ? "," : "", cpu, last);
+      }
+    }
+    cpu = last + 1;
+  }
+}
+
+int placement__first_cpu(const cpu_set_t* cpus) {
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, cpus)) return cpu;
+  }
+  return -1;
+}
+
+bool placement__node_cpus(int node, cpu_set_t* cpus) {
+  char path[128];
+  char line[4096];
+  FILE* file;
+  bool parsed;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  file = fopen(path, "r");
+  if (!file) return false;
+
+  parsed = fgets(line, sizeof(line), file) != NULL && placement__parse_cpus(line, cpus);
+  fclose(file);
+  return parsed;
+}
+
+/* -1 if the kernel doesn't expose the topology (no NUMA) */
+int placement__cpu_node(int cpu) {
+  cpu_set_t cpus;
+  int node;
+
+  for (node = 0; node < PLACEMENT_MAX_NODES; ++node) {
+    if (placement__node_cpus(node, &cpus) && CPU_ISSET(cpu, &cpus)) {
+      return node;
+    }
+  }
+  return -1;
+}
+
+int placement__bind(const cpu_set_t* cpus, bool prefer_local) {
+  int node = prefer_local ? placement__cpu_node(placement__first_cpu(cpus)) : -1;
+  int rc;
+
+  rc = sched_setaffinity(0, sizeof(cpu_set_t), cpus);
+  if (rc != 0) {
+    fprintf(stderr, "Unable to set CPU affinity: %s\n", strerror(errno));
+    return rc;
+  }
+
+  if (node >= 0) {
+    unsigned long nodemask = 1UL << node;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, PLACEMENT_MAX_NODES + 1) != 0) {
+      /* Not fatal, memory just isn't guaranteed to be local */
+      fprintf(stderr, "Unable to prefer memory from node %d: %s\n", node, strerror(errno));
+    }
+  } else {
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+  }
+
+  return 0;
+}
+
+/*****************************************************************************/
+
+void placement_init(placement_t* placement) {
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &placement->initial_cpus) != 0) {
+    CPU_ZERO(&placement->initial_cpus);
+  }
+  CPU_ZERO(&placement->loop_cpus);
+  CPU_ZERO(&placement->io_cpus);
+  placement->has_loop_cpus = false;
+  placement->has_io_cpus = false;
+}
+
+bool placement_set(placement_t* placement, const char* name, const char* value) {
+  if (strcmp(name, "loop") == 0) {
+    placement->has_loop_cpus = placement__parse_cpus(value, &placement->loop_cpus);
+    return placement->has_loop_cpus;
+  } else if (strcmp(name, "io") == 0) {
+    placement->has_io_cpus = placement__parse_cpus(value, &placement->io_cpus);
+    return placement->has_io_cpus;
+  }
+  return false;
+}
+
+int placement_auto(placement_t* placement, int num_threads_io) {
+  cpu_set_t available;
+  int cpu;
+  int count = 0;
+
+  /* Without NUMA everything the process may run on is "node 0" */
+  if (placement__node_cpus(0, &available)) {
+    CPU_AND(&available, &available, &placement->initial_cpus);
+  } else {
+    CPU_OR(&available, &placement->initial_cpus, &placement->initial_cpus);
+  }
+  if (CPU_COUNT(&available) == 0) {
+    fprintf(stderr, "Unable to read the CPU topology\n");
+    return -1;
+  }
+
+  CPU_ZERO(&placement->loop_cpus);
+  CPU_ZERO(&placement->io_cpus);
+
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &available)) continue;
+    if (count == 0) {
+      CPU_SET(cpu, &placement->loop_cpus);
+    } else if (count <= num_threads_io) {
+      CPU_SET(cpu, &placement->io_cpus);
+    }
+    count++;
+  }
+
+  placement->has_loop_cpus = true;
+  /* A single CPU is shared by everything */
+  if (CPU_COUNT(&placement->io_cpus) == 0) {
+    CPU_OR(&placement->io_cpus, &placement->io_cpus, &placement->loop_cpus);
+  }
+  placement->has_io_cpus = true;
+
+  return 0;
+}
+
+int placement_bind_loop(const placement_t* placement) {
+  if (!placement->has_loop_cpus) return 0;
+  return placement__bind(&placement->loop_cpus, true);
+}
+
+/* Without an IO placement the driver's threads are left free to run
+ * anywhere, they mustn't inherit the loop's */
+int placement_bind_io(const placement_t* placement) {
+  if (placement->has_io_cpus) {
+    return placement__bind(&placement->io_cpus, true);
+  } else if (placement->has_loop_cpus && CPU_COUNT(&placement->initial_cpus) > 0) {
+    return placement__bind(&placement->initial_cpus, false);
+  }
+  return 0;
+}
+
+void placement_report(const placement_t* placement, FILE* file) {
+  char cpus[256];
+
+  if (placement->has_loop_cpus) {
+    placement__format_cpus(&placement->loop_cpus, cpus, sizeof(cpus));
+    fprintf(file, "Loop thread on CPUs %s (node %d)\n", cpus,
+            placement__cpu_node(placement__first_cpu(&placement->loop_cpus)));
+  }
+  if (placement->has_io_cpus) {
+    placement__format_cpus(&placement->io_cpus, cpus, sizeof(cpus));
+    fprintf(file, "Driver IO threads on CPUs %s (node %d)\n", cpus,
+            placement__cpu_node(placement__first_cpu(&placement->io_cpus)));
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Which CPUs the loop thread and the driver's IO threads run on. The driver
+ * has no hook for its threads, they inherit the mask (and memory policy) of
+ * the thread that connects the session, so the loop thread borrows the IO
+ * placement for the duration of cass_session_connect(). Memory is preferred
+ * from the node of each set's first CPU, pools allocated and touched on the
+ * loop thread after placement_bind_loop() end up local to it. */
+typedef struct placement_s {
+  cpu_set_t initial_cpus; /* What the process was started with */
+  cpu_set_t loop_cpus;
+  cpu_set_t io_cpus;
+  bool has_loop_cpus;
+  bool has_io_cpus;
+} placement_t;
+
+void placement_init(placement_t* placement);
+
+/* "loop" or "io" with a CPU list such as "0-3,8" */
+bool placement_set(placement_t* placement, const char* name, const char* value);
+
+/* Loop thread on the first CPU of node 0, IO threads on the following ones */
+int placement_auto(placement_t* placement, int num_threads_io);
+
+int placement_bind_loop(const placement_t* placement);
+int placement_bind_io(const placement_t* placement);
+
+void placement_report(const placement_t* placement, FILE* file);
+
+#endif
@@ -12,8 +12,9 @@ static const char _request_uri_actions[] = {
 	0, 1, 0, 1, 1, 1, 2, 1, 
 	3, 1, 4, 1, 5, 1, 6, 1, 
 	7, 1, 8, 1, 9, 1, 10, 1, 
-	11, 1, 12, 2, 1, 8, 2, 1, 
-	9, 2, 1, 10, 2, 1, 11
+	11, 1, 12, 1, 13, 1, 14, 1, 
+	15, 2, 1, 8, 2, 1, 9, 2, 
+	1, 10, 2, 1, 11
 };
 
 static const char _request_uri_key_offsets[] = {
@@ -21,11 +22,12 @@ static const char _request_uri_key_offsets[] = {
 	8, 9, 10, 11, 12, 13, 14, 15, 
 	16, 17, 18, 19, 20, 21, 22, 23, 
 	24, 25, 26, 27, 28, 29, 30, 31, 
-	32, 33, 35, 36, 37, 38, 39, 40, 
-	41, 42, 43, 44, 45, 46, 47, 48, 
-	49, 50, 51, 52, 53, 54, 55, 56, 
-	57, 58, 60, 61, 65, 66, 67, 70, 
-	73, 74, 77, 78, 81, 84, 85, 88
+	32, 33, 34, 35, 36, 37, 38, 39, 
+	40, 41, 42, 43, 44, 45, 46, 47, 
+	48, 49, 50, 51, 52, 53, 54, 55, 
+	56, 57, 58, 59, 64, 65, 66, 67, 
+	70, 71, 74, 77, 78, 81, 82, 83, 
+	86, 87, 90, 93, 94, 97, 98
 };
 
 static const char _request_uri_trans_keys[] = {
@@ -33,14 +35,15 @@ static const char _request_uri_trans_keys[] = {
 	114, 101, 112, 97, 114, 101, 100, 45, 
 	115, 116, 97, 116, 101, 109, 101, 110, 
 	116, 115, 47, 117, 115, 101, 114, 115, 
-	47, 48, 57, 105, 109, 112, 108, 101, 
-	45, 115, 116, 97, 116, 101, 109, 101, 
-	110, 116, 115, 47, 117, 115, 101, 114, 
-	115, 47, 48, 57, 47, 47, 99, 112, 
-	115, 47, 47, 47, 48, 57, 47, 48, 
-	57, 47, 47, 48, 57, 47, 47, 48, 
-	57, 47, 48, 57, 47, 47, 48, 57, 
-	47, 0
+	105, 109, 112, 108, 101, 45, 115, 116, 
+	97, 116, 101, 109, 101, 110, 116, 115, 
+	47, 117, 115, 101, 114, 115, 114, 97, 
+	99, 101, 47, 47, 99, 112, 115, 116, 
+	47, 47, 47, 47, 48, 57, 47, 47, 
+	48, 57, 47, 48, 57, 47, 47, 48, 
+	57, 47, 47, 47, 48, 57, 47, 47, 
+	48, 57, 47, 48, 57, 47, 47, 48, 
+	57, 47, 47, 0
 };
 
 static const char _request_uri_single_lengths[] = {
@@ -48,11 +51,12 @@ static const char _request_uri_single_lengths[] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 
 	1, 1, 1, 1, 1, 1, 1, 1, 
 	1, 1, 1, 1, 1, 1, 1, 1, 
-	1, 0, 1, 1, 1, 1, 1, 1, 
 	1, 1, 1, 1, 1, 1, 1, 1, 
 	1, 1, 1, 1, 1, 1, 1, 1, 
-	1, 0, 1, 4, 1, 1, 1, 1, 
-	1, 1, 1, 1, 1, 1, 1, 1
+	1, 1, 1, 1, 1, 1, 1, 1, 
+	1, 1, 1, 5, 1, 1, 1, 1, 
+	1, 1, 1, 1, 1, 1, 1, 1, 
+	1, 1, 1, 1, 1, 1, 1
 };
 
 static const char _request_uri_range_lengths[] = {
@@ -60,11 +64,12 @@ static const char _request_uri_range_lengths[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
-	0, 1, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
-	0, 1, 0, 0, 0, 0, 1, 1, 
-	0, 1, 0, 1, 1, 0, 1, 0
+	0, 0, 0, 0, 0, 0, 0, 0, 
+	0, 0, 0, 0, 0, 0, 0, 1, 
+	0, 1, 1, 0, 1, 0, 0, 1, 
+	0, 1, 1, 0, 1, 0, 0
 };
 
 static const unsigned char _request_uri_index_offsets[] = {
@@ -75,8 +80,9 @@ static const unsigned char _request_uri_index_offsets[] = {
 	64, 66, 68, 70, 72, 74, 76, 78, 
 	80, 82, 84, 86, 88, 90, 92, 94, 
 	96, 98, 100, 102, 104, 106, 108, 110, 
-	112, 114, 116, 118, 123, 125, 127, 130, 
-	133, 135, 138, 140, 143, 146, 148, 151
+	112, 114, 116, 118, 124, 126, 128, 130, 
+	133, 135, 138, 141, 143, 146, 148, 150, 
+	153, 155, 158, 161, 163, 166, 168
 };
 
 static const char _request_uri_trans_targs[] = {
@@ -87,18 +93,21 @@ static const char _request_uri_trans_targs[] = {
 	17, 58, 18, 58, 19, 58, 20, 58, 
 	21, 58, 22, 58, 23, 58, 24, 58, 
 	25, 58, 26, 58, 27, 58, 28, 58, 
-	29, 58, 30, 58, 31, 58, 32, 58, 
-	33, 58, 62, 58, 35, 58, 36, 58, 
+	29, 58, 30, 58, 31, 58, 62, 58, 
+	33, 58, 34, 58, 35, 58, 36, 58, 
 	37, 58, 38, 58, 39, 58, 40, 58, 
 	41, 58, 42, 58, 43, 58, 44, 58, 
 	45, 58, 46, 58, 47, 58, 48, 58, 
 	49, 58, 50, 58, 51, 58, 52, 58, 
-	53, 58, 54, 58, 55, 58, 56, 58, 
-	57, 58, 67, 58, 59, 58, 60, 0, 
-	8, 34, 58, 60, 58, 61, 58, 63, 
-	62, 58, 64, 65, 58, 64, 58, 66, 
-	65, 58, 66, 58, 68, 67, 58, 69, 
-	70, 58, 69, 58, 71, 70, 58, 71, 
+	53, 58, 70, 58, 55, 58, 56, 58, 
+	57, 58, 78, 58, 59, 58, 60, 0, 
+	8, 32, 54, 58, 60, 58, 61, 58, 
+	63, 58, 64, 65, 58, 64, 58, 66, 
+	65, 58, 67, 68, 58, 67, 58, 69, 
+	68, 58, 69, 58, 71, 58, 72, 73, 
+	58, 72, 58, 74, 73, 58, 75, 76, 
+	58, 75, 58, 77, 76, 58, 77, 58, 
+	78, 58, 58, 58, 58, 58, 58, 58, 
 	58, 58, 58, 58, 58, 58, 58, 58, 
 	58, 58, 58, 58, 58, 58, 58, 58, 
 	58, 58, 58, 58, 58, 58, 58, 58, 
@@ -112,34 +121,37 @@ static const char _request_uri_trans_targs[] = {
 };
 
 static const char _request_uri_trans_actions[] = {
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 1, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 0, 25, 0, 25, 0, 25, 
-	0, 25, 1, 25, 9, 11, 0, 0, 
-	0, 0, 13, 0, 13, 0, 15, 3, 
-	0, 30, 0, 1, 19, 0, 19, 3, 
-	0, 36, 0, 23, 3, 0, 27, 0, 
-	1, 17, 0, 17, 3, 0, 33, 0, 
-	21, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 25, 25, 25, 25, 25, 
-	25, 25, 25, 13, 13, 15, 30, 19, 
-	19, 36, 23, 27, 17, 17, 33, 21, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 0, 31, 0, 31, 
+	0, 31, 0, 31, 9, 11, 0, 0, 
+	0, 0, 0, 13, 0, 13, 0, 15, 
+	0, 27, 0, 1, 27, 0, 27, 3, 
+	0, 36, 0, 1, 19, 0, 19, 3, 
+	0, 42, 0, 23, 0, 25, 0, 1, 
+	25, 0, 25, 3, 0, 33, 0, 1, 
+	17, 0, 17, 3, 0, 39, 0, 21, 
+	0, 29, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 31, 31, 31, 31, 
+	31, 31, 31, 31, 13, 13, 15, 27, 
+	27, 27, 36, 19, 19, 42, 23, 25, 
+	25, 25, 33, 17, 17, 39, 21, 29, 
 	0
 };
 
@@ -152,7 +164,8 @@ static const char _request_uri_to_state_actions[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 5, 0, 0, 0, 0, 0, 
-	0, 0, 0, 0, 0, 0, 0, 0
+	0, 0, 0, 0, 0, 0, 0, 0, 
+	0, 0, 0, 0, 0, 0, 0
 };
 
 static const char _request_uri_from_state_actions[] = {
@@ -164,19 +177,21 @@ static const char _request_uri_from_state_actions[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 0, 0, 0, 0, 0, 0, 
 	0, 0, 7, 0, 0, 0, 0, 0, 
-	0, 0, 0, 0, 0, 0, 0, 0
+	0, 0, 0, 0, 0, 0, 0, 0, 
+	0, 0, 0, 0, 0, 0, 0
 };
 
 static const unsigned char _request_uri_eof_trans[] = {
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 211, 211, 211, 211, 211, 211, 
-	211, 211, 0, 213, 213, 214, 215, 217, 
-	217, 218, 219, 220, 222, 222, 223, 224
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 228, 228, 228, 228, 228, 228, 
+	228, 228, 0, 230, 230, 231, 234, 234, 
+	234, 235, 237, 237, 238, 239, 242, 242, 
+	242, 243, 245, 245, 246, 247, 248
 };
 
 static const int request_uri_start = 58;
@@ -203,7 +218,7 @@ int parse_request_uri(const char* request_uri, request_uri_section_t* sections)
   int current_section = 0;
 
   
-#line 207 "request_uri_parser.c"
+#line 222 "request_uri_parser.c"
 	{
 	cs = request_uri_start;
 	ts = 0;
@@ -211,7 +226,7 @@ int parse_request_uri(const char* request_uri, request_uri_section_t* sections)
 	act = 0;
 	}
 
-#line 215 "request_uri_parser.c"
+#line 230 "request_uri_parser.c"
 	{
 	int _klen;
 	unsigned int _trans;
@@ -230,7 +245,7 @@ _resume:
 #line 1 "NONE"
 	{ts = p;}
 	break;
-#line 234 "request_uri_parser.c"
+#line 249 "request_uri_parser.c"
 		}
 	}
 
@@ -314,38 +329,50 @@ _eof_trans:
 	{te = p+1;}
 	break;
 	case 5:
-#line 52 "request_uri_parser.rl"
+#line 58 "request_uri_parser.rl"
 	{te = p+1;{ result = REQUEST_URI_UNKNOWN; }}
 	break;
 	case 6:
-#line 46 "request_uri_parser.rl"
+#line 49 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_ROOT; }}
 	break;
 	case 7:
-#line 47 "request_uri_parser.rl"
+#line 50 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_CASSANDRA; }}
 	break;
 	case 8:
-#line 48 "request_uri_parser.rl"
+#line 51 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_SIMPLE_USER_SINGLE; }}
 	break;
 	case 9:
-#line 49 "request_uri_parser.rl"
+#line 52 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_PREPARED_USER_SINGLE; }}
 	break;
 	case 10:
-#line 50 "request_uri_parser.rl"
+#line 53 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_SIMPLE_USER_MULTIPLE; }}
 	break;
 	case 11:
-#line 51 "request_uri_parser.rl"
+#line 54 "request_uri_parser.rl"
 	{te = p;p--;{ result = REQUEST_URI_PREPARED_USER_MULTIPLE; }}
 	break;
 	case 12:
-#line 46 "request_uri_parser.rl"
+#line 55 "request_uri_parser.rl"
+	{te = p;p--;{ result = REQUEST_URI_SIMPLE_USERS; }}
+	break;
+	case 13:
+#line 56 "request_uri_parser.rl"
+	{te = p;p--;{ result = REQUEST_URI_PREPARED_USERS; }}
+	break;
+	case 14:
+#line 57 "request_uri_parser.rl"
+	{te = p;p--;{ result = REQUEST_URI_TRACE; }}
+	break;
+	case 15:
+#line 49 "request_uri_parser.rl"
 	{{p = ((te))-1;}{ result = REQUEST_URI_ROOT; }}
 	break;
-#line 349 "request_uri_parser.c"
+#line 376 "request_uri_parser.c"
 		}
 	}
 
@@ -358,7 +385,7 @@ _again:
 #line 1 "NONE"
 	{ts = 0;}
 	break;
-#line 362 "request_uri_parser.c"
+#line 389 "request_uri_parser.c"
 		}
 	}
 
@@ -375,7 +402,7 @@ _again:
 
 	}
 
-#line 57 "request_uri_parser.rl"
+#line 63 "request_uri_parser.rl"
 
 
   return result;
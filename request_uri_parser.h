@@ -13,7 +13,10 @@ enum {
   REQUEST_URI_SIMPLE_USER_SINGLE,
   REQUEST_URI_PREPARED_USER_SINGLE,
   REQUEST_URI_SIMPLE_USER_MULTIPLE,
-  REQUEST_URI_PREPARED_USER_MULTIPLE
+  REQUEST_URI_PREPARED_USER_MULTIPLE,
+  REQUEST_URI_SIMPLE_USERS,
+  REQUEST_URI_PREPARED_USERS,
+  REQUEST_URI_TRACE
 };
 
 int parse_request_uri(const char* request_uri, request_uri_section_t* sections);
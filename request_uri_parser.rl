@@ -41,6 +41,9 @@ int parse_request_uri(const char* request_uri, request_uri_section_t* sections)
     prepared_user_single_uri = "/prepared-statements/users/" number "/"*;
     simple_user_multiple_uri = "/simple-statements/users/" number "/" number "/"*;
     prepared_user_multiple_uri = "/prepared-statements/users/" number "/" number "/"*;
+    simple_users_uri = "/simple-statements/users" "/"*;
+    prepared_users_uri = "/prepared-statements/users" "/"*;
+    trace_uri = "/trace" "/"*;
 
     main := |*
       root_uri => { result = REQUEST_URI_ROOT; };
@@ -49,6 +52,9 @@ int parse_request_uri(const char* request_uri, request_uri_section_t* sections)
       prepared_user_single_uri => { result = REQUEST_URI_PREPARED_USER_SINGLE; };
       simple_user_multiple_uri => { result = REQUEST_URI_SIMPLE_USER_MULTIPLE; };
       prepared_user_multiple_uri => { result = REQUEST_URI_PREPARED_USER_MULTIPLE; };
+      simple_users_uri => { result = REQUEST_URI_SIMPLE_USERS; };
+      prepared_users_uri => { result = REQUEST_URI_PREPARED_USERS; };
+      trace_uri => { result = REQUEST_URI_TRACE; };
       any => { result = REQUEST_URI_UNKNOWN; };
     *|;
 
@@ -0,0 +1,151 @@
+#include "scheduler.h"
+
+/*****************************************************************************/
+
+static void scheduler__on_async(uv_async_t* async);
+static bool scheduler__has_capacity(scheduler_t* scheduler);
+static void scheduler__drain(scheduler_t* scheduler);
+
+/*****************************************************************************/
+
+void scheduler__on_async(uv_async_t* async) {
+  scheduler__drain((scheduler_t*)async->data);
+}
+
+/* Sequentially consistent with scheduler_finish() so a completion can't miss
+ * a statement that was just queued while the drain misses the completion */
+bool scheduler__has_capacity(scheduler_t* scheduler) {
+  return scheduler->limit == 0 ||
+         __atomic_load_n(&scheduler->submitted, __ATOMIC_SEQ_CST) < scheduler->limit;
+}
+
+/* The queue at the head of the active list keeps submitting until it runs
+ * out of deficit, then goes to the back. An emptied queue leaves the list
+ * and loses what's left of its deficit. */
+void scheduler__drain(scheduler_t* scheduler) {
+  while (scheduler->active_head && scheduler__has_capacity(scheduler)) {
+    scheduler_queue_t* queue = scheduler->active_head;
+    scheduler_item_t* item;
+
+    if (queue->deficit <= 0) {
+      queue->deficit += queue->weight;
+    }
+
+    item = queue->head;
+    queue->head = item->next_in_list;
+    if (!queue->head) queue->tail = NULL;
+    queue->deficit--;
+
+    if (!queue->head) {
+      queue->deficit = 0;
+      queue->active = false;
+      scheduler->active_head = queue->next_in_list;
+      if (!scheduler->active_head) scheduler->active_tail = NULL;
+    } else if (queue->deficit <= 0 && queue->next_in_list) {
+      scheduler->active_head = queue->next_in_list;
+      queue->next_in_list = NULL;
+      scheduler->active_tail->next_in_list = queue;
+      scheduler->active_tail = queue;
+    }
+
+    __atomic_sub_fetch(&scheduler->pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&scheduler->submitted, 1, __ATOMIC_RELAXED);
+    scheduler->submit_cb(item);
+  }
+}
+
+/*****************************************************************************/
+
+void scheduler_init(scheduler_t* scheduler, uv_loop_t* loop, uint64_t limit,
+                    scheduler_submit_cb submit_cb) {
+  scheduler->active_head = NULL;
+  scheduler->active_tail = NULL;
+  scheduler->limit = limit;
+  scheduler->submitted = 0;
+  scheduler->pending = 0;
+  scheduler->submit_cb = submit_cb;
+  scheduler->async.data = scheduler;
+  uv_async_init(loop, &scheduler->async, scheduler__on_async);
+}
+
+void scheduler_queue_init(scheduler_queue_t* queue, int weight) {
+  queue->next_in_list = NULL;
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->weight = weight > 0 ? weight : 1;
+  queue->deficit = 0;
+  queue->active = false;
+}
+
+void scheduler_queue_set_weight(scheduler_queue_t* queue, int weight) {
+  queue->weight = weight > 0 ? weight : 1;
+}
+
+void scheduler_enqueue(scheduler_t* scheduler, scheduler_queue_t* queue, scheduler_item_t* item) {
+  item->next_in_list = NULL;
+  if (queue->tail) {
+    queue->tail->next_in_list = item;
+  } else {
+    queue->head = item;
+  }
+  queue->tail = item;
+
+  if (!queue->active) {
+    queue->active = true;
+    queue->next_in_list = NULL;
+    if (scheduler->active_tail) {
+      scheduler->active_tail->next_in_list = queue;
+    } else {
+      scheduler->active_head = queue;
+    }
+    scheduler->active_tail = queue;
+  }
+
+  __atomic_add_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+  scheduler__drain(scheduler);
+}
+
+scheduler_item_t* scheduler_queue_clear(scheduler_t* scheduler, scheduler_queue_t* queue) {
+  scheduler_item_t* items = queue->head;
+  scheduler_item_t* item;
+  scheduler_queue_t* previous = NULL;
+  scheduler_queue_t* current = scheduler->active_head;
+
+  if (!queue->active) return NULL;
+
+  while (current != queue) {
+    previous = current;
+    current = current->next_in_list;
+  }
+  if (previous) {
+    previous->next_in_list = queue->next_in_list;
+  } else {
+    scheduler->active_head = queue->next_in_list;
+  }
+  if (scheduler->active_tail == queue) {
+    scheduler->active_tail = previous;
+  }
+
+  for (item = items; item; item = item->next_in_list) {
+    __atomic_sub_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+  }
+
+  queue->next_in_list = NULL;
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->deficit = 0;
+  queue->active = false;
+
+  return items;
+}
+
+void scheduler_start(scheduler_t* scheduler) {
+  __atomic_add_fetch(&scheduler->submitted, 1, __ATOMIC_RELAXED);
+}
+
+void scheduler_finish(scheduler_t* scheduler) {
+  __atomic_sub_fetch(&scheduler->submitted, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&scheduler->pending, __ATOMIC_SEQ_CST) > 0) {
+    uv_async_send(&scheduler->async);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct scheduler_s;
+
+typedef struct scheduler_item_s {
+  struct scheduler_item_s* next_in_list;
+} scheduler_item_t;
+
+/* Statements waiting to be submitted for one connection. The weight is the
+ * number of statements the queue gets to submit per round. */
+typedef struct scheduler_queue_s {
+  struct scheduler_queue_s* next_in_list;
+  scheduler_item_t* head;
+  scheduler_item_t* tail;
+  int weight;
+  int deficit;
+  bool active;
+} scheduler_queue_t;
+
+typedef void(*scheduler_submit_cb)(scheduler_item_t* item);
+
+/* Deficit round-robin over the queues with pending statements, draining into
+ * a bounded number of submitted (not yet completed) statements. Everything
+ * but scheduler_finish() runs on the loop thread. */
+typedef struct scheduler_s {
+  scheduler_queue_t* active_head;
+  scheduler_queue_t* active_tail;
+  uint64_t limit; /* 0 submits everything right away */
+  uint64_t submitted;
+  uint64_t pending;
+  scheduler_submit_cb submit_cb;
+  uv_async_t async;
+} scheduler_t;
+
+void scheduler_init(scheduler_t* scheduler, uv_loop_t* loop, uint64_t limit,
+                    scheduler_submit_cb submit_cb);
+
+void scheduler_queue_init(scheduler_queue_t* queue, int weight);
+
+/* The weight applies from the queue's next round */
+void scheduler_queue_set_weight(scheduler_queue_t* queue, int weight);
+
+void scheduler_enqueue(scheduler_t* scheduler, scheduler_queue_t* queue, scheduler_item_t* item);
+
+/* Takes every waiting statement out of the queue and returns them as a list
+ * for the caller to release */
+scheduler_item_t* scheduler_queue_clear(scheduler_t* scheduler, scheduler_queue_t* queue);
+
+/* Counts a statement that bypasses the queues as submitted */
+void scheduler_start(scheduler_t* scheduler);
+
+/* Called when a submitted statement completes, safe from any thread */
+void scheduler_finish(scheduler_t* scheduler);
+
+#endif
@@ -0,0 +1,129 @@
+#include "single_flight.h"
+
+#include <string.h>
+
+typedef struct single_flight_entry_s {
+  struct single_flight_entry_s* next_in_bucket;
+
+  uint64_t hash;
+  const void* statement;
+
+  single_flight_waiter_t* waiters_head;
+  single_flight_waiter_t* waiters_tail;
+
+  size_t key_length;
+  char key[];
+} single_flight_entry_t;
+
+/*****************************************************************************/
+
+static uint64_t single_flight__hash(const void* statement, const char* key, size_t key_length);
+static single_flight_stripe_t* single_flight__get_stripe(single_flight_t* flights, uint64_t hash);
+static single_flight_entry_t** single_flight__find(single_flight_stripe_t* stripe, uint64_t hash,
+                                                   const void* statement,
+                                                   const char* key, size_t key_length);
+
+/*****************************************************************************/
+
+uint64_t single_flight__hash(const void* statement, const char* key, size_t key_length) {
+  /* FNV-1a seeded with the statement */
+  uint64_t hash = 0xCBF29CE484222325ULL ^ (uint64_t)(uintptr_t)statement;
+  size_t i;
+  for (i = 0; i < key_length; ++i) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+single_flight_stripe_t* single_flight__get_stripe(single_flight_t* flights, uint64_t hash) {
+  return &flights->stripes[(hash >> 56) % SINGLE_FLIGHT_STRIPES];
+}
+
+single_flight_entry_t** single_flight__find(single_flight_stripe_t* stripe, uint64_t hash,
+                                            const void* statement,
+                                            const char* key, size_t key_length) {
+  single_flight_entry_t** pos = &stripe->buckets[hash % SINGLE_FLIGHT_BUCKETS];
+  while (*pos) {
+    single_flight_entry_t* entry = *pos;
+    if (entry->hash == hash &&
+        entry->statement == statement &&
+        entry->key_length == key_length &&
+        memcmp(entry->key, key, key_length) == 0) {
+      break;
+    }
+    pos = &entry->next_in_bucket;
+  }
+  return pos;
+}
+
+/*****************************************************************************/
+
+void single_flight_init(single_flight_t* flights) {
+  int i;
+  for (i = 0; i < SINGLE_FLIGHT_STRIPES; ++i) {
+    single_flight_stripe_t* stripe = &flights->stripes[i];
+    uv_mutex_init(&stripe->mutex);
+    memset(stripe->buckets, 0, sizeof(stripe->buckets));
+  }
+}
+
+bool single_flight_join(single_flight_t* flights, const void* statement,
+                        const char* key, size_t key_length,
+                        single_flight_waiter_t* waiter) {
+  uint64_t hash = single_flight__hash(statement, key, key_length);
+  single_flight_stripe_t* stripe = single_flight__get_stripe(flights, hash);
+  bool is_leader = false;
+
+  waiter->next_in_list = NULL;
+
+  uv_mutex_lock(&stripe->mutex);
+
+  single_flight_entry_t** pos = single_flight__find(stripe, hash, statement, key, key_length);
+  if (*pos) {
+    single_flight_entry_t* entry = *pos;
+    if (entry->waiters_tail) {
+      entry->waiters_tail->next_in_list = waiter;
+    } else {
+      entry->waiters_head = waiter;
+    }
+    entry->waiters_tail = waiter;
+  } else {
+    single_flight_entry_t* entry = (single_flight_entry_t*)malloc(sizeof(single_flight_entry_t) + key_length);
+    entry->next_in_bucket = NULL;
+    entry->hash = hash;
+    entry->statement = statement;
+    entry->waiters_head = NULL;
+    entry->waiters_tail = NULL;
+    entry->key_length = key_length;
+    memcpy(entry->key, key, key_length);
+    *pos = entry;
+    is_leader = true;
+  }
+
+  uv_mutex_unlock(&stripe->mutex);
+
+  return is_leader;
+}
+
+single_flight_waiter_t* single_flight_complete(single_flight_t* flights, const void* statement,
+                                               const char* key, size_t key_length) {
+  uint64_t hash = single_flight__hash(statement, key, key_length);
+  single_flight_stripe_t* stripe = single_flight__get_stripe(flights, hash);
+  single_flight_waiter_t* waiters = NULL;
+
+  uv_mutex_lock(&stripe->mutex);
+
+  single_flight_entry_t** pos = single_flight__find(stripe, hash, statement, key, key_length);
+  single_flight_entry_t* entry = *pos;
+  if (entry) {
+    *pos = entry->next_in_bucket;
+    waiters = entry->waiters_head;
+  }
+
+  uv_mutex_unlock(&stripe->mutex);
+
+  free(entry);
+
+  return waiters;
+}
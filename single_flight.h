@@ -0,0 +1,41 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SINGLE_FLIGHT_STRIPES 16
+#define SINGLE_FLIGHT_BUCKETS 256
+
+struct single_flight_entry_s;
+
+/* Embedded in whatever is waiting on a flight */
+typedef struct single_flight_waiter_s {
+  struct single_flight_waiter_s* next_in_list;
+} single_flight_waiter_t;
+
+typedef struct single_flight_stripe_s {
+  uv_mutex_t mutex;
+  struct single_flight_entry_s* buckets[SINGLE_FLIGHT_BUCKETS];
+} single_flight_stripe_t;
+
+typedef struct single_flight_s {
+  single_flight_stripe_t stripes[SINGLE_FLIGHT_STRIPES];
+} single_flight_t;
+
+void single_flight_init(single_flight_t* flights);
+
+/* Returns true if the waiter is the leader and has to execute the query
+ * itself. Otherwise it's queued and handed back by single_flight_complete(). */
+bool single_flight_join(single_flight_t* flights, const void* statement,
+                        const char* key, size_t key_length,
+                        single_flight_waiter_t* waiter);
+
+/* Ends the flight and returns everyone that joined after the leader */
+single_flight_waiter_t* single_flight_complete(single_flight_t* flights, const void* statement,
+                                               const char* key, size_t key_length);
+
+#endif
@@ -0,0 +1,273 @@
+#include "statement_cache.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* How long to wait before preparing a query again after a failed prepare */
+#define STATEMENT_CACHE_RETRY_MS 1000
+
+typedef struct statement_cache_entry_s {
+  struct statement_cache_entry_s* next_in_bucket;
+  struct statement_cache_entry_s* prev_in_lru;
+  struct statement_cache_entry_s* next_in_lru;
+
+  uint64_t hash;
+
+  const CassPrepared* prepared;
+  CassFuture* future; /* Outstanding prepare, if any */
+  uint64_t retry_at;
+
+  size_t query_length;
+  char query[];
+} statement_cache_entry_t;
+
+/*****************************************************************************/
+
+static uint64_t statement_cache__hash(const char* query, size_t query_length);
+static uint64_t statement_cache__now_ms();
+
+static statement_cache_entry_t* statement_cache__find(statement_cache_t* cache, uint64_t hash,
+                                                      const char* query, size_t query_length);
+static void statement_cache__link(statement_cache_t* cache, statement_cache_entry_t* entry);
+static void statement_cache__unlink(statement_cache_t* cache, statement_cache_entry_t* entry);
+static void statement_cache__touch(statement_cache_t* cache, statement_cache_entry_t* entry);
+static void statement_cache__free(statement_cache_entry_t* entry);
+
+static void statement_cache__prepare(statement_cache_t* cache, statement_cache_entry_t* entry);
+static void statement_cache__collect(statement_cache_entry_t* entry);
+
+/*****************************************************************************/
+
+uint64_t statement_cache__hash(const char* query, size_t query_length) {
+  /* FNV-1a */
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t i;
+  for (i = 0; i < query_length; ++i) {
+    hash ^= (uint8_t)query[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+uint64_t statement_cache__now_ms() {
+  return uv_hrtime() / 1000000;
+}
+
+statement_cache_entry_t* statement_cache__find(statement_cache_t* cache, uint64_t hash,
+                                               const char* query, size_t query_length) {
+  statement_cache_entry_t* entry = cache->buckets[hash & cache->bucket_mask];
+  while (entry) {
+    if (entry->hash == hash &&
+        entry->query_length == query_length &&
+        memcmp(entry->query, query, query_length) == 0) {
+      return entry;
+    }
+    entry = entry->next_in_bucket;
+  }
+  return NULL;
+}
+
+void statement_cache__link(statement_cache_t* cache, statement_cache_entry_t* entry) {
+  statement_cache_entry_t** bucket = &cache->buckets[entry->hash & cache->bucket_mask];
+  entry->next_in_bucket = *bucket;
+  *bucket = entry;
+
+  entry->prev_in_lru = NULL;
+  entry->next_in_lru = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->prev_in_lru = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+
+  cache->count++;
+}
+
+void statement_cache__unlink(statement_cache_t* cache, statement_cache_entry_t* entry) {
+  statement_cache_entry_t** pos = &cache->buckets[entry->hash & cache->bucket_mask];
+  while (*pos != entry) {
+    pos = &(*pos)->next_in_bucket;
+  }
+  *pos = entry->next_in_bucket;
+
+  if (entry->prev_in_lru) {
+    entry->prev_in_lru->next_in_lru = entry->next_in_lru;
+  } else {
+    cache->lru_head = entry->next_in_lru;
+  }
+  if (entry->next_in_lru) {
+    entry->next_in_lru->prev_in_lru = entry->prev_in_lru;
+  } else {
+    cache->lru_tail = entry->prev_in_lru;
+  }
+
+  cache->count--;
+}
+
+void statement_cache__touch(statement_cache_t* cache, statement_cache_entry_t* entry) {
+  if (cache->lru_head == entry) return;
+
+  entry->prev_in_lru->next_in_lru = entry->next_in_lru;
+  if (entry->next_in_lru) {
+    entry->next_in_lru->prev_in_lru = entry->prev_in_lru;
+  } else {
+    cache->lru_tail = entry->prev_in_lru;
+  }
+
+  entry->prev_in_lru = NULL;
+  entry->next_in_lru = cache->lru_head;
+  cache->lru_head->prev_in_lru = entry;
+  cache->lru_head = entry;
+}
+
+void statement_cache__free(statement_cache_entry_t* entry) {
+  /* Freeing an outstanding future is fine, the driver keeps its own reference */
+  if (entry->future) {
+    cass_future_free(entry->future);
+  }
+  if (entry->prepared) {
+    cass_prepared_free(entry->prepared);
+  }
+  free(entry);
+}
+
+void statement_cache__prepare(statement_cache_t* cache, statement_cache_entry_t* entry) {
+  entry->future = cass_session_prepare(cache->session,
+                                       cass_string_init2(entry->query, entry->query_length));
+}
+
+/* Picks up the result of a finished prepare. Polling the future under the
+ * lock (instead of a callback) means an entry is never touched by another
+ * thread after it's been evicted. */
+void statement_cache__collect(statement_cache_entry_t* entry) {
+  if (!entry->future || !cass_future_ready(entry->future)) return;
+
+  if (cass_future_error_code(entry->future) == CASS_OK) {
+    entry->prepared = cass_future_get_prepared(entry->future);
+  } else {
+    CassString error = cass_future_error_message(entry->future);
+    LOGGER_WRITE("Unable to prepare \"%.*s\": %.*s\n",
+                 (int)entry->query_length, entry->query,
+                 (int)error.length, error.data);
+    entry->retry_at = statement_cache__now_ms() + STATEMENT_CACHE_RETRY_MS;
+  }
+
+  cass_future_free(entry->future);
+  entry->future = NULL;
+}
+
+/*****************************************************************************/
+
+int statement_cache_init(statement_cache_t* cache, CassSession* session, size_t capacity) {
+  size_t bucket_count = 16;
+
+  cache->enabled = capacity > 0;
+  cache->session = session;
+  cache->lru_head = NULL;
+  cache->lru_tail = NULL;
+  cache->count = 0;
+  cache->capacity = capacity;
+
+  if (!cache->enabled) return 0;
+
+  while (bucket_count < capacity) bucket_count <<= 1;
+
+  uv_mutex_init(&cache->mutex);
+  cache->buckets = (statement_cache_entry_t**)calloc(bucket_count, sizeof(statement_cache_entry_t*));
+  cache->bucket_mask = bucket_count - 1;
+
+  return 0;
+}
+
+void statement_cache_destroy(statement_cache_t* cache) {
+  if (!cache->enabled) return;
+
+  while (cache->lru_head) {
+    statement_cache_entry_t* entry = cache->lru_head;
+    statement_cache__unlink(cache, entry);
+    statement_cache__free(entry);
+  }
+
+  free(cache->buckets);
+  uv_mutex_destroy(&cache->mutex);
+
+  cache->enabled = false;
+}
+
+CassStatement* statement_cache_new_statement(statement_cache_t* cache, const char* query,
+                                             size_t parameter_count, bool* prepared) {
+  CassStatement* statement = NULL;
+  size_t query_length = strlen(query);
+
+  *prepared = false;
+
+  if (!cache->enabled) {
+    return cass_statement_new(cass_string_init2(query, query_length), parameter_count);
+  }
+
+  uint64_t hash = statement_cache__hash(query, query_length);
+
+  uv_mutex_lock(&cache->mutex);
+
+  statement_cache_entry_t* entry = statement_cache__find(cache, hash, query, query_length);
+  if (entry) {
+    statement_cache__touch(cache, entry);
+    statement_cache__collect(entry);
+  } else {
+    if (cache->count >= cache->capacity) {
+      statement_cache_entry_t* victim = cache->lru_tail;
+      statement_cache__unlink(cache, victim);
+      statement_cache__free(victim);
+    }
+
+    entry = (statement_cache_entry_t*)malloc(sizeof(statement_cache_entry_t) + query_length);
+    entry->hash = hash;
+    entry->prepared = NULL;
+    entry->future = NULL;
+    entry->retry_at = 0;
+    entry->query_length = query_length;
+    memcpy(entry->query, query, query_length);
+
+    statement_cache__link(cache, entry);
+  }
+
+  if (entry->prepared) {
+    statement = cass_prepared_bind(entry->prepared);
+    *prepared = true;
+  } else if (!entry->future && entry->retry_at <= statement_cache__now_ms()) {
+    statement_cache__prepare(cache, entry);
+  }
+
+  uv_mutex_unlock(&cache->mutex);
+
+  if (!statement) {
+    statement = cass_statement_new(cass_string_init2(query, query_length), parameter_count);
+  }
+
+  return statement;
+}
+
+void statement_cache_unprepared(statement_cache_t* cache, const char* query) {
+  if (!cache->enabled) return;
+
+  size_t query_length = strlen(query);
+  uint64_t hash = statement_cache__hash(query, query_length);
+
+  uv_mutex_lock(&cache->mutex);
+
+  statement_cache_entry_t* entry = statement_cache__find(cache, hash, query, query_length);
+  if (entry) {
+    statement_cache__collect(entry);
+    /* Only the first error starts a new prepare, later ones find it running */
+    if (entry->prepared) {
+      cass_prepared_free(entry->prepared);
+      entry->prepared = NULL;
+      statement_cache__prepare(cache, entry);
+    }
+  }
+
+  uv_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,43 @@
+#ifndef STATEMENT_CACHE_H
+#define STATEMENT_CACHE_H
+
+#include <cassandra.h>
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct statement_cache_entry_s;
+
+/* Prepared statements keyed by query text (LRU). Queries are prepared in the
+ * background the first time they're seen and executed as simple statements
+ * until the prepare finishes. */
+typedef struct statement_cache_s {
+  bool enabled;
+  CassSession* session;
+
+  uv_mutex_t mutex;
+  struct statement_cache_entry_s** buckets;
+  size_t bucket_mask;
+
+  /* Most recently used first */
+  struct statement_cache_entry_s* lru_head;
+  struct statement_cache_entry_s* lru_tail;
+
+  size_t count;
+  size_t capacity;
+} statement_cache_t;
+
+int statement_cache_init(statement_cache_t* cache, CassSession* session, size_t capacity);
+void statement_cache_destroy(statement_cache_t* cache);
+
+/* Returns a new statement for "query", "prepared" tells whether it was bound
+ * from a prepared statement or is a simple statement */
+CassStatement* statement_cache_new_statement(statement_cache_t* cache, const char* query,
+                                             size_t parameter_count, bool* prepared);
+
+/* Called when the server no longer knows the query's prepared id */
+void statement_cache_unprepared(statement_cache_t* cache, const char* query);
+
+#endif
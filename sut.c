@@ -1,11 +1,31 @@
+#include "admission.h"
+#include "arena.h"
+#include "calibrate.h"
+#include "combiner.h"
+#include "driver_config.h"
 #include "fastercgi.h"
+#include "hedge.h"
+#include "ingest.h"
+#include "logger.h"
+#include "murmur3.h"
+#include "negative_cache.h"
+#include "placement.h"
 #include "request_uri_parser.h"
+#include "scheduler.h"
+#include "single_flight.h"
+#include "statement_cache.h"
+#include "trace.h"
+#include "user_cache.h"
+#include "user_row.h"
 
 #include <cassandra.h>
 #include <uv.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 
 #define min(a, b)             \
@@ -13,6 +33,9 @@
    __typeof__ (b) _b = (b);   \
    _a < _b ? _a : _b; })
 
+#define container_of(ptr, type, member) \
+  ((type*)((char*)(ptr) - offsetof(type, member)))
+
 enum {
   UNKNOWN,
   GET,
@@ -20,162 +43,1586 @@ enum {
 };
 
 
-#define CONTENT_TYPE_TEXT_PLAIN "Content-Type: text/plain\r\n\r\n"
+#define CONTENT_TYPE_TEXT_PLAIN "Content-Type: text/plain\r\n\r\n"
+
+struct request_s;
+struct hedge_race_s;
+
+/* Each future gets its own slot. The slot's result is decoded on the driver's
+ * IO thread (in on_future) into "fragment" so the loop thread only has to
+ * stitch fragments together. */
+typedef struct request_slot_s {
+  struct request_s* request;
+  fcgi_connection_t* conn;
+
+  CassFuture* future;
+  CassError rc;
+  bool auto_prepared;
+  /* Query and cache of a statement from a statement cache, for the retry
+   * when it turns out unprepared */
+  const char* query;
+  statement_cache_t* statement_cache;
+  int columns; /* Projection a single-user read fetches */
+  bool handed_off; /* Completed by a driver callback or another request */
+  bool done;
+  bool has_row;
+  bool has_more_pages;
+  const CassResult* result;
+  const char* key; /* Allocated from the request's arena */
+  size_t key_length;
+  fcgi_buffer_t fragment;
+
+  /* Slots reused for the whole request (bulk ingest) keep their key here
+   * instead, the arena would grow with every row */
+  fcgi_buffer_t owned_key;
+  uint64_t row_number;
+
+  /* Statement of the flight this slot leads, NULL if it isn't coalesced */
+  const void* flight;
+  uint32_t cache_generation; /* Both taken before a read is sent */
+  uint32_t negative_generation;
+  single_flight_waiter_t waiter;
+
+  /* Waiting in the request's scheduler queue until it's submitted */
+  scheduler_item_t scheduler_item;
+  CassStatement* statement;
+  bool owns_statement;
+
+  /* Inserts can be held by the write combiner and sent in a batch */
+  bool batchable;
+  combiner_item_t combiner_item;
+} request_slot_t;
+
+#define INGEST_WINDOW 256
+#define INGEST_MAX_ERROR_LINES 100
+
+/* Uploads are read only while less than the high water mark is waiting to
+ * be parsed */
+#define INGEST_HIGH_WATER_MARK (4 * INGEST_MAX_ROW_LENGTH)
+#define INGEST_LOW_WATER_MARK INGEST_MAX_ROW_LENGTH
+
+/* Bulk ingest parses rows as STDIN arrives and keeps at most INGEST_WINDOW
+ * inserts in flight, each one in a slot that's reused once it completes */
+typedef struct ingest_s {
+  ingest_parser_t parser;
+  bool eof;
+  bool finished;
+  bool use_prepared;
+  int in_flight;
+  int free_slots[INGEST_WINDOW];
+  int free_count;
+  uint64_t inserted;
+  uint64_t failed;
+  fcgi_buffer_t errors;
+} ingest_t;
+
+typedef struct request_s {
+  int method;
+  int type;
+  int format;
+  int columns; /* Projection the response renders */
+  bool picked_columns; /* With "fields", otherwise it's the format's default */
+
+  int slots_capacity;
+  int slots_length;
+  int futures_count;
+  request_slot_t* slots;
+
+  /* Streamed responses write out the completed prefix of the slots as soon
+   * as it's available, at most one write is in flight at a time */
+  bool stream;
+  bool stream_started;
+  bool stream_failed;
+  bool stream_write_pending;
+  bool stream_notify_pending;
+  int next_slot;
+  int stream_rows;
+
+  /* Paged scans keep at most one page being written and one being fetched */
+  CassStatement* scan_statement;
+
+  ingest_t ingest;
+
+  /* Pending second execution of a single-user read */
+  uv_timer_t hedge_timer;
+  struct hedge_race_s* hedge_race;
+
+  /* Everything that only lives as long as the request, reset in one go */
+  arena_t arena;
+
+  /* Phase timestamps, reset when the next request begins */
+  trace_t trace;
+
+  /* uv_hrtime() past which statements aren't submitted anymore, 0 if the
+   * request has no deadline */
+  uint64_t deadline;
+
+  /* Statements of this connection waiting to be submitted */
+  scheduler_queue_t queue;
+
+  /* A request whose connection went away before it finished is cancelled.
+   * If slots are still handed off it's detached from the connection and
+   * freed once the last of them completes. */
+  bool cancelled;
+  int outstanding;
+  struct request_s* next_orphan;
+
+  uv_mutex_t mutex;
+} request_t;
+
+/* A hedged read executes the same statement twice and whichever future
+ * completes first fills the slot. The loser can't be cancelled in the
+ * driver so the race outlives the request and only touches the slot once
+ * it has been claimed. */
+typedef struct hedge_race_s {
+  request_slot_t* slot;
+  hedge_policy_t* policy;
+  CassStatement* statement;
+  CassFuture* hedge_future;
+  uint64_t start;
+  int refs;
+  int claimed;
+} hedge_race_t;
+
+#define INITIAL_CAPACITY 256
+
+#define DEFAULT_CACHE_MEMORY (64 * 1024 * 1024)
+#define DEFAULT_CACHE_TTL_MS (60 * 1000)
+#define DEFAULT_CACHE_SNAPSHOT_INTERVAL_S 60
+
+#define DEFAULT_NEGATIVE_CACHE_ENTRIES (64 * 1024)
+#define DEFAULT_NEGATIVE_CACHE_TTL_MS (10 * 1000)
+
+#define DEFAULT_SCAN_PAGE_SIZE 1000
+
+#define DEFAULT_AUTO_PREPARE_ENTRIES 0
+
+#define DEFAULT_HEDGE_BUDGET_PERCENT 5
+
+#define DEFAULT_SLOW_REQUEST_MS 100
+#define TRACE_RING_ENTRIES 4096
+
+/* Bulk requests are shed once half the in-flight limit is used */
+#define ADMISSION_BULK_PERCENT 50
+
+/* Statements submitted per scheduling round, single-key reads and writes
+ * get ahead of multi-user requests, scans and uploads */
+#define DEFAULT_MAX_SUBMITTED 1024
+#define SCHEDULER_WEIGHT_SINGLE 8
+#define SCHEDULER_WEIGHT_BULK 1
+
+/* Inserts are only combined with -W, the ring is split into this many
+ * token ranges and each range's inserts are batched together */
+#define DEFAULT_INSERT_BATCH_MAX 32
+#define INSERT_BATCH_TOKEN_RANGES 64
+
+#define SELECT_QUERY "SELECT username, firstname, lastname, " \
+  "password, email, created_date "        \
+"FROM videodb.users WHERE username = ?"
+
+/* SELECT_QUERY with only some of the columns, one per projection */
+#define PROJECTION_QUERY_WHERE " FROM videodb.users WHERE username = ?"
+#define PROJECTION_MAX_QUERY_LENGTH 256
+
+#define SCAN_QUERY "SELECT username, firstname, lastname, " \
+  "password, email, created_date "        \
+"FROM videodb.users WHERE token(username) >= ? AND token(username) <= ?"
+
+#define INSERT_QUERY "INSERT INTO videodb.users " \
+  "(username, firstname, lastname, password, created_date) " \
+  "VALUES (?, ?, ?, ?, unixTimestampOf(now()))"
+
+typedef struct route_deadline_s {
+  const char* name;
+  uint64_t deadline_ms; /* 0 for no deadline */
+} route_deadline_t;
+
+enum {
+  ROUTE_DEADLINE_CASSANDRA,
+  ROUTE_DEADLINE_USER,
+  ROUTE_DEADLINE_USERS_RANGE,
+  ROUTE_DEADLINE_USERS,
+  ROUTE_DEADLINE_COUNT
+};
+
+/* Scans and uploads run for as long as the data keeps flowing */
+route_deadline_t route_deadlines[ROUTE_DEADLINE_COUNT] = {
+  { "cassandra", 1000 },
+  { "user", 1000 },
+  { "users_range", 10000 },
+  { "users", 0 }
+};
+
+const CassPrepared* select_prepared;
+const CassPrepared* insert_prepared;
+const CassPrepared* scan_prepared;
+
+user_cache_t user_cache;
+negative_cache_t negative_cache;
+single_flight_t select_flights;
+statement_cache_t statement_cache;
+
+/* Single-user reads only select the columns the response uses. The prepared
+ * routes use select_prepared unless "fields" picked some, those projections
+ * are prepared the first time they're used. The simple routes go through
+ * statement_cache like any other query. */
+char projection_queries[USER_ROW_PROJECTIONS][PROJECTION_MAX_QUERY_LENGTH];
+statement_cache_t projection_statements;
+/* Only their addresses are used, as single-flight keys per route kind */
+char projection_flights[2][USER_ROW_PROJECTIONS];
+hedge_policy_t simple_hedge_policy;
+hedge_policy_t prepared_hedge_policy;
+trace_ring_t trace_ring;
+admission_t admission;
+scheduler_t scheduler;
+combiner_t insert_combiner;
+
+/* Cancelled requests whose last slot just completed, freed on the loop */
+uv_async_t orphans_async;
+uv_mutex_t orphans_mutex;
+struct request_s* orphans;
+uv_signal_t trace_signal;
+
+/* The user cache is saved with -F every -I seconds on the thread pool and
+ * once more on SIGTERM or SIGINT */
+const char* cache_snapshot_file;
+uv_timer_t cache_snapshot_timer;
+uv_work_t cache_snapshot_work;
+bool cache_snapshot_saving;
+uv_signal_t shutdown_signals[2];
+
+/* Startup runs in the background while the listener already answers with
+ * 503s. The connect callback prepares every statement and warms up the
+ * connections concurrently, the last one to finish wakes the loop up. */
+typedef struct startup_s {
+  uv_async_t async;
+  CassSession* session;
+  int warmup_requests;
+  int pending;
+  int failed;
+  bool ready;
+} startup_t;
+
+typedef struct startup_statement_s {
+  const char* query;
+  const CassPrepared** prepared;
+} startup_statement_t;
+
+#define WARMUP_QUERY "SELECT release_version FROM system.local"
+
+startup_t startup;
+
+startup_statement_t startup_statements[] = {
+  { SELECT_QUERY, &select_prepared },
+  { INSERT_QUERY, &insert_prepared },
+  { SCAN_QUERY, &scan_prepared }
+};
+
+#define STARTUP_STATEMENTS_COUNT (sizeof(startup_statements) / sizeof(startup_statements[0]))
+
+void startup_complete_one() {
+  if (__atomic_sub_fetch(&startup.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    uv_async_send(&startup.async);
+  }
+}
+
+void startup_fail(const char* what, CassFuture* future) {
+  CassString error = cass_future_error_message(future);
+  fprintf(stderr, "%s: %.*s\n", what, (int)error.length, error.data);
+  __atomic_store_n(&startup.failed, 1, __ATOMIC_RELEASE);
+}
+
+void on_startup_prepared(CassFuture* future, void* data) {
+  startup_statement_t* statement = (startup_statement_t*)data;
+  if (cass_future_error_code(future) == CASS_OK) {
+    *statement->prepared = cass_future_get_prepared(future);
+  } else {
+    startup_fail("Query error", future);
+  }
+  cass_future_free(future);
+  startup_complete_one();
+}
+
+void on_startup_warmup(CassFuture* future, void* data) {
+  /* Not fatal, the connection is just as warm */
+  if (cass_future_error_code(future) != CASS_OK) {
+    CassString error = cass_future_error_message(future);
+    fprintf(stderr, "Warm-up error: %.*s\n", (int)error.length, error.data);
+  }
+  cass_future_free(future);
+  startup_complete_one();
+}
+
+void on_startup_connect(CassFuture* future, void* data) {
+  size_t i;
+  int j;
+
+  if (cass_future_error_code(future) != CASS_OK) {
+    startup_fail("Unable to connect", future);
+    cass_future_free(future);
+    uv_async_send(&startup.async);
+    return;
+  }
+  cass_future_free(future);
+
+  startup.pending = STARTUP_STATEMENTS_COUNT + startup.warmup_requests;
+
+  for (i = 0; i < STARTUP_STATEMENTS_COUNT; ++i) {
+    CassFuture* prepare_future = cass_session_prepare(startup.session,
+                                                      cass_string_init(startup_statements[i].query));
+    cass_future_set_callback(prepare_future, on_startup_prepared, &startup_statements[i]);
+  }
+
+  /* One round trip on every connection so the first requests don't pay for it */
+  for (j = 0; j < startup.warmup_requests; ++j) {
+    CassStatement* statement = cass_statement_new(cass_string_init(WARMUP_QUERY), 0);
+    CassFuture* warmup_future = cass_session_execute(startup.session, statement);
+    cass_future_set_callback(warmup_future, on_startup_warmup, NULL);
+    cass_statement_free(statement);
+  }
+}
+
+void on_startup(uv_async_t* async) {
+  if (__atomic_load_n(&startup.failed, __ATOMIC_ACQUIRE)) {
+    uv_stop(async->loop);
+    return;
+  }
+  startup.ready = true;
+  uv_close((uv_handle_t*)async, NULL);
+}
+
+void startup_start(uv_loop_t* loop, CassSession* session, CassCluster* cluster,
+                   const driver_config_t* config) {
+  startup.session = session;
+  startup.warmup_requests = config->num_threads_io * config->core_connections_per_host;
+  startup.pending = 0;
+  startup.failed = 0;
+  startup.ready = false;
+  uv_async_init(loop, &startup.async, on_startup);
+
+  CassFuture* future = cass_session_connect(session, cluster);
+  cass_future_set_callback(future, on_startup_connect, NULL);
+}
+
+void request_init(request_t* request, uv_loop_t* loop) {
+  request->method = 0;
+  request->type = 0;
+  request->format = USER_ROW_FORMAT_TEXT;
+  request->columns = USER_ROW_ALL_COLUMNS;
+  request->picked_columns = false;
+  request->slots = (request_slot_t*)calloc(INITIAL_CAPACITY, sizeof(request_slot_t));
+  request->slots_capacity = INITIAL_CAPACITY;
+  request->slots_length = 0;
+  request->futures_count = 0;
+  request->stream = false;
+  request->stream_started = false;
+  request->stream_failed = false;
+  request->stream_write_pending = false;
+  request->stream_notify_pending = false;
+  request->next_slot = 0;
+  request->stream_rows = 0;
+  request->scan_statement = NULL;
+  uv_timer_init(loop, &request->hedge_timer);
+  request->hedge_timer.data = request;
+  request->hedge_race = NULL;
+  ingest_parser_init(&request->ingest.parser, INGEST_FORMAT_NDJSON);
+  request->ingest.errors.capacity = 0;
+  request->ingest.errors.data = NULL;
+  fcgi_buffer_reset(&request->ingest.errors);
+  arena_init(&request->arena, ARENA_DEFAULT_BLOCK_SIZE);
+  trace_reset(&request->trace);
+  scheduler_queue_init(&request->queue, SCHEDULER_WEIGHT_SINGLE);
+  request->cancelled = false;
+  request->outstanding = 0;
+  request->next_orphan = NULL;
+  request->deadline = 0;
+  uv_mutex_init(&request->mutex);
+}
+
+void request_reset(request_t* request) {
+  request->method = 0;
+  request->type = 0;
+  request->format = USER_ROW_FORMAT_TEXT;
+  request->columns = USER_ROW_ALL_COLUMNS;
+  request->picked_columns = false;
+  request->slots_length = 0;
+  request->futures_count = 0;
+  request->stream = false;
+  request->stream_started = false;
+  request->stream_failed = false;
+  request->stream_write_pending = false;
+  request->stream_notify_pending = false;
+  request->next_slot = 0;
+  request->stream_rows = 0;
+  request->cancelled = false;
+  request->deadline = 0;
+  arena_reset(&request->arena);
+}
+
+void on_request_closed(uv_handle_t* handle) {
+  request_t* request = (request_t*)handle->data;
+  int i;
+
+  for (i = 0; i < request->slots_capacity; ++i) {
+    free(request->slots[i].fragment.data);
+    free(request->slots[i].owned_key.data);
+  }
+  free(request->slots);
+  ingest_parser_destroy(&request->ingest.parser);
+  free(request->ingest.errors.data);
+  arena_destroy(&request->arena);
+  uv_mutex_destroy(&request->mutex);
+  free(request);
+}
+
+void on_orphans(uv_async_t* async) {
+  request_t* request;
+
+  uv_mutex_lock(&orphans_mutex);
+  request = orphans;
+  orphans = NULL;
+  uv_mutex_unlock(&orphans_mutex);
+
+  while (request) {
+    request_t* next = request->next_orphan;
+    uv_close((uv_handle_t*)&request->hedge_timer, on_request_closed);
+    request = next;
+  }
+}
+
+/* Slots must not move while futures are outstanding so this has to be called
+ * with the total number of futures before the first one is executed. */
+void request_reserve(request_t* request, int count) {
+  if (count > request->slots_capacity) {
+    size_t new_capacity = request->slots_capacity;
+    while (new_capacity < (size_t)count) {
+      new_capacity = new_capacity < 4096
+                   ? new_capacity * 2
+                   : new_capacity + 1024;
+    }
+    request->slots = (request_slot_t*)realloc(request->slots,
+                                              new_capacity * sizeof(request_slot_t));
+    memset(request->slots + request->slots_capacity, 0,
+           (new_capacity - request->slots_capacity) * sizeof(request_slot_t));
+    request->slots_capacity = new_capacity;
+  }
+}
+
+void request_slot_init(request_t* request, request_slot_t* slot, fcgi_connection_t* conn) {
+  slot->request = request;
+  slot->conn = conn;
+  slot->future = NULL;
+  slot->rc = CASS_OK;
+  slot->auto_prepared = false;
+  slot->query = NULL;
+  slot->statement_cache = NULL;
+  slot->columns = USER_ROW_ALL_COLUMNS;
+  slot->handed_off = false;
+  slot->done = false;
+  slot->has_row = false;
+  slot->has_more_pages = false;
+  slot->result = NULL;
+  slot->key = NULL;
+  slot->key_length = 0;
+  fcgi_buffer_reset(&slot->fragment);
+  slot->row_number = 0;
+  slot->flight = NULL;
+  slot->cache_generation = 0;
+  slot->negative_generation = 0;
+  slot->statement = NULL;
+  slot->owns_statement = false;
+  slot->batchable = false;
+}
+
+request_slot_t* request_append_slot(request_t* request, fcgi_connection_t* conn,
+                                    const char* key, size_t key_length) {
+  request_reserve(request, request->slots_length + 1);
+  request_slot_t* slot = &request->slots[request->slots_length++];
+  request_slot_init(request, slot, conn);
+  slot->key = arena_copy(&request->arena, key, key_length);
+  slot->key_length = key_length;
+  return slot;
+}
+
+/* The slot will be completed from somewhere else (a driver callback or the
+ * leader of its flight), a cancelled request waits for it */
+void request_hand_off(request_slot_t* slot) {
+  request_t* request = slot->request;
+  uv_mutex_lock(&request->mutex);
+  if (!slot->handed_off) {
+    slot->handed_off = true;
+    request->outstanding++;
+  }
+  uv_mutex_unlock(&request->mutex);
+}
+
+void request_complete_slot(request_slot_t* slot) {
+  request_t* request = slot->request;
+  bool orphaned = false;
+
+  uv_mutex_lock(&request->mutex);
+  slot->done = true;
+  if (slot->handed_off) {
+    slot->handed_off = false;
+    request->outstanding--;
+  }
+  if (request->cancelled) {
+    /* Nobody is waiting for it, let go of the result right away */
+    if (slot->future) {
+      cass_future_free(slot->future);
+      slot->future = NULL;
+    }
+    if (slot->result) {
+      cass_result_free(slot->result);
+      slot->result = NULL;
+    }
+    orphaned = request->outstanding == 0;
+  } else if(--request->futures_count <= 0 || request->stream) {
+    fcgi_connection_notify(slot->conn);
+  }
+  uv_mutex_unlock(&request->mutex);
+
+  if (orphaned) {
+    uv_mutex_lock(&orphans_mutex);
+    request->next_orphan = orphans;
+    orphans = request;
+    uv_mutex_unlock(&orphans_mutex);
+    uv_async_send(&orphans_async);
+  }
+}
+
+/* Hands the leader's result to every request that joined its flight */
+void request_complete_flight(request_slot_t* slot) {
+  single_flight_waiter_t* waiter = single_flight_complete(&select_flights, slot->flight,
+                                                          slot->key, slot->key_length);
+  while (waiter) {
+    single_flight_waiter_t* next = waiter->next_in_list;
+    request_slot_t* follower = container_of(waiter, request_slot_t, waiter);
+    follower->rc = slot->rc;
+    follower->has_row = slot->has_row;
+    fcgi_buffer_append(&follower->fragment, slot->fragment.data, slot->fragment.length);
+    request_complete_slot(follower);
+    waiter = next;
+  }
+}
+
+void request_free_futures(request_t* request) {
+  int i;
+  for (i = 0; i < request->slots_length; ++i) {
+    request_slot_t* slot = &request->slots[i];
+    if (slot->future) {
+      cass_future_free(slot->future);
+      slot->future = NULL;
+    }
+  }
+}
+
+int stoi(request_uri_section_t* s) {
+  char temp[512];
+  size_t to_copy = min(sizeof(temp), (size_t)(s->end - s->start));
+  memcpy(temp, s->start, to_copy);
+  temp[to_copy] = '\0';
+  return atoi(temp);
+}
+
+/* Finds "name" in a query string and copies its (raw) value */
+bool query_get(const char* query, const char* name, char* value, size_t value_size) {
+  size_t name_length = strlen(name);
+  const char* pos = query;
+  while (*pos) {
+    const char* end = strchr(pos, '&');
+    if (!end) end = pos + strlen(pos);
+    if ((size_t)(end - pos) > name_length &&
+        strncmp(pos, name, name_length) == 0 &&
+        pos[name_length] == '=') {
+      size_t to_copy = min((size_t)(end - pos) - name_length - 1, value_size - 1);
+      memcpy(value, pos + name_length + 1, to_copy);
+      value[to_copy] = '\0';
+      return true;
+    }
+    pos = *end ? end + 1 : end;
+  }
+  return false;
+}
+
+bool is_scan(int type) {
+  return type == REQUEST_URI_SIMPLE_USERS ||
+         type == REQUEST_URI_PREPARED_USERS;
+}
+
+/* Milliseconds a request of this type gets by default */
+uint64_t route_deadline_ms(int type) {
+  switch (type) {
+    case REQUEST_URI_CASSANDRA:
+      return route_deadlines[ROUTE_DEADLINE_CASSANDRA].deadline_ms;
+    case REQUEST_URI_SIMPLE_USER_SINGLE: /* Fallthrough intended */
+    case REQUEST_URI_PREPARED_USER_SINGLE:
+      return route_deadlines[ROUTE_DEADLINE_USER].deadline_ms;
+    case REQUEST_URI_SIMPLE_USER_MULTIPLE: /* Fallthrough intended */
+    case REQUEST_URI_PREPARED_USER_MULTIPLE:
+      return route_deadlines[ROUTE_DEADLINE_USERS_RANGE].deadline_ms;
+    case REQUEST_URI_SIMPLE_USERS: /* Fallthrough intended */
+    case REQUEST_URI_PREPARED_USERS:
+      return route_deadlines[ROUTE_DEADLINE_USERS].deadline_ms;
+    default:
+      return 0;
+  }
+}
+
+bool route_deadline_set(const char* name, const char* value) {
+  int i;
+  for (i = 0; i < ROUTE_DEADLINE_COUNT; ++i) {
+    if (strcmp(route_deadlines[i].name, name) == 0) {
+      route_deadlines[i].deadline_ms = strtoull(value, NULL, 10);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Driver 1.0 has no per-statement timeout, a statement that was sent runs
+ * until the driver's global request timeout. The deadline can only keep
+ * statements from being sent. */
+bool request_past_deadline(request_t* request) {
+  return request->deadline != 0 && uv_hrtime() >= request->deadline;
+}
+
+/* Fails a slot whose statement won't be sent, it's answered with a 504 */
+void request_slot_expire(request_slot_t* slot) {
+  const char* message = "Deadline exceeded";
+  slot->rc = CASS_ERROR_LIB_REQUEST_TIMED_OUT;
+  fcgi_buffer_append(&slot->fragment, message, strlen(message));
+}
+
+int error_status(CassError rc) {
+  return rc == CASS_ERROR_LIB_REQUEST_TIMED_OUT ? 504 : 500;
+}
+
+bool is_bulk(int type) {
+  return is_scan(type) ||
+         type == REQUEST_URI_SIMPLE_USER_MULTIPLE ||
+         type == REQUEST_URI_PREPARED_USER_MULTIPLE;
+}
+
+/* Binds the username to every parameter of the SELECT or INSERT */
+void bind_user(CassStatement* statement, size_t parameter_count,
+               const char* id, size_t id_length) {
+  CassString id_str = cass_string_init2(id, id_length);
+  size_t i;
+  for (i = 0; i < parameter_count; ++i) {
+    cass_statement_bind_string(statement, i, id_str);
+  }
+}
+
+void on_future(CassFuture* future, void* data) {
+  request_slot_t* slot = (request_slot_t*)data;
+  request_t* request = slot->request;
+
+  trace_mark(&request->trace, TRACE_PHASE_FUTURE);
+
+  slot->rc = cass_future_error_code(future);
+  if (slot->rc == CASS_ERROR_SERVER_UNPREPARED && slot->auto_prepared &&
+      !__atomic_load_n(&request->cancelled, __ATOMIC_RELAXED) &&
+      request_past_deadline(request)) {
+    /* Too late for the retry below, anyone following the flight gets the
+     * same 504 */
+    request_slot_expire(slot);
+  } else if (slot->rc == CASS_ERROR_SERVER_UNPREPARED && slot->auto_prepared &&
+             !__atomic_load_n(&request->cancelled, __ATOMIC_RELAXED)) {
+    /* The query is prepared again in the background, retry this one as a
+     * simple statement so the caller never sees the error */
+    const char* query = slot->query;
+    size_t parameter_count = request->method == POST ? 4 : 1;
+    CassSession* session = (CassSession*)slot->conn->serv->data;
+    CassStatement* statement = cass_statement_new(cass_string_init(query), parameter_count);
+
+    statement_cache_unprepared(slot->statement_cache, query);
+
+    bind_user(statement, parameter_count, slot->key, slot->key_length);
+    /* Not "future", if it's a hedge it belongs to the race */
+    cass_future_free(slot->future);
+    slot->auto_prepared = false;
+    slot->future = cass_session_execute(session, statement);
+    cass_future_set_callback(slot->future, on_future, slot);
+    cass_statement_free(statement);
+    return;
+  }
+
+  if (slot->rc == CASS_OK) {
+    if (request->method == GET && is_scan(request->type)) {
+      const CassResult* result = cass_future_get_result(future);
+      CassIterator* rows = cass_iterator_from_result(result);
+      size_t index = user_row_username_index(result);
+      while (cass_iterator_next(rows)) {
+        const CassRow* row = cass_iterator_get_row(rows);
+        const CassValue* value = cass_row_get_column(row, index);
+
+        CassString username;
+        cass_value_get_string(value, &username);
+        fcgi_buffer_append(&slot->fragment, username.data, username.length);
+        fcgi_buffer_append(&slot->fragment, "\n", 1);
+      }
+      cass_iterator_free(rows);
+      /* Kept around for the paging state of the next page */
+      slot->has_more_pages = cass_result_has_more_pages(result);
+      slot->result = result;
+    } else if (request->method == GET &&
+               request->type != REQUEST_URI_CASSANDRA) {
+      const CassResult* result = cass_future_get_result(future);
+      if (cass_result_row_count(result) > 0) {
+        const CassRow* row = cass_result_first_row(result);
+        user_row_encode(result, row, slot->columns, &slot->fragment);
+        slot->has_row = true;
+
+        user_cache_put(&user_cache, slot->key, slot->key_length,
+                       slot->fragment.data, slot->fragment.length, slot->cache_generation);
+      } else {
+        negative_cache_put(&negative_cache, slot->key, slot->key_length,
+                           slot->negative_generation);
+      }
+      cass_result_free(result);
+    } else if (request->method == POST) {
+      /* Drop anything a concurrent read cached while the insert was running */
+      user_cache_invalidate(&user_cache, slot->key, slot->key_length);
+      negative_cache_invalidate(&negative_cache, slot->key, slot->key_length);
+    }
+  } else if (slot->rc != CASS_ERROR_LIB_REQUEST_TIMED_OUT || slot->fragment.length == 0) {
+    CassString error = cass_future_error_message(future);
+    fcgi_buffer_append(&slot->fragment, error.data, error.length);
+  }
+
+  admission_finish(&admission);
+  scheduler_finish(&scheduler);
+
+  if (slot->flight) {
+    request_complete_flight(slot);
+  }
+  request_complete_slot(slot);
+}
+
+/* Every statement of a request goes through here (or execute_hedged) so
+ * it's counted in flight until on_future. It waits in the request's queue
+ * until the scheduler submits it, an owned statement is freed then. */
+void request_execute(request_slot_t* slot, CassStatement* statement, bool owned) {
+  request_hand_off(slot);
+  admission_start(&admission);
+  slot->statement = statement;
+  slot->owns_statement = owned;
+  scheduler_enqueue(&scheduler, &slot->request->queue, &slot->scheduler_item);
+}
+
+void submit_slot(request_slot_t* slot) {
+  CassSession* session = (CassSession*)slot->conn->serv->data;
+
+  trace_mark_first(&slot->request->trace, TRACE_PHASE_EXECUTE);
+  slot->future = cass_session_execute(session, slot->statement);
+  cass_future_set_callback(slot->future, on_future, slot);
+
+  if (slot->owns_statement) {
+    cass_statement_free(slot->statement);
+  }
+  slot->statement = NULL;
+}
+
+void on_submit(scheduler_item_t* item) {
+  request_slot_t* slot = container_of(item, request_slot_t, scheduler_item);
+
+  /* Flight leaders still run, other requests are waiting for them */
+  if (request_past_deadline(slot->request) && !slot->flight) {
+    if (slot->owns_statement) {
+      cass_statement_free(slot->statement);
+    }
+    slot->statement = NULL;
+    request_slot_expire(slot);
+    admission_finish(&admission);
+    scheduler_finish(&scheduler);
+    request_complete_slot(slot);
+    return;
+  }
+
+  if (slot->batchable && insert_combiner.enabled) {
+    combiner_add(&insert_combiner, &slot->combiner_item,
+                 murmur3_token(slot->key, slot->key_length));
+    return;
+  }
+
+  submit_slot(slot);
+}
+
+/* Every insert of the batch completes with the batch's result */
+void on_insert_batch_future(CassFuture* future, void* data) {
+  combiner_item_t* item = (combiner_item_t*)data;
+  CassError rc = cass_future_error_code(future);
+  CassString error = { NULL, 0 };
+
+  if (rc != CASS_OK) {
+    error = cass_future_error_message(future);
+  }
+
+  while (item) {
+    /* The slot can be reused as soon as it's completed */
+    combiner_item_t* next = item->next_in_list;
+    request_slot_t* slot = container_of(item, request_slot_t, combiner_item);
+
+    trace_mark(&slot->request->trace, TRACE_PHASE_FUTURE);
+    slot->rc = rc;
+    if (rc == CASS_OK) {
+      user_cache_invalidate(&user_cache, slot->key, slot->key_length);
+      negative_cache_invalidate(&negative_cache, slot->key, slot->key_length);
+    } else {
+      fcgi_buffer_append(&slot->fragment, error.data, error.length);
+    }
+
+    admission_finish(&admission);
+    scheduler_finish(&scheduler);
+    request_complete_slot(slot);
+    item = next;
+  }
+
+  cass_future_free(future);
+}
+
+/* Inserts of requests that were cancelled while the combiner held them are
+ * completed without being sent. Returns the rest, in the same order. */
+combiner_item_t* insert_batch_drop_cancelled(combiner_item_t* items, int* count) {
+  combiner_item_t* kept = NULL;
+  combiner_item_t** tail = &kept;
+
+  while (items) {
+    combiner_item_t* next = items->next_in_list;
+    request_slot_t* slot = container_of(items, request_slot_t, combiner_item);
+    if (__atomic_load_n(&slot->request->cancelled, __ATOMIC_RELAXED)) {
+      if (slot->owns_statement) {
+        cass_statement_free(slot->statement);
+      }
+      slot->statement = NULL;
+      admission_finish(&admission);
+      scheduler_finish(&scheduler);
+      request_complete_slot(slot);
+      (*count)--;
+    } else {
+      *tail = items;
+      tail = &items->next_in_list;
+    }
+    items = next;
+  }
+  *tail = NULL;
+
+  return kept;
+}
+
+/* Inserts held by the combiner for the same token range go out as one
+ * unlogged batch, a batch of one is just executed */
+void on_insert_batch(combiner_item_t* items, int count) {
+  request_slot_t* first;
+  CassSession* session;
+  CassBatch* batch;
+  CassFuture* future;
+  combiner_item_t* item;
+
+  items = insert_batch_drop_cancelled(items, &count);
+  if (count == 0) return;
+
+  first = container_of(items, request_slot_t, combiner_item);
+  session = (CassSession*)first->conn->serv->data;
+
+  if (count == 1) {
+    submit_slot(first);
+    return;
+  }
+
+  batch = cass_batch_new(CASS_BATCH_TYPE_UNLOGGED);
+  for (item = items; item; item = item->next_in_list) {
+    request_slot_t* slot = container_of(item, request_slot_t, combiner_item);
+    trace_mark_first(&slot->request->trace, TRACE_PHASE_EXECUTE);
+    cass_batch_add_statement(batch, slot->statement);
+  }
+
+  future = cass_session_execute_batch(session, batch);
+  cass_batch_free(batch);
+
+  for (item = items; item; item = item->next_in_list) {
+    request_slot_t* slot = container_of(item, request_slot_t, combiner_item);
+    if (slot->owns_statement) {
+      cass_statement_free(slot->statement);
+    }
+    slot->statement = NULL;
+  }
+
+  cass_future_set_callback(future, on_insert_batch_future, items);
+}
+
+void hedge_race_release(hedge_race_t* race) {
+  if (__atomic_sub_fetch(&race->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (race->hedge_future) {
+      cass_future_free(race->hedge_future);
+    }
+    cass_statement_free(race->statement);
+    free(race);
+  }
+}
+
+void hedge_race_finish(hedge_race_t* race, CassFuture* future) {
+  if (__atomic_exchange_n(&race->claimed, 1, __ATOMIC_ACQ_REL) == 0) {
+    on_future(future, race->slot);
+  }
+  hedge_race_release(race);
+}
+
+void on_hedged_future(CassFuture* future, void* data) {
+  hedge_race_t* race = (hedge_race_t*)data;
+  hedge_policy_record(race->policy, uv_hrtime() - race->start);
+  hedge_race_finish(race, future);
+}
+
+void on_hedge_future(CassFuture* future, void* data) {
+  hedge_race_finish((hedge_race_t*)data, future);
+}
+
+void on_hedge_timer(uv_timer_t* timer) {
+  request_t* request = (request_t*)timer->data;
+  hedge_race_t* race = request->hedge_race;
+  request->hedge_race = NULL;
+
+  if (!__atomic_load_n(&race->claimed, __ATOMIC_ACQUIRE) &&
+      !request_past_deadline(request) &&
+      hedge_policy_acquire(race->policy)) {
+    CassSession* session = (CassSession*)race->slot->conn->serv->data;
+    __atomic_add_fetch(&race->refs, 1, __ATOMIC_ACQ_REL);
+    race->hedge_future = cass_session_execute(session, race->statement);
+    cass_future_set_callback(race->hedge_future, on_hedge_future, race);
+  }
+  hedge_race_release(race);
+}
+
+void request_cancel_hedge(request_t* request) {
+  if (request->hedge_race) {
+    uv_timer_stop(&request->hedge_timer);
+    hedge_race_release(request->hedge_race);
+    request->hedge_race = NULL;
+  }
+}
+
+/* Stops a request whose connection is gone: statements still waiting in the
+ * scheduler are dropped, completed futures are freed and the ones still
+ * running are freed as they complete. Returns true if slots are still
+ * handed off, the request then frees itself after the last one. */
+bool request_cancel(request_t* request) {
+  scheduler_item_t* dropped = scheduler_queue_clear(&scheduler, &request->queue);
+  scheduler_item_t* item = dropped;
+  bool orphaned;
+  int i;
+
+  request_cancel_hedge(request);
+
+  uv_mutex_lock(&request->mutex);
+  __atomic_store_n(&request->cancelled, true, __ATOMIC_RELAXED);
+
+  /* Never submitted so they'll never complete */
+  while (item) {
+    scheduler_item_t* next = item->next_in_list;
+    request_slot_t* slot = container_of(item, request_slot_t, scheduler_item);
+    if (slot->owns_statement) {
+      cass_statement_free(slot->statement);
+    }
+    slot->statement = NULL;
+    slot->handed_off = false;
+    request->outstanding--;
+    admission_finish(&admission);
+    item = next;
+  }
+
+  for (i = 0; i < request->slots_length; ++i) {
+    request_slot_t* slot = &request->slots[i];
+    if (slot->done) {
+      if (slot->future) {
+        cass_future_free(slot->future);
+        slot->future = NULL;
+      }
+      if (slot->result) {
+        cass_result_free(slot->result);
+        slot->result = NULL;
+      }
+    }
+  }
+  orphaned = request->outstanding > 0;
+  uv_mutex_unlock(&request->mutex);
+
+  /* Other requests follow the dropped leaders, they get a 504 instead of
+   * waiting forever. Done unlocked, followers can be in this request. */
+  for (item = dropped; item; item = item->next_in_list) {
+    request_slot_t* slot = container_of(item, request_slot_t, scheduler_item);
+    if (slot->flight) {
+      request_slot_expire(slot);
+      request_complete_flight(slot);
+    }
+  }
+
+  /* The driver copies what it needs at execute time */
+  if (request->scan_statement) {
+    cass_statement_free(request->scan_statement);
+    request->scan_statement = NULL;
+  }
+
+  return orphaned;
+}
+
+/* Executes a single-user read and arms a timer that sends it again if it
+ * takes longer than the route usually does */
+void execute_hedged(CassSession* session, request_t* request, request_slot_t* slot,
+                    CassStatement* statement, hedge_policy_t* policy) {
+  hedge_race_t* race;
+
+  /* Neither the read nor its hedge go out past the deadline. The flight was
+   * only just started on this thread so nobody is following it yet. */
+  if (request_past_deadline(request)) {
+    cass_statement_free(statement);
+    request_slot_expire(slot);
+    if (slot->flight) {
+      request_complete_flight(slot);
+    }
+    request_complete_slot(slot);
+    return;
+  }
+
+  race = (hedge_race_t*)malloc(sizeof(hedge_race_t));
+  race->slot = slot;
+  race->policy = policy;
+  race->statement = statement;
+  race->hedge_future = NULL;
+  race->start = uv_hrtime();
+  race->refs = 2; /* The primary future and the timer */
+  race->claimed = 0;
+
+  request->hedge_race = race;
+  uv_timer_start(&request->hedge_timer, on_hedge_timer, hedge_policy_start(policy), 0);
+
+  /* Single-key reads are ahead of everything else anyway, a hedge can't wait
+   * in the queue without defeating its purpose */
+  request_hand_off(slot);
+  admission_start(&admission);
+  scheduler_start(&scheduler);
+  trace_mark_first(&request->trace, TRACE_PHASE_EXECUTE);
+  slot->future = cass_session_execute(session, statement);
+  cass_future_set_callback(slot->future, on_hedged_future, race);
+}
+
+void send_status2(fcgi_connection_t* conn, int status, const char* message, size_t message_length) {
+  char temp[512];
+  conn->app_status = status;
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+  snprintf(temp, sizeof(temp), CONTENT_TYPE_TEXT_PLAIN "%.*s", (int)message_length, message);
+  fcgi_buffer_append(&req->outgoing_buf, temp, strlen(temp));
+  fcgi_write_request_send(req);
+}
+
+void send_status(fcgi_connection_t* conn, int status, const char* message) {
+  send_status2(conn, status, message, strlen(message));
+}
+
+void send_unavailable(fcgi_connection_t* conn, const char* message) {
+  const char* headers = "Status: 503 Service Unavailable\r\n"
+                        "Retry-After: 1\r\n"
+                        CONTENT_TYPE_TEXT_PLAIN;
+  conn->app_status = 503;
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+  fcgi_buffer_append(&req->outgoing_buf, headers, strlen(headers));
+  fcgi_buffer_append(&req->outgoing_buf, message, strlen(message));
+  fcgi_write_request_send(req);
+}
+
+void send_user(fcgi_connection_t* conn, request_t* request, request_slot_t* slot) {
+  const char* content_type = user_row_content_type(request->format);
+  conn->app_status = 200;
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+  fcgi_buffer_append(&req->outgoing_buf, content_type, strlen(content_type));
+  user_row_render(request->format, request->columns, slot->fragment.data, slot->fragment.length,
+                  &req->outgoing_buf);
+  fcgi_write_request_send(req);
+}
+
+void insert_user(fcgi_connection_t* conn, request_t* request, 
+                 const char* id, size_t id_length,
+                 bool use_prepared) {
+  request_slot_t* slot = request_append_slot(request, conn, id, id_length);
+  CassStatement* statement;
+  if (use_prepared) {
+    statement = cass_prepared_bind(insert_prepared);
+  } else {
+    slot->query = INSERT_QUERY;
+    slot->statement_cache = &statement_cache;
+    statement = statement_cache_new_statement(&statement_cache, INSERT_QUERY, 4,
+                                              &slot->auto_prepared);
+  }
+  bind_user(statement, 4, id, id_length);
+  user_cache_invalidate(&user_cache, id, id_length);
+  negative_cache_invalidate(&negative_cache, id, id_length);
+  /* A retry after an unprepared error needs its own future */
+  slot->batchable = !slot->auto_prepared;
+  request_execute(slot, statement, true);
+}
+
+void projection_init() {
+  int columns;
+  int i;
+
+  for (columns = 0; columns < USER_ROW_PROJECTIONS; ++columns) {
+    char* query = projection_queries[columns];
+    size_t length = snprintf(query, PROJECTION_MAX_QUERY_LENGTH, "SELECT %s", user_row_column_name(0));
+    for (i = 1; i < USER_ROW_COLUMNS; ++i) {
+      if (columns & (1 << i)) {
+        length += snprintf(query + length, PROJECTION_MAX_QUERY_LENGTH - length,
+                           ", %s", user_row_column_name(i));
+      }
+    }
+    snprintf(query + length, PROJECTION_MAX_QUERY_LENGTH - length, PROJECTION_QUERY_WHERE);
+  }
+}
+
+void select_user(fcgi_connection_t* conn, request_t* request,
+                 const char* id, size_t id_length, 
+                 bool use_prepared) {
+  request_slot_t* slot = request_append_slot(request, conn, id, id_length);
+  int columns = request->columns;
+  if (user_cache_get(&user_cache, id, id_length, &slot->fragment)) {
+    int cached = user_row_columns(slot->fragment.data, slot->fragment.length);
+    if ((cached & columns) == columns) {
+      slot->has_row = true;
+      request_complete_slot(slot);
+      return;
+    }
+    /* Also read what the cached row had so the cache isn't narrowed */
+    columns |= cached;
+    fcgi_buffer_reset(&slot->fragment);
+  }
+
+  /* Known missing users are answered with a 404 without touching the cluster */
+  if (negative_cache_contains(&negative_cache, id, id_length)) {
+    request_complete_slot(slot);
+    return;
+  }
+
+  /* The prepared routes read the default projection whole with
+   * select_prepared, only picked fields go through projection_statements */
+  if (use_prepared && !request->picked_columns) {
+    columns = USER_ROW_ALL_COLUMNS;
+  }
+
+  /* Concurrent identical reads wait for the first one's result. The leader
+   * can complete this slot as soon as it's joined. */
+  const void* flight = &projection_flights[use_prepared][columns];
+  slot->columns = columns;
+  request_hand_off(slot);
+  if (!single_flight_join(&select_flights, flight, id, id_length, &slot->waiter)) {
+    return;
+  }
+  slot->flight = flight;
+  slot->cache_generation = user_cache_generation(&user_cache, id, id_length);
+  slot->negative_generation = negative_cache_generation(&negative_cache, id, id_length);
+
+  CassSession* session = (CassSession*)conn->serv->data;
+  CassStatement* statement;
+  if (use_prepared && columns == USER_ROW_ALL_COLUMNS) {
+    statement = cass_prepared_bind(select_prepared);
+  } else {
+    slot->query = projection_queries[columns];
+    slot->statement_cache = use_prepared ? &projection_statements : &statement_cache;
+    statement = statement_cache_new_statement(slot->statement_cache, slot->query, 1,
+                                              &slot->auto_prepared);
+  }
+  bind_user(statement, 1, id, id_length);
+
+  hedge_policy_t* policy = use_prepared ? &prepared_hedge_policy : &simple_hedge_policy;
+  if (policy->enabled &&
+      (request->type == REQUEST_URI_SIMPLE_USER_SINGLE ||
+       request->type == REQUEST_URI_PREPARED_USER_SINGLE)) {
+    execute_hedged(session, request, slot, statement, policy);
+    return;
+  }
+
+  request_execute(slot, statement, true);
+}
+
+void scan_fetch_page(fcgi_connection_t* conn, request_t* request) {
+  request->slots_length = 0;
+  request->futures_count = 0;
+  request_slot_t* slot = request_append_slot(request, conn, "", 0);
+  request_execute(slot, request->scan_statement, false);
+}
+
+void scan_users(fcgi_connection_t* conn, request_t* request,
+                const char* query_string, bool use_prepared) {
+  char temp[32];
+  int64_t start_token = INT64_MIN;
+  int64_t end_token = INT64_MAX;
+  int page_size = DEFAULT_SCAN_PAGE_SIZE;
+
+  if (query_get(query_string, "start_token", temp, sizeof(temp))) {
+    start_token = strtoll(temp, NULL, 10);
+  }
+  if (query_get(query_string, "end_token", temp, sizeof(temp))) {
+    end_token = strtoll(temp, NULL, 10);
+  }
+  if (query_get(query_string, "page_size", temp, sizeof(temp))) {
+    page_size = atoi(temp);
+    if (page_size <= 0) page_size = DEFAULT_SCAN_PAGE_SIZE;
+  }
+
+  CassStatement* statement;
+  if (use_prepared) {
+    statement = cass_prepared_bind(scan_prepared);
+  } else {
+    statement = cass_statement_new(cass_string_init(SCAN_QUERY), 2);
+  }
+  cass_statement_bind_int64(statement, 0, start_token);
+  cass_statement_bind_int64(statement, 1, end_token);
+  cass_statement_set_paging_size(statement, page_size);
+
+  request->scan_statement = statement;
+  scan_fetch_page(conn, request);
+}
 
-typedef struct request_s {
-  int method;
-  int type;
+/* Streams out the page that just arrived and starts fetching the next one
+ * while it's being written */
+void scan_process_page(fcgi_connection_t* conn, request_t* request) {
+  request_slot_t* slot = &request->slots[0];
+  const CassResult* result = slot->result;
+  bool has_more_pages = slot->has_more_pages;
 
-  int futures_capacity;
-  int futures_length;
-  int futures_count;
-  CassFuture** futures;
+  slot->result = NULL;
 
-  uv_mutex_t mutex;
-} request_t;
+  if (slot->rc != CASS_OK) {
+    LOGGER_WRITE("Query error: %.*s\n",  (int)slot->fragment.length, slot->fragment.data);
+    if (!request->stream_started) {
+      send_status2(conn, error_status(slot->rc), slot->fragment.data, slot->fragment.length);
+    } else {
+      /* Too late for a status line, end the stream with a failed app status */
+      conn->app_status = 500;
+      fcgi_write_request_send(fcgi_connection_get_write_request(conn, FCGI_STDOUT));
+    }
+    request_free_futures(request);
+    cass_statement_free(request->scan_statement);
+    request->scan_statement = NULL;
+    return;
+  }
 
-#define INITIAL_CAPACITY 256
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+  if (!request->stream_started) {
+    fcgi_buffer_append(&req->outgoing_buf, CONTENT_TYPE_TEXT_PLAIN, strlen(CONTENT_TYPE_TEXT_PLAIN));
+    request->stream_started = true;
+  }
+  fcgi_buffer_append(&req->outgoing_buf, slot->fragment.data, slot->fragment.length);
+  request_free_futures(request);
 
-#define SELECT_QUERY "SELECT username, firstname, lastname, " \
-  "password, email, created_date "        \
-"FROM videodb.users WHERE username = ?"
+  if (has_more_pages && !conn->is_closed) {
+    cass_statement_set_paging_state(request->scan_statement, result);
+    cass_result_free(result);
+    request->stream_write_pending = true;
+    scan_fetch_page(conn, request);
+    fcgi_write_request_flush(req);
+  } else {
+    cass_result_free(result);
+    cass_statement_free(request->scan_statement);
+    request->scan_statement = NULL;
+    fcgi_write_request_send(req);
+  }
+}
 
-#define INSERT_QUERY "INSERT INTO videodb.users " \
-  "(username, firstname, lastname, password, created_date) " \
-  "VALUES (?, ?, ?, ?, unixTimestampOf(now()))"
+void stream_users_begin(request_t* request, fcgi_write_req_t* req) {
+  if (!request->stream_started) {
+    const char* content_type = user_row_content_type(request->format);
+    fcgi_buffer_append(&req->outgoing_buf, content_type, strlen(content_type));
+    user_row_render_begin(request->format, &req->outgoing_buf);
+    request->stream_started = true;
+  }
+}
 
-const CassPrepared* select_prepared;
-const CassPrepared* insert_prepared;
+/* Writes out the longest prefix of completed users. Nothing can be ended
+ * before every future completed because their slots get reused by the
+ * connection's next request. */
+void stream_users(fcgi_connection_t* conn, request_t* request) {
+  int end = request->next_slot;
+  int i;
 
-CassError prepare_query(CassSession* session, const char* query, const CassPrepared** prepared) {
-  CassError rc = CASS_OK;
-  CassFuture* future = NULL;
+  uv_mutex_lock(&request->mutex);
+  while (end < request->slots_length && request->slots[end].done) {
+    end++;
+  }
+  uv_mutex_unlock(&request->mutex);
 
-  future = cass_session_prepare(session, cass_string_init(query));
-  cass_future_wait(future);
+  if (end == request->next_slot) return;
 
-  rc = cass_future_error_code(future);
-  if (rc != CASS_OK) {
-    CassString error = cass_future_error_message(future);
-    fprintf(stderr, "Query error: %.*s\n",  (int)error.length, error.data);
+  fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+
+  for (i = request->next_slot; i < end; ++i) {
+    request_slot_t* slot = &request->slots[i];
+    if (slot->rc != CASS_OK) {
+      request->stream_failed = true;
+    }
+    if (!request->stream_failed && slot->has_row) {
+      stream_users_begin(request, req);
+      /* Plain text keeps its original separators */
+      if (request->format == USER_ROW_FORMAT_TEXT ? i > 0 : request->stream_rows > 0) {
+        user_row_render_separator(request->format, &req->outgoing_buf);
+      }
+      user_row_render(request->format, request->columns, slot->fragment.data, slot->fragment.length,
+                      &req->outgoing_buf);
+      request->stream_rows++;
+    }
+    if (slot->future) {
+      cass_future_free(slot->future);
+      slot->future = NULL;
+    }
+  }
+  request->next_slot = end;
+
+  if (end == request->slots_length) {
+    if (request->stream_failed) {
+      if (!request->stream_started) {
+        fcgi_buffer_reset(&req->outgoing_buf);
+        fcgi_buffer_append(&req->outgoing_buf, CONTENT_TYPE_TEXT_PLAIN, strlen(CONTENT_TYPE_TEXT_PLAIN));
+        fcgi_buffer_append(&req->outgoing_buf, "Query failures", strlen("Query failures"));
+      }
+      /* Once the stream has started the failure only shows in the app status */
+      conn->app_status = 500;
+    } else {
+      stream_users_begin(request, req);
+      user_row_render_end(request->format, &req->outgoing_buf);
+    }
+    fcgi_write_request_send(req);
   } else {
-    *prepared = cass_future_get_prepared(future);
+    request->stream_write_pending = true;
+    fcgi_write_request_flush(req);
   }
+}
 
-  cass_future_free(future);
+void ingest_start(fcgi_connection_t* conn, request_t* request,
+                  const char* content_type, bool use_prepared) {
+  ingest_t* ingest = &request->ingest;
+  int i;
 
-  return rc;
-}
+  ingest_parser_reset(&ingest->parser, ingest_parse_format(content_type));
+  ingest->eof = false;
+  ingest->finished = false;
+  ingest->use_prepared = use_prepared;
+  ingest->in_flight = 0;
+  ingest->inserted = 0;
+  ingest->failed = 0;
+  fcgi_buffer_reset(&ingest->errors);
 
-void request_init(request_t* request) {
-  request->method = 0;
-  request->type = 0;
-  request->futures = (CassFuture**)malloc(INITIAL_CAPACITY * sizeof(CassFuture*));
-  request->futures_capacity = INITIAL_CAPACITY;
-  request->futures_length = 0;
-  request->futures_count = 0;
-  uv_mutex_init(&request->mutex);
+  request->stream = true;
+  request_reserve(request, INGEST_WINDOW);
+  request->slots_length = INGEST_WINDOW;
+  for (i = 0; i < INGEST_WINDOW; ++i) {
+    request_slot_init(request, &request->slots[i], conn);
+    ingest->free_slots[i] = INGEST_WINDOW - 1 - i;
+  }
+  ingest->free_count = INGEST_WINDOW;
+
+  conn->stream_stdin = true;
 }
 
-void request_reset(request_t* request) {
-  request->method = 0;
-  request->type = 0;
-  request->futures_length = 0;
-  request->futures_count = 0;
+void ingest_report(ingest_t* ingest, uint64_t row_number, const char* error, size_t error_length) {
+  char temp[32];
+  if (ingest->failed++ < INGEST_MAX_ERROR_LINES) {
+    snprintf(temp, sizeof(temp), "row %llu: ", (unsigned long long)row_number);
+    fcgi_buffer_append(&ingest->errors, temp, strlen(temp));
+    fcgi_buffer_append(&ingest->errors, error, error_length);
+    fcgi_buffer_append(&ingest->errors, "\n", 1);
+  }
 }
 
-void request_append_future(request_t* request, CassFuture* future) {
-  if (request->futures_length + 1 > request->futures_capacity) {
-    size_t new_capacity = request->futures_capacity < 4096 
-                        ? request->futures_capacity * 2 
-                        : request->futures_capacity + 1024;
-    request->futures = (CassFuture**)realloc(request->futures, 
-                                             new_capacity * sizeof(CassFuture*));
-    request->futures_capacity = new_capacity;
+void ingest_execute(fcgi_connection_t* conn, request_t* request, ingest_row_t* row) {
+  ingest_t* ingest = &request->ingest;
+  request_slot_t* slot = &request->slots[ingest->free_slots[--ingest->free_count]];
+  CassStatement* statement;
+  int i;
+
+  request_slot_init(request, slot, conn);
+  fcgi_buffer_reset(&slot->owned_key);
+  fcgi_buffer_append(&slot->owned_key, row->fields[INGEST_FIELD_USERNAME].data,
+                     row->fields[INGEST_FIELD_USERNAME].length);
+  slot->key = slot->owned_key.data;
+  slot->key_length = slot->owned_key.length;
+  slot->row_number = row->number;
+
+  /* Rows aren't kept around so these can't go through the auto-prepare
+   * retry, which rebinds from the key alone */
+  if (ingest->use_prepared) {
+    statement = cass_prepared_bind(insert_prepared);
+  } else {
+    statement = cass_statement_new(cass_string_init(INSERT_QUERY), 4);
+  }
+  for (i = 0; i < INGEST_FIELD_COUNT; ++i) {
+    cass_statement_bind_string(statement, i, row->fields[i]);
   }
-  request->futures[request->futures_length++] = future;
+
+  user_cache_invalidate(&user_cache, slot->key, slot->key_length);
+  negative_cache_invalidate(&negative_cache, slot->key, slot->key_length);
+
+  ingest->in_flight++;
+  request_execute(slot, statement, true);
 }
 
-int stoi(request_uri_section_t* s) {
-  char temp[512];
-  size_t to_copy = min(sizeof(temp), (size_t)(s->end - s->start));
-  memcpy(temp, s->start, to_copy);
-  temp[to_copy] = '\0';
-  return atoi(temp);
+/* Starts as many rows as the window allows, applies back pressure on the
+ * upload and answers once everything has been inserted */
+void ingest_pump(fcgi_connection_t* conn, request_t* request) {
+  ingest_t* ingest = &request->ingest;
+  ingest_row_t row;
+  int rc;
+
+  /* Late wakeups once the response is out */
+  if (ingest->finished) return;
+
+  while (ingest->free_count > 0 &&
+         (rc = ingest_parser_next(&ingest->parser, ingest->eof, &row)) != INGEST_NEED_MORE) {
+    if (rc == INGEST_ERROR) {
+      ingest_report(ingest, row.number, row.error, strlen(row.error));
+    } else {
+      ingest_execute(conn, request, &row);
+    }
+  }
+
+  if (!ingest->eof) {
+    size_t buffered = ingest_parser_buffered(&ingest->parser);
+    if (buffered > INGEST_HIGH_WATER_MARK) {
+      fcgi_connection_pause(conn);
+    } else if (buffered < INGEST_LOW_WATER_MARK) {
+      fcgi_connection_resume(conn);
+    }
+  } else if (ingest->in_flight == 0) {
+    char temp[64];
+    ingest->finished = true;
+    conn->app_status = ingest->failed > 0 ? 500 : 200;
+    fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
+    snprintf(temp, sizeof(temp), CONTENT_TYPE_TEXT_PLAIN "inserted %llu\nfailed %llu\n",
+             (unsigned long long)ingest->inserted, (unsigned long long)ingest->failed);
+    fcgi_buffer_append(&req->outgoing_buf, temp, strlen(temp));
+    fcgi_buffer_append(&req->outgoing_buf, ingest->errors.data, ingest->errors.length);
+    fcgi_write_request_send(req);
+  }
 }
 
-void on_future(CassFuture* future, void* data) {
-  fcgi_connection_t* conn = (fcgi_connection_t*)data;
-  request_t* request = (request_t*)conn->data;
+/* Returns the slots of completed inserts to the window */
+void ingest_collect(request_t* request) {
+  ingest_t* ingest = &request->ingest;
+  int i;
+
   uv_mutex_lock(&request->mutex);
-  if(--request->futures_count <= 0) {
-    fcgi_connection_notify(conn);
+  for (i = 0; i < INGEST_WINDOW; ++i) {
+    request_slot_t* slot = &request->slots[i];
+    /* Rows skipped past their deadline complete without a future */
+    if (!slot->done) continue;
+
+    if (slot->rc == CASS_OK) {
+      ingest->inserted++;
+    } else {
+      ingest_report(ingest, slot->row_number, slot->fragment.data, slot->fragment.length);
+    }
+
+    if (slot->future) {
+      cass_future_free(slot->future);
+      slot->future = NULL;
+    }
+    /* Free slots aren't done so they're only collected once */
+    slot->done = false;
+    ingest->free_slots[ingest->free_count++] = i;
+    ingest->in_flight--;
   }
   uv_mutex_unlock(&request->mutex);
 }
 
-void send_status2(fcgi_connection_t* conn, int status, const char* message, size_t message_length) {
-  char temp[512];
-  conn->app_status = status;
+/* Checks what a request is about to send to the cluster against what's
+ * already in flight */
+bool admit_request(int type, bool post, request_uri_section_t* sections) {
+  switch (type) {
+    case REQUEST_URI_CASSANDRA: /* Fallthrough intended */
+    case REQUEST_URI_SIMPLE_USER_SINGLE:
+    case REQUEST_URI_PREPARED_USER_SINGLE:
+      return admission_admit(&admission, 1, false);
+    case REQUEST_URI_SIMPLE_USER_MULTIPLE: /* Fallthrough intended */
+    case REQUEST_URI_PREPARED_USER_MULTIPLE:
+      {
+        int count = stoi(&sections[1]) - stoi(&sections[0]);
+        return count <= 0 || admission_admit(&admission, count, true);
+      }
+    case REQUEST_URI_SIMPLE_USERS: /* Fallthrough intended */
+    case REQUEST_URI_PREPARED_USERS:
+      /* An upload keeps a window of inserts in flight, a scan one page */
+      return admission_admit(&admission, post ? INGEST_WINDOW : 1, true);
+    default:
+      return true;
+  }
+}
+
+void send_traces(fcgi_connection_t* conn) {
+  trace_t* traces = (trace_t*)malloc(trace_ring.capacity * sizeof(trace_t));
+  size_t count = trace_ring_snapshot(&trace_ring, traces, trace_ring.capacity);
+  size_t i;
+
   fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
-  snprintf(temp, sizeof(temp), CONTENT_TYPE_TEXT_PLAIN "%.*s", (int)message_length, message);
-  fcgi_buffer_append(&req->outgoing_buf, temp, strlen(temp));
+  fcgi_buffer_append(&req->outgoing_buf, CONTENT_TYPE_TEXT_PLAIN, strlen(CONTENT_TYPE_TEXT_PLAIN));
+  for (i = 0; i < count; ++i) {
+    trace_format(&traces[i], &req->outgoing_buf);
+  }
   fcgi_write_request_send(req);
+
+  free(traces);
 }
 
-void send_status(fcgi_connection_t* conn, int status, const char* message) {
-  send_status2(conn, status, message, strlen(message));
+void on_trace_signal(uv_signal_t* signal, int signum) {
+  trace_ring_dump(&trace_ring, stderr);
 }
 
-void insert_user(fcgi_connection_t* conn, request_t* request, 
-                 const char* id, size_t id_length,
-                 bool use_prepared) {
-  CassString id_str = cass_string_init2(id, id_length); 
-  CassSession* session = (CassSession*)conn->serv->data;
-  CassString query = cass_string_init(INSERT_QUERY);
-  CassStatement* statement;
-  if (use_prepared) {
-    statement = cass_prepared_bind(insert_prepared);
-  } else {
-    statement = cass_statement_new(query, 4);
-  }
-  cass_statement_bind_string(statement, 0, id_str);
-  cass_statement_bind_string(statement, 1, id_str);
-  cass_statement_bind_string(statement, 2, id_str);
-  cass_statement_bind_string(statement, 3, id_str);
-  CassFuture* future = cass_session_execute(session, statement);
-  request_append_future(request, future);
-  cass_future_set_callback(future, on_future, conn);
-  cass_statement_free(statement);
+void on_cache_snapshot_work(uv_work_t* work) {
+  user_cache_snapshot_save(&user_cache, cache_snapshot_file);
 }
 
-void select_user(fcgi_connection_t* conn, request_t* request, 
-                 const char* id, size_t id_length, 
-                 bool use_prepared) {
-  CassString id_str = cass_string_init2(id, id_length); 
-  CassSession* session = (CassSession*)conn->serv->data;
-  CassString query = cass_string_init(SELECT_QUERY);
-  CassStatement* statement;
-  if (use_prepared) {
-    statement = cass_prepared_bind(select_prepared);
-  } else {
-    statement = cass_statement_new(query, 1);
+void on_cache_snapshot_saved(uv_work_t* work, int status) {
+  cache_snapshot_saving = false;
+}
+
+void on_cache_snapshot_timer(uv_timer_t* timer) {
+  /* A save that takes longer than the interval skips a turn */
+  if (cache_snapshot_saving) return;
+  cache_snapshot_saving = true;
+  uv_queue_work(timer->loop, &cache_snapshot_work, on_cache_snapshot_work, on_cache_snapshot_saved);
+}
+
+/* Waits for a periodic save that's still running, then saves the latest */
+void on_shutdown_signal(uv_signal_t* signal, int signum) {
+  user_cache_snapshot_save(&user_cache, cache_snapshot_file);
+  uv_stop(signal->loop);
+}
+
+request_t* request_get(fcgi_connection_t* conn) {
+  request_t* request = (request_t*)conn->data;
+  if (!request) {
+    request = (request_t*)malloc(sizeof(request_t));
+    request_init(request, &conn->serv->loop);
+    conn->data = request;
   }
-  cass_statement_bind_string(statement, 0, id_str);
-  CassFuture* future = cass_session_execute(session, statement);
-  request_append_future(request, future);
-  cass_future_set_callback(future, on_future, conn);
-  cass_statement_free(statement);
+  return request;
 }
 
 void handle(fcgi_connection_t* conn, int type) {
   char request_method[16];
   char request_uri[512];
+  char query_string[512];
+  char content_type[128];
+  char deadline_header[32];
 
   request_method[0] = '\0';
   request_uri[0] = '\0';
+  query_string[0] = '\0';
+  content_type[0] = '\0';
+  deadline_header[0] = '\0';
 
-  if (type == FCGI_STATE_PARAMS) {
+  if (type == FCGI_STATE_BEGIN) {
+    request_t* request = request_get(conn);
+    trace_reset(&request->trace);
+    trace_mark(&request->trace, TRACE_PHASE_BEGIN);
+  } else if (type == FCGI_STATE_PARAMS) {
     fcgi_params_t params;
     fcgi_params_init(&params, &conn->incoming_buf);
 
@@ -188,6 +1635,18 @@ void handle(fcgi_connection_t* conn, int type) {
         size_t to_copy = min(params.value_length, sizeof(request_method) - 1);
         memcpy(request_method, params.value, to_copy);
         request_method[to_copy] = '\0';
+      } else if (strncmp(params.name, "QUERY_STRING", params.name_length) == 0) {
+        size_t to_copy = min(params.value_length, sizeof(query_string) - 1);
+        memcpy(query_string, params.value, to_copy);
+        query_string[to_copy] = '\0';
+      } else if (strncmp(params.name, "CONTENT_TYPE", params.name_length) == 0) {
+        size_t to_copy = min(params.value_length, sizeof(content_type) - 1);
+        memcpy(content_type, params.value, to_copy);
+        content_type[to_copy] = '\0';
+      } else if (strncmp(params.name, "HTTP_X_DEADLINE_MS", params.name_length) == 0) {
+        size_t to_copy = min(params.value_length, sizeof(deadline_header) - 1);
+        memcpy(deadline_header, params.value, to_copy);
+        deadline_header[to_copy] = '\0';
       }
       //printf("%.*s : %.*s\n", (int)params.name_length, params.name,
       //                        (int)params.value_length, params.value);
@@ -195,22 +1654,72 @@ void handle(fcgi_connection_t* conn, int type) {
 
     //printf("%s %s (conn %p)\n", request_method, request_uri, conn);
 
-    request_t* request;
-    if (!conn->data) {
-      request = (request_t*)malloc(sizeof(request_t));
-      request_init(request);
-      conn->data = request;
-    } else {
-      request = (request_t*)conn->data;
-      request_reset(request);
-    }
+    request_t* request = request_get(conn);
+    request_reset(request);
+
+    trace_set_request(&request->trace, request_method, request_uri);
+    trace_mark(&request->trace, TRACE_PHASE_PARAMS);
 
+    /* The query string is passed separately */
+    char* query = strchr(request_uri, '?');
+    if (query) *query = '\0';
 
     request_uri_section_t sections[2];
     request->type =  parse_request_uri(request_uri, sections);
 
+    /* Everything but the root needs the session and prepared statements */
+    if (!startup.ready && request->type != REQUEST_URI_ROOT &&
+        request->type != REQUEST_URI_TRACE) {
+      send_unavailable(conn, "Starting up");
+      return;
+    }
+
+    /* Shed load before anything is queued on the driver */
+    if (!admit_request(request->type, strcmp(request_method, "POST") == 0, sections)) {
+      conn->proto_status = FCGI_OVERLOADED;
+      send_unavailable(conn, "Overloaded");
+      return;
+    }
+
+    scheduler_queue_set_weight(&request->queue, is_bulk(request->type) ? SCHEDULER_WEIGHT_BULK
+                                                                       : SCHEDULER_WEIGHT_SINGLE);
+
+    char format[16];
+    if (query_get(query_string, "format", format, sizeof(format))) {
+      request->format = user_row_parse_format(format);
+    }
+
+    /* Plain text only has the username, the other formats have every
+     * column unless "fields" picks some */
+    char fields[128];
+    if (request->format == USER_ROW_FORMAT_TEXT) {
+      request->columns = USER_ROW_COLUMN_USERNAME;
+    } else if (query_get(query_string, "fields", fields, sizeof(fields))) {
+      request->columns = user_row_parse_columns(fields);
+      request->picked_columns = true;
+      if (request->columns < 0) {
+        send_status(conn, 400, "Unknown field");
+        return;
+      }
+    }
+
+    /* The budget starts when the request came in, a deadline_ms parameter
+     * or X-Deadline-Ms header overrides the route's */
+    char deadline[32];
+    uint64_t deadline_ms = route_deadline_ms(request->type);
+    if (query_get(query_string, "deadline_ms", deadline, sizeof(deadline))) {
+      deadline_ms = strtoull(deadline, NULL, 10);
+    } else if (deadline_header[0] != '\0') {
+      deadline_ms = strtoull(deadline_header, NULL, 10);
+    }
+    if (deadline_ms > 0) {
+      uint64_t start = request->trace.times[TRACE_PHASE_BEGIN];
+      request->deadline = (start ? start : uv_hrtime()) + deadline_ms * 1000 * 1000;
+    }
+
     bool prepared = request->type == REQUEST_URI_PREPARED_USER_SINGLE ||
-                    request->type == REQUEST_URI_PREPARED_USER_MULTIPLE;
+                    request->type == REQUEST_URI_PREPARED_USER_MULTIPLE ||
+                    request->type == REQUEST_URI_PREPARED_USERS;
     if (strcmp(request_method, "GET") == 0) {
       request->method = GET;
       switch (request->type) {
@@ -224,13 +1733,10 @@ void handle(fcgi_connection_t* conn, int type) {
           break;
         case REQUEST_URI_CASSANDRA:
           {
-            CassSession* session = (CassSession*)conn->serv->data;
             CassString query = cass_string_init("SELECT NOW() FROM system.local");
             CassStatement* statement = cass_statement_new(query, 0);
-            CassFuture* future = cass_session_execute(session, statement);
-            request_append_future(request, future);
-            cass_future_set_callback(future, on_future, conn);
-            cass_statement_free(statement);
+            request_slot_t* slot = request_append_slot(request, conn, "", 0);
+            request_execute(slot, statement, true);
           }
           break;
         case REQUEST_URI_SIMPLE_USER_SINGLE: /* Fallthrough intended */
@@ -248,6 +1754,8 @@ void handle(fcgi_connection_t* conn, int type) {
               send_status(conn, 204, "No content");
             } else {
               request->futures_count = nbusers - id;
+              request->stream = true;
+              request_reserve(request, nbusers - id);
 
               int i;
               for (i = id; i < nbusers; ++i) {
@@ -257,6 +1765,13 @@ void handle(fcgi_connection_t* conn, int type) {
             }
           }
           break;
+        case REQUEST_URI_SIMPLE_USERS: /* Fallthrough intended */
+        case REQUEST_URI_PREPARED_USERS:
+          scan_users(conn, request, query_string, prepared);
+          break;
+        case REQUEST_URI_TRACE:
+          send_traces(conn);
+          break;
         default:
           send_status(conn, 404, "Not found");
           break;
@@ -280,6 +1795,7 @@ void handle(fcgi_connection_t* conn, int type) {
               send_status(conn, 200, "OK");
             } else {
               request->futures_count = nbusers - id;
+              request_reserve(request, nbusers - id);
 
               int i;
               for (i = id; i < nbusers; ++i) {
@@ -289,6 +1805,12 @@ void handle(fcgi_connection_t* conn, int type) {
             }
           }
           break;
+
+        case REQUEST_URI_SIMPLE_USERS: /* Fallthrough intended */
+        case REQUEST_URI_PREPARED_USERS:
+          ingest_start(conn, request, content_type, prepared);
+          break;
+
         default:
           send_status(conn, 501, "Not implemented");
           break;
@@ -296,37 +1818,72 @@ void handle(fcgi_connection_t* conn, int type) {
     } else {
       send_status(conn, 501, "Not implemented");
     }
+  } else if (type == FCGI_STATE_STDIN_DATA) {
+    request_t* request = (request_t*)conn->data;
+    ingest_parser_feed(&request->ingest.parser, conn->incoming_buf.data, conn->incoming_buf.length);
+    ingest_pump(conn, request);
   } else if (type == FCGI_STATE_STDIN) {
+    request_t* request = (request_t*)conn->data;
+    if (conn->stream_stdin) {
+      request->ingest.eof = true;
+      ingest_pump(conn, request);
+    }
   } else if (type == FCGI_STATE_NOTIFY) {
     request_t* request = (request_t*)conn->data;
+    /* Wakeups sent before the request was cancelled can still arrive */
+    if (!request || request->cancelled) return;
+    trace_mark(&request->trace, TRACE_PHASE_NOTIFY);
     switch(request->type) {
       case REQUEST_URI_SIMPLE_USER_SINGLE: /* Fallthrough intended */
       case REQUEST_URI_PREPARED_USER_SINGLE:
         {
-          CassFuture* future = request->futures[0];
-          if (cass_future_error_code(future) == CASS_OK) {
+          request_slot_t* slot = &request->slots[0];
+          bool done;
+
+          /* A multi-user stream notifies per user so a late wakeup from the
+           * previous request on this connection can land here */
+          uv_mutex_lock(&request->mutex);
+          done = request->slots_length > 0 && slot->done;
+          uv_mutex_unlock(&request->mutex);
+          if (!done) break;
+
+          request_cancel_hedge(request);
+
+          if (slot->rc == CASS_OK) {
             if (request->method == GET) {
-              const CassResult* result = cass_future_get_result(future);
-              if (cass_result_row_count(result) > 0) {
-                const CassRow* row = cass_result_first_row(result);
-                const CassValue* value = cass_row_get_column_by_name(row, "username");
-
-                CassString username;
-                cass_value_get_string(value, &username);
-                send_status2(conn, 200, username.data, username.length);
+              if (slot->has_row) {
+                send_user(conn, request, slot);
               } else {
                 send_status(conn, 404, "Not found");
               }
-              cass_result_free(result);
             } else {
               send_status(conn, 201, "Created");
             }
           } else {
-            CassString error = cass_future_error_message(future);
-            fprintf(stderr, "Query error: %.*s\n",  (int)error.length, error.data);
-            send_status2(conn, 500, error.data, error.length);
+            LOGGER_WRITE("Query error: %.*s\n",  (int)slot->fragment.length, slot->fragment.data);
+            send_status2(conn, error_status(slot->rc), slot->fragment.data, slot->fragment.length);
           }
-          cass_future_free(future);
+          request_free_futures(request);
+        }
+        break;
+
+      case REQUEST_URI_SIMPLE_USERS: /* Fallthrough intended */
+      case REQUEST_URI_PREPARED_USERS:
+        if (request->method == POST) {
+          ingest_collect(request);
+          ingest_pump(conn, request);
+        } else if (request->stream_write_pending) {
+          request->stream_notify_pending = true;
+        } else {
+          bool done;
+
+          /* Same as above, the page might not be there yet */
+          uv_mutex_lock(&request->mutex);
+          done = request->slots_length > 0 && request->slots[0].done;
+          uv_mutex_unlock(&request->mutex);
+          if (!done) break;
+
+          scan_process_page(conn, request);
         }
         break;
 
@@ -334,53 +1891,22 @@ void handle(fcgi_connection_t* conn, int type) {
       case REQUEST_URI_PREPARED_USER_MULTIPLE:
         {
           if (request->method == GET) {
-            int query_failure_count = 0;
-            int i;
-            for (i = 0; i < request->futures_length; ++i) {
-              CassFuture* future = request->futures[i];
-              if (cass_future_error_code(future) != CASS_OK) {
-                query_failure_count++;
-                //CassString error = cass_future_error_message(future);
-                //fprintf(stderr, "Query error: %.*s\n",  (int)error.length, error.data);
-              }
-            }
-
-            if (query_failure_count == 0) {
-              fcgi_write_req_t* req = fcgi_connection_get_write_request(conn, FCGI_STDOUT);
-              fcgi_buffer_append(&req->outgoing_buf, CONTENT_TYPE_TEXT_PLAIN, strlen(CONTENT_TYPE_TEXT_PLAIN));
-              for (i = 0; i < request->futures_length; ++i) {
-                CassFuture* future = request->futures[i];
-                const CassResult* result = cass_future_get_result(future);
-                if (cass_result_row_count(result) > 0) {
-                  const CassRow* row = cass_result_first_row(result);
-                  const CassValue* value = cass_row_get_column_by_name(row, "username");
-                  CassString username;
-                  cass_value_get_string(value, &username);
-                  if (i > 0) {
-                    fcgi_buffer_append(&req->outgoing_buf, ",", 1);
-                  }
-                  fcgi_buffer_append(&req->outgoing_buf, username.data, username.length);
-                }
-                cass_result_free(result);
-                cass_future_free(future);
-              }
-              fcgi_write_request_send(req);
+            if (request->stream_write_pending) {
+              request->stream_notify_pending = true;
             } else {
-              send_status(conn, 500, "Query failures");
+              stream_users(conn, request);
             }
-            
           } else {
             int query_failure_count = 0;
             int i;
-            for (i = 0; i < request->futures_length; ++i) {
-              CassFuture* future = request->futures[i];
-              if (cass_future_error_code(future) != CASS_OK) {
+            for (i = 0; i < request->slots_length; ++i) {
+              request_slot_t* slot = &request->slots[i];
+              if (slot->rc != CASS_OK) {
                 query_failure_count++;
-                CassString error = cass_future_error_message(future);
-                fprintf(stderr, "Query error: %.*s\n",  (int)error.length, error.data);
+                LOGGER_WRITE("Query error: %.*s\n",  (int)slot->fragment.length, slot->fragment.data);
               }
-              cass_future_free(future);
             }
+            request_free_futures(request);
 
             if (query_failure_count == 0) {
               send_status(conn, 201, "Created");
@@ -392,58 +1918,306 @@ void handle(fcgi_connection_t* conn, int type) {
         break;
 
       default:
-        {
-          int i;
-          for (i = 0; i < request->futures_length; ++i) {
-            CassFuture* future = request->futures[i];
-            cass_future_free(future);
-          }
-          send_status(conn, 200, "OK");
-        }
+        request_free_futures(request);
+        send_status(conn, 200, "OK");
         break;
     }
+  } else if (type == FCGI_STATE_FLUSH) {
+    request_t* request = (request_t*)conn->data;
+    if (!request || request->cancelled) return;
+    request->stream_write_pending = false;
+    if (request->stream_notify_pending) {
+      request->stream_notify_pending = false;
+      handle(conn, FCGI_STATE_NOTIFY);
+    }
   } else if (type == FCGI_STATE_WRITE) {
+    request_t* request = (request_t*)conn->data;
+    if (request) {
+      trace_mark(&request->trace, TRACE_PHASE_WRITE_END);
+      request->trace.status = conn->app_status;
+      trace_ring_push(&trace_ring, &request->trace);
+    }
     fcgi_connection_end(conn);
+  } else if (type == FCGI_STATE_CLOSE) {
+    request_t* request = (request_t*)conn->data;
+    if (request && request_cancel(request)) {
+      /* The connection gets a new request, this one frees itself */
+      conn->data = NULL;
+    }
   }
 }
 
+void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [-m <cache_memory_bytes>] [-t <cache_ttl_ms>] "
+                  "[-n <negative_cache_entries>] [-N <negative_cache_ttl_ms>] "
+                  "[-a <auto_prepare_entries>] [-H <hedge_delay_ms>|p95] "
+                  "[-B <hedge_budget_percent>] [-c <driver_config_file>] "
+                  "[-o <driver_setting>=<value>] [-T <slow_request_ms>] "
+                  "[-L <max_in_flight>] [-S <max_submitted>] "
+                  "[-D <route>=<deadline_ms>] [-A loop|io=<cpus>|auto] "
+                  "[-P [<address>:]<http_port>] "
+                  "[-W <insert_batch_window_us>] [-G <insert_batch_max>] "
+                  "[-F <cache_snapshot_file>] [-I <cache_snapshot_interval_s>] "
+                  "<contact_points> <sock_file>\n"
+                  "       %s [-c <driver_config_file>] [-o <driver_setting>=<value>] "
+                  "-C <profile_output_file> <contact_points>\n", program, program);
+}
+
 int main(int argc, char** argv) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <contact_points> <sock_file>\n", argv[0]);
+  size_t cache_memory = DEFAULT_CACHE_MEMORY;
+  uint64_t cache_ttl_ms = DEFAULT_CACHE_TTL_MS;
+  size_t negative_cache_entries = DEFAULT_NEGATIVE_CACHE_ENTRIES;
+  uint64_t negative_cache_ttl_ms = DEFAULT_NEGATIVE_CACHE_TTL_MS;
+  size_t auto_prepare_entries = DEFAULT_AUTO_PREPARE_ENTRIES;
+  bool hedge = false;
+  uint64_t hedge_delay_ms = 0;
+  int hedge_budget_percent = DEFAULT_HEDGE_BUDGET_PERCENT;
+  uint64_t slow_request_ms = DEFAULT_SLOW_REQUEST_MS;
+  int64_t max_in_flight = -1;
+  uint64_t max_submitted = DEFAULT_MAX_SUBMITTED;
+  const char* driver_config_file = NULL;
+  const char* calibrate_output_file = NULL;
+  driver_config_t driver_config;
+  driver_config_t driver_overrides;
+  placement_t placement;
+  bool auto_placement = false;
+  const char* http_address = "0.0.0.0";
+  int http_port = 0;
+  int64_t insert_batch_window_us = -1;
+  int insert_batch_max = DEFAULT_INSERT_BATCH_MAX;
+  uint64_t cache_snapshot_interval_s = DEFAULT_CACHE_SNAPSHOT_INTERVAL_S;
+
+  driver_config_init_defaults(&driver_config);
+  driver_config_init_unset(&driver_overrides);
+  placement_init(&placement);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:n:N:a:H:B:c:o:C:T:L:S:D:A:P:W:G:F:I:")) != -1) {
+    switch (opt) {
+      case 'm':
+        cache_memory = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        cache_ttl_ms = strtoull(optarg, NULL, 10);
+        break;
+      case 'n':
+        negative_cache_entries = strtoull(optarg, NULL, 10);
+        break;
+      case 'N':
+        negative_cache_ttl_ms = strtoull(optarg, NULL, 10);
+        break;
+      case 'a':
+        auto_prepare_entries = strtoull(optarg, NULL, 10);
+        break;
+      case 'H':
+        hedge = true;
+        hedge_delay_ms = strcmp(optarg, "p95") == 0 ? 0 : strtoull(optarg, NULL, 10);
+        break;
+      case 'B':
+        hedge_budget_percent = atoi(optarg);
+        break;
+      case 'c':
+        driver_config_file = optarg;
+        break;
+      case 'o':
+        {
+          char* value = strchr(optarg, '=');
+          if (value) *value++ = '\0';
+          if (!value || !driver_config_set(&driver_overrides, optarg, value)) {
+            fprintf(stderr, "Invalid driver setting \"%s\"\n", optarg);
+            return 1;
+          }
+        }
+        break;
+      case 'C':
+        calibrate_output_file = optarg;
+        break;
+      case 'T':
+        slow_request_ms = strtoull(optarg, NULL, 10);
+        break;
+      case 'L':
+        max_in_flight = strtoll(optarg, NULL, 10);
+        break;
+      case 'S':
+        max_submitted = strtoull(optarg, NULL, 10);
+        break;
+      case 'D':
+        {
+          char* value = strchr(optarg, '=');
+          if (value) *value++ = '\0';
+          if (!value || !route_deadline_set(optarg, value)) {
+            fprintf(stderr, "Invalid route deadline \"%s\"\n", optarg);
+            return 1;
+          }
+        }
+        break;
+      case 'A':
+        if (strcmp(optarg, "auto") == 0) {
+          auto_placement = true;
+        } else {
+          char* value = strchr(optarg, '=');
+          if (value) *value++ = '\0';
+          if (!value || !placement_set(&placement, optarg, value)) {
+            fprintf(stderr, "Invalid CPU placement \"%s\"\n", optarg);
+            return 1;
+          }
+        }
+        break;
+      case 'P':
+        {
+          char* port = strrchr(optarg, ':');
+          if (port) {
+            *port++ = '\0';
+            http_address = optarg;
+          } else {
+            port = optarg;
+          }
+          http_port = atoi(port);
+          if (http_port <= 0 || http_port > 65535) {
+            fprintf(stderr, "Invalid HTTP port \"%s\"\n", port);
+            return 1;
+          }
+        }
+        break;
+      case 'W':
+        insert_batch_window_us = strtoll(optarg, NULL, 10);
+        break;
+      case 'G':
+        insert_batch_max = atoi(optarg);
+        break;
+      case 'F':
+        cache_snapshot_file = optarg;
+        break;
+      case 'I':
+        cache_snapshot_interval_s = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (argc - optind < (calibrate_output_file ? 1 : 2)) {
+    usage(argv[0]);
     return 1;
   }
 
-  CassFuture* connect_future = NULL;
-  CassCluster* cluster = cass_cluster_new();
-  CassSession* session = cass_session_new();
+  /* Settings on the command line take precedence over the config file */
+  if (driver_config_file && driver_config_load(&driver_config, driver_config_file) != 0) {
+    return 1;
+  }
+  driver_config_merge(&driver_config, &driver_overrides);
 
-  cass_cluster_set_contact_points(cluster, argv[1]);
-  cass_cluster_set_num_threads_io(cluster, 4);
-  cass_cluster_set_queue_size_io(cluster, 10000);
-  cass_cluster_set_pending_requests_low_water_mark(cluster, 5000);
-  cass_cluster_set_pending_requests_high_water_mark(cluster, 10000);
-  cass_cluster_set_core_connections_per_host(cluster, 1);
-  cass_cluster_set_max_connections_per_host(cluster, 2);
+  const char* contact_points = argv[optind];
+  const char* sock_file = argv[optind + 1];
 
-  connect_future = cass_session_connect(session, cluster);
+  if (calibrate_output_file) {
+    return calibrate_run(contact_points, &driver_config,
+                         SELECT_QUERY, "calibration", calibrate_output_file) == 0 ? 0 : 1;
+  }
+
+  /* Started before anything is pinned so the writer thread can run on any
+   * CPU rather than compete with the loop */
+  if (logger_start() != 0) {
+    fprintf(stderr, "Unable to start the logger\n");
+    return 1;
+  }
 
-  if (cass_future_error_code(connect_future) != CASS_OK) {
+  if (auto_placement && placement_auto(&placement, driver_config.num_threads_io) != 0) {
     return 1;
   }
 
-  if (prepare_query(session, SELECT_QUERY, &select_prepared) != CASS_OK) {
+  /* Pinned before anything is allocated so the caches and buffers are first
+   * touched on the loop's node */
+  if (placement_bind_loop(&placement) != 0) {
     return 1;
   }
 
-  if (prepare_query(session, INSERT_QUERY, &insert_prepared) != CASS_OK) {
+  CassCluster* cluster = cass_cluster_new();
+  CassSession* session = cass_session_new();
+
+  cass_cluster_set_contact_points(cluster, contact_points);
+  driver_config_apply(&driver_config, cluster);
+
+  user_cache_init(&user_cache, cache_memory, cache_ttl_ms);
+  /* A missing or bad snapshot only means starting cold */
+  if (cache_snapshot_file) {
+    user_cache_snapshot_load(&user_cache, cache_snapshot_file);
+  }
+  negative_cache_init(&negative_cache, negative_cache_entries, negative_cache_ttl_ms);
+  single_flight_init(&select_flights);
+  statement_cache_init(&statement_cache, session, auto_prepare_entries);
+  projection_init();
+  statement_cache_init(&projection_statements, session, USER_ROW_PROJECTIONS);
+  hedge_policy_init(&simple_hedge_policy, hedge, hedge_delay_ms, hedge_budget_percent);
+  hedge_policy_init(&prepared_hedge_policy, hedge, hedge_delay_ms, hedge_budget_percent);
+
+  if (trace_ring_init(&trace_ring, TRACE_RING_ENTRIES, slow_request_ms) != 0) {
     return 1;
   }
 
+  /* By default nothing more is queued than the driver's high water mark */
+  admission_init(&admission,
+                 max_in_flight >= 0 ? (uint64_t)max_in_flight
+                                    : (uint64_t)driver_config.pending_requests_high_water_mark,
+                 ADMISSION_BULK_PERCENT);
+
   fcgi_server_t serv;
   serv.data = (void*)session;
   fcgi_server_init(&serv);
-  unlink(argv[2]);
-  fcgi_server_start(&serv, argv[2], handle);
+
+  /* kill -USR1 dumps the recent requests to stderr */
+  uv_signal_init(&serv.loop, &trace_signal);
+  uv_signal_start(&trace_signal, on_trace_signal, SIGUSR1);
+
+  if (cache_snapshot_file && cache_memory > 0) {
+    uv_signal_init(&serv.loop, &shutdown_signals[0]);
+    uv_signal_start(&shutdown_signals[0], on_shutdown_signal, SIGTERM);
+    uv_signal_init(&serv.loop, &shutdown_signals[1]);
+    uv_signal_start(&shutdown_signals[1], on_shutdown_signal, SIGINT);
+
+    if (cache_snapshot_interval_s > 0) {
+      uv_timer_init(&serv.loop, &cache_snapshot_timer);
+      uv_timer_start(&cache_snapshot_timer, on_cache_snapshot_timer,
+                     cache_snapshot_interval_s * 1000, cache_snapshot_interval_s * 1000);
+    }
+  }
+
+  scheduler_init(&scheduler, &serv.loop, max_submitted, on_submit);
+
+  /* Without a window every insert is executed on its own */
+  combiner_init(&insert_combiner, &serv.loop,
+                insert_batch_window_us > 0 ? (uint64_t)insert_batch_window_us : 0,
+                insert_batch_window_us >= 0 ? insert_batch_max : 0,
+                INSERT_BATCH_TOKEN_RANGES, on_insert_batch);
+
+  uv_mutex_init(&orphans_mutex);
+  orphans = NULL;
+  uv_async_init(&serv.loop, &orphans_async, on_orphans);
+
+  /* The driver's IO threads are started by the connect and inherit this
+   * thread's affinity and memory policy, there's no other hook for them */
+  if (placement_bind_io(&placement) != 0) {
+    return 1;
+  }
+
+  /* Connecting and preparing happen while the listener is already up */
+  startup_start(&serv.loop, session, cluster, &driver_config);
+
+  if (placement_bind_loop(&placement) != 0) {
+    return 1;
+  }
+  placement_report(&placement, stderr);
+
+  /* Clients can skip the web server and talk HTTP to the same handler */
+  if (http_port > 0 && fcgi_server_listen_http(&serv, http_address, http_port) != 0) {
+    return 1;
+  }
+
+  unlink(sock_file);
+  if (fcgi_server_start(&serv, sock_file, handle) != 0 || startup.failed) {
+    return 1;
+  }
 
   return 0;
 }
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Uploads more rows than the ingest window with a 1ms deadline, so most of
+# them are skipped before they're submitted. The upload must still be
+# answered with every row counted as inserted or failed.
+#
+# Needs a Cassandra node with the videodb schema:
+#   ./test_ingest_deadline.sh [<contact_points>]
+
+CONTACT_POINTS=${1:-127.0.0.1}
+PORT=${PORT:-18080}
+ROWS=2000
+URL=http://127.0.0.1:$PORT
+
+SOCK=$(mktemp -u /tmp/sut_test.XXXXXX)
+BODY=$(mktemp /tmp/sut_test_body.XXXXXX)
+
+./sut -P 127.0.0.1:$PORT "$CONTACT_POINTS" "$SOCK" 2>/dev/null &
+PID=$!
+trap 'kill $PID 2>/dev/null; rm -f "$SOCK" "$BODY"' EXIT
+
+# Everything but / answers with a 503 until startup is done
+i=0
+while [ "$(curl -s -o /dev/null -w '%{http_code}' $URL/cassandra)" != 200 ]; do
+  i=$((i + 1))
+  if [ $i -ge 100 ]; then
+    echo "FAIL: the server didn't start"
+    exit 1
+  fi
+  sleep 0.1
+done
+
+i=0
+while [ $i -lt $ROWS ]; do
+  printf '{"username":"deadline%d","firstname":"f","lastname":"l","password":"p"}\n' $i
+  i=$((i + 1))
+done > "$BODY"
+
+RESPONSE=$(curl -s --max-time 10 -H 'Content-Type: application/x-ndjson' \
+                --data-binary @"$BODY" "$URL/prepared-statements/users?deadline_ms=1")
+if [ $? -ne 0 ]; then
+  echo "FAIL: the upload wasn't answered"
+  exit 1
+fi
+
+INSERTED=$(echo "$RESPONSE" | sed -n 's/^inserted //p')
+FAILED=$(echo "$RESPONSE" | sed -n 's/^failed //p')
+if [ -z "$INSERTED" ] || [ -z "$FAILED" ] || [ $((INSERTED + FAILED)) -ne $ROWS ]; then
+  echo "FAIL: unexpected response"
+  echo "$RESPONSE"
+  exit 1
+fi
+
+echo "PASS: inserted $INSERTED, failed $FAILED"
@@ -0,0 +1,172 @@
+#include "trace.h"
+#include "logger.h"
+
+#include <string.h>
+
+static const char* trace__phase_names[TRACE_PHASE_COUNT] = {
+  "begin", "params", "execute", "future", "notify", "write"
+};
+
+/*****************************************************************************/
+
+static void trace__copy(char* to, size_t to_size, const char* from);
+static uint64_t trace__total_ns(const trace_t* trace);
+
+/*****************************************************************************/
+
+void trace__copy(char* to, size_t to_size, const char* from) {
+  size_t length = strlen(from);
+  if (length >= to_size) length = to_size - 1;
+  memcpy(to, from, length);
+  to[length] = '\0';
+}
+
+uint64_t trace__total_ns(const trace_t* trace) {
+  uint64_t first = 0;
+  uint64_t last = 0;
+  int i;
+
+  for (i = 0; i < TRACE_PHASE_COUNT; ++i) {
+    if (trace->times[i] == 0) continue;
+    if (first == 0) first = trace->times[i];
+    last = trace->times[i];
+  }
+
+  return last - first;
+}
+
+/*****************************************************************************/
+
+void trace_reset(trace_t* trace) {
+  int i;
+  for (i = 0; i < TRACE_PHASE_COUNT; ++i) {
+    __atomic_store_n(&trace->times[i], 0, __ATOMIC_RELAXED);
+  }
+  trace->status = 0;
+  trace->method[0] = '\0';
+  trace->uri[0] = '\0';
+}
+
+void trace_set_request(trace_t* trace, const char* method, const char* uri) {
+  trace__copy(trace->method, sizeof(trace->method), method);
+  trace__copy(trace->uri, sizeof(trace->uri), uri);
+}
+
+void trace_mark(trace_t* trace, int phase) {
+  __atomic_store_n(&trace->times[phase], uv_hrtime(), __ATOMIC_RELAXED);
+}
+
+void trace_mark_first(trace_t* trace, int phase) {
+  uint64_t expected = 0;
+  __atomic_compare_exchange_n(&trace->times[phase], &expected, uv_hrtime(),
+                              false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+int trace_ring_init(trace_ring_t* ring, size_t capacity, uint64_t slow_threshold_ms) {
+  size_t rounded = 1;
+  while (rounded < capacity) rounded <<= 1;
+
+  ring->entries = (trace_ring_entry_t*)calloc(rounded, sizeof(trace_ring_entry_t));
+  if (!ring->entries) {
+    return -1;
+  }
+  ring->capacity = rounded;
+  ring->head = 0;
+  ring->slow_threshold_ns = slow_threshold_ms * 1000 * 1000;
+
+  return 0;
+}
+
+void trace_ring_destroy(trace_ring_t* ring) {
+  free(ring->entries);
+  ring->entries = NULL;
+}
+
+void trace_ring_push(trace_ring_t* ring, const trace_t* trace) {
+  uint64_t head = ring->head;
+  trace_ring_entry_t* entry = &ring->entries[head & (ring->capacity - 1)];
+
+  __atomic_store_n(&entry->sequence, 2 * head + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&entry->trace, trace, sizeof(trace_t));
+  __atomic_store_n(&entry->sequence, 2 * head + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  if (ring->slow_threshold_ns > 0 && trace__total_ns(trace) >= ring->slow_threshold_ns) {
+    fcgi_buffer_t line = { 0, 0, 0, NULL };
+    trace_format(trace, &line);
+    LOGGER_WRITE("Slow request: %.*s", (int)line.length, line.data);
+    free(line.data);
+  }
+}
+
+size_t trace_ring_snapshot(const trace_ring_t* ring, trace_t* traces, size_t count) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t start = head > ring->capacity ? head - ring->capacity : 0;
+  size_t copied = 0;
+  uint64_t i;
+
+  if (head - start > count) start = head - count;
+
+  for (i = start; i < head; ++i) {
+    const trace_ring_entry_t* entry = &ring->entries[i & (ring->capacity - 1)];
+    uint64_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    if (sequence != 2 * i + 2) continue; /* Being overwritten */
+
+    memcpy(&traces[copied], &entry->trace, sizeof(trace_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == sequence) {
+      copied++;
+    }
+  }
+
+  return copied;
+}
+
+/* One line per request, each phase is the time since the previous one */
+void trace_format(const trace_t* trace, fcgi_buffer_t* out) {
+  char temp[64];
+  uint64_t previous = 0;
+  int i;
+
+  snprintf(temp, sizeof(temp), "%s ", trace->method[0] ? trace->method : "-");
+  fcgi_buffer_append(out, temp, strlen(temp));
+  fcgi_buffer_append(out, trace->uri[0] ? trace->uri : "-", trace->uri[0] ? strlen(trace->uri) : 1);
+
+  snprintf(temp, sizeof(temp), " %u total=%lluus", trace->status,
+           (unsigned long long)(trace__total_ns(trace) / 1000));
+  fcgi_buffer_append(out, temp, strlen(temp));
+
+  for (i = 0; i < TRACE_PHASE_COUNT; ++i) {
+    if (trace->times[i] == 0) continue;
+    if (previous != 0) {
+      snprintf(temp, sizeof(temp), " %s=+%lluus", trace__phase_names[i],
+               (unsigned long long)((trace->times[i] - previous) / 1000));
+      fcgi_buffer_append(out, temp, strlen(temp));
+    }
+    previous = trace->times[i];
+  }
+
+  fcgi_buffer_append(out, "\n", 1);
+}
+
+void trace_ring_dump(const trace_ring_t* ring, FILE* file) {
+  trace_t* traces = (trace_t*)malloc(ring->capacity * sizeof(trace_t));
+  fcgi_buffer_t out = { 0, 0, 0, NULL };
+  size_t count;
+  size_t i;
+
+  if (!traces) return;
+
+  count = trace_ring_snapshot(ring, traces, ring->capacity);
+
+  for (i = 0; i < count; ++i) {
+    trace_format(&traces[i], &out);
+  }
+  fwrite(out.data, 1, out.length, file);
+  fflush(file);
+
+  free(out.data);
+  free(traces);
+}
@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "fastercgi.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+  TRACE_PHASE_BEGIN,     /* FCGI_BEGIN_REQUEST record read */
+  TRACE_PHASE_PARAMS,    /* FCGI_PARAMS parsed */
+  TRACE_PHASE_EXECUTE,   /* First statement handed to the driver */
+  TRACE_PHASE_FUTURE,    /* Last future callback on a driver IO thread */
+  TRACE_PHASE_NOTIFY,    /* Last wakeup on the loop thread */
+  TRACE_PHASE_WRITE_END, /* Last record of the response written */
+  TRACE_PHASE_COUNT
+};
+
+#define TRACE_METHOD_LENGTH 8
+#define TRACE_URI_LENGTH 64
+
+/* Monotonic timestamps (uv_hrtime()) of a request's phase transitions, 0
+ * for phases the request didn't go through (e.g. cache hits never execute) */
+typedef struct trace_s {
+  uint64_t times[TRACE_PHASE_COUNT];
+  uint32_t status;
+  char method[TRACE_METHOD_LENGTH];
+  char uri[TRACE_URI_LENGTH];
+} trace_t;
+
+typedef struct trace_ring_entry_s {
+  uint64_t sequence; /* Odd while the entry is being written */
+  trace_t trace;
+} trace_ring_entry_t;
+
+/* Fixed size ring of the most recent requests. There's a single writer (the
+ * loop thread), readers copy entries out without locking and drop the ones
+ * that were overwritten while they were reading. */
+typedef struct trace_ring_s {
+  trace_ring_entry_t* entries;
+  size_t capacity; /* Power of two */
+  uint64_t head;
+  uint64_t slow_threshold_ns;
+} trace_ring_t;
+
+void trace_reset(trace_t* trace);
+void trace_set_request(trace_t* trace, const char* method, const char* uri);
+
+/* Safe to call from the driver's IO threads */
+void trace_mark(trace_t* trace, int phase);
+void trace_mark_first(trace_t* trace, int phase);
+
+/* Capacity is rounded up to a power of two, slow requests aren't logged if
+ * the threshold is 0 */
+int trace_ring_init(trace_ring_t* ring, size_t capacity, uint64_t slow_threshold_ms);
+void trace_ring_destroy(trace_ring_t* ring);
+
+/* Adds a finished request, logging it to stderr if it was slow */
+void trace_ring_push(trace_ring_t* ring, const trace_t* trace);
+
+/* Copies up to "count" of the most recent requests into "traces", oldest
+ * first, and returns how many were copied */
+size_t trace_ring_snapshot(const trace_ring_t* ring, trace_t* traces, size_t count);
+
+void trace_format(const trace_t* trace, fcgi_buffer_t* out);
+void trace_ring_dump(const trace_ring_t* ring, FILE* file);
+
+#endif
@@ -0,0 +1,857 @@
+#include "user_cache.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Rough size of a cached user, only used to size the hash tables */
+#define USER_CACHE_EXPECTED_ENTRY_SIZE 96
+#define USER_CACHE_MAX_FREQUENCY 15
+
+#define USER_CACHE_SNAPSHOT_MAGIC 0x31504E5343525355ULL /* "USRCSNP1" */
+/* Also bumped when the encoding of the cached rows changes */
+#define USER_CACHE_SNAPSHOT_VERSION 2
+
+/* Slot offsets that aren't records, the header is at offset 0 */
+#define USER_CACHE_SNAPSHOT_EMPTY 0
+#define USER_CACHE_SNAPSHOT_REMOVED 1
+
+typedef struct user_cache_entry_s {
+  struct user_cache_entry_s* next_in_bucket;
+  struct user_cache_entry_s* prev_in_clock;
+  struct user_cache_entry_s* next_in_clock;
+
+  uint64_t hash;
+  uint64_t expires_at;
+  bool referenced;
+
+  uint32_t key_length;
+  uint32_t value_length;
+  char data[]; /* Key followed by the value */
+} user_cache_entry_t;
+
+/* Snapshot file layout: the header, the records (each 8 byte aligned) and
+ * then the slots, an open addressing table of record offsets by key hash.
+ * Expiry times are wall clock milliseconds so they survive a restart. */
+typedef struct user_cache_snapshot_header_s {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_count; /* Power of two */
+  uint64_t slots_offset;
+  uint64_t entry_count;
+  int64_t expires_at; /* Latest expiry of any record */
+} user_cache_snapshot_header_t;
+
+typedef struct user_cache_snapshot_record_s {
+  int64_t expires_at;
+  uint32_t key_length;
+  uint32_t value_length;
+  char data[]; /* Key followed by the value */
+} user_cache_snapshot_record_t;
+
+/* Promoted and invalidated entries are marked as removed in the private
+ * mapping, always with the key's shard locked */
+typedef struct user_cache_snapshot_slot_s {
+  uint64_t hash;
+  uint64_t offset;
+} user_cache_snapshot_slot_t;
+
+/* Records written so far while saving */
+typedef struct user_cache_snapshot_index_s {
+  user_cache_snapshot_slot_t* entries;
+  size_t count;
+  size_t capacity;
+  int64_t expires_at;
+} user_cache_snapshot_index_t;
+
+/* A record still only in the loaded snapshot, copied out before any shard
+ * is locked. It's only written if its slot is unchanged once its shard is. */
+typedef struct user_cache_snapshot_carried_s {
+  user_cache_snapshot_slot_t* slot;
+  uint64_t slot_offset;
+  uint64_t hash;
+  int64_t expires_at;
+  size_t position; /* Of the key and value in the copy */
+  uint32_t key_length;
+  uint32_t value_length;
+  bool kept;
+} user_cache_snapshot_carried_t;
+
+typedef struct user_cache_snapshot_carry_s {
+  user_cache_snapshot_carried_t* entries; /* Grouped by shard */
+  size_t starts[USER_CACHE_SHARDS + 1];
+  fcgi_buffer_t data;
+} user_cache_snapshot_carry_t;
+
+static const uint64_t user_cache__sketch_seeds[USER_CACHE_SKETCH_DEPTH] = {
+  0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+  0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+};
+
+/*****************************************************************************/
+
+static uint64_t user_cache__hash(const char* key, size_t key_length);
+static uint64_t user_cache__now_ms();
+static int64_t user_cache__wall_ms();
+static size_t user_cache__next_pow2(size_t n);
+
+static size_t user_cache__entry_size(const user_cache_entry_t* entry);
+static user_cache_shard_t* user_cache__get_shard(user_cache_t* cache, uint64_t hash);
+static uint32_t* user_cache__get_generation(user_cache_shard_t* shard, uint64_t hash);
+
+static void user_cache__shard_init(user_cache_shard_t* shard, size_t memory_budget);
+static user_cache_entry_t* user_cache__shard_find(user_cache_shard_t* shard, uint64_t hash,
+                                                  const char* key, size_t key_length);
+static void user_cache__shard_link(user_cache_shard_t* shard, user_cache_entry_t* entry);
+static void user_cache__shard_unlink(user_cache_shard_t* shard, user_cache_entry_t* entry);
+static user_cache_entry_t* user_cache__shard_victim(user_cache_shard_t* shard);
+static bool user_cache__shard_insert(user_cache_t* cache, user_cache_shard_t* shard, uint64_t hash,
+                                     const char* key, size_t key_length,
+                                     const char* value, size_t value_length,
+                                     uint64_t expires_at);
+
+static void user_cache__sketch_increment(user_cache_shard_t* shard, uint64_t hash);
+static int user_cache__sketch_frequency(user_cache_shard_t* shard, uint64_t hash);
+
+static bool user_cache__snapshot_active(user_cache_t* cache, uint64_t now);
+static const user_cache_snapshot_record_t* user_cache__snapshot_record(const user_cache_snapshot_t* snapshot,
+                                                                       uint64_t offset);
+static user_cache_snapshot_slot_t* user_cache__snapshot_find(user_cache_snapshot_t* snapshot, uint64_t hash,
+                                                             const char* key, size_t key_length,
+                                                             const user_cache_snapshot_record_t** record);
+static bool user_cache__snapshot_promote(user_cache_t* cache, user_cache_shard_t* shard, uint64_t hash,
+                                         const char* key, size_t key_length, fcgi_buffer_t* value);
+static void user_cache__snapshot_remove(user_cache_t* cache, uint64_t hash,
+                                        const char* key, size_t key_length);
+static void user_cache__snapshot_append(fcgi_buffer_t* records, user_cache_snapshot_index_t* index,
+                                        uint64_t hash, uint64_t offset, int64_t expires_at,
+                                        const char* data, uint32_t key_length, uint32_t value_length);
+static void user_cache__snapshot_carry(user_cache_t* cache, int64_t wall,
+                                       user_cache_snapshot_carry_t* carry);
+static int user_cache__snapshot_write(user_cache_t* cache, FILE* file);
+
+/*****************************************************************************/
+
+uint64_t user_cache__hash(const char* key, size_t key_length) {
+  /* FNV-1a */
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  size_t i;
+  for (i = 0; i < key_length; ++i) {
+    hash ^= (uint8_t)key[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+uint64_t user_cache__now_ms() {
+  return uv_hrtime() / 1000000;
+}
+
+int64_t user_cache__wall_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+size_t user_cache__next_pow2(size_t n) {
+  size_t result = 1;
+  while (result < n) result <<= 1;
+  return result;
+}
+
+size_t user_cache__entry_size(const user_cache_entry_t* entry) {
+  return sizeof(user_cache_entry_t) + entry->key_length + entry->value_length;
+}
+
+user_cache_shard_t* user_cache__get_shard(user_cache_t* cache, uint64_t hash) {
+  return &cache->shards[(hash >> 56) % USER_CACHE_SHARDS];
+}
+
+uint32_t* user_cache__get_generation(user_cache_shard_t* shard, uint64_t hash) {
+  return &shard->generations[(hash >> 16) & (USER_CACHE_SHARD_GENERATIONS - 1)];
+}
+
+void user_cache__shard_init(user_cache_shard_t* shard, size_t memory_budget) {
+  size_t bucket_count = user_cache__next_pow2(memory_budget / USER_CACHE_EXPECTED_ENTRY_SIZE);
+  if (bucket_count < 16) bucket_count = 16;
+
+  uv_mutex_init(&shard->mutex);
+
+  shard->buckets = (user_cache_entry_t**)calloc(bucket_count, sizeof(user_cache_entry_t*));
+  shard->bucket_mask = bucket_count - 1;
+
+  shard->hand = NULL;
+
+  shard->memory_used = 0;
+  shard->memory_budget = memory_budget;
+
+  shard->sketch = (uint8_t*)calloc(USER_CACHE_SKETCH_DEPTH * bucket_count, sizeof(uint8_t));
+  shard->sketch_mask = bucket_count - 1;
+  shard->sketch_additions = 0;
+  shard->sketch_sample_size = 10 * bucket_count;
+
+  memset(shard->generations, 0, sizeof(shard->generations));
+}
+
+user_cache_entry_t* user_cache__shard_find(user_cache_shard_t* shard, uint64_t hash,
+                                           const char* key, size_t key_length) {
+  user_cache_entry_t* entry = shard->buckets[hash & shard->bucket_mask];
+  while (entry) {
+    if (entry->hash == hash &&
+        entry->key_length == key_length &&
+        memcmp(entry->data, key, key_length) == 0) {
+      return entry;
+    }
+    entry = entry->next_in_bucket;
+  }
+  return NULL;
+}
+
+void user_cache__shard_link(user_cache_shard_t* shard, user_cache_entry_t* entry) {
+  user_cache_entry_t** bucket = &shard->buckets[entry->hash & shard->bucket_mask];
+  entry->next_in_bucket = *bucket;
+  *bucket = entry;
+
+  /* New entries go right behind the hand so they are the last ones visited */
+  if (shard->hand) {
+    entry->next_in_clock = shard->hand;
+    entry->prev_in_clock = shard->hand->prev_in_clock;
+    shard->hand->prev_in_clock->next_in_clock = entry;
+    shard->hand->prev_in_clock = entry;
+  } else {
+    entry->next_in_clock = entry;
+    entry->prev_in_clock = entry;
+    shard->hand = entry;
+  }
+
+  shard->memory_used += user_cache__entry_size(entry);
+}
+
+void user_cache__shard_unlink(user_cache_shard_t* shard, user_cache_entry_t* entry) {
+  user_cache_entry_t** pos = &shard->buckets[entry->hash & shard->bucket_mask];
+  while (*pos != entry) {
+    pos = &(*pos)->next_in_bucket;
+  }
+  *pos = entry->next_in_bucket;
+
+  if (entry->next_in_clock == entry) {
+    shard->hand = NULL;
+  } else {
+    if (shard->hand == entry) {
+      shard->hand = entry->next_in_clock;
+    }
+    entry->prev_in_clock->next_in_clock = entry->next_in_clock;
+    entry->next_in_clock->prev_in_clock = entry->prev_in_clock;
+  }
+
+  shard->memory_used -= user_cache__entry_size(entry);
+  free(entry);
+}
+
+user_cache_entry_t* user_cache__shard_victim(user_cache_shard_t* shard) {
+  uint64_t now = user_cache__now_ms();
+  while (shard->hand) {
+    user_cache_entry_t* entry = shard->hand;
+    if (!entry->referenced || entry->expires_at <= now) {
+      return entry;
+    }
+    entry->referenced = false;
+    shard->hand = entry->next_in_clock;
+  }
+  return NULL;
+}
+
+/* The shard must be locked. Returns false if the entry wasn't admitted. */
+bool user_cache__shard_insert(user_cache_t* cache, user_cache_shard_t* shard, uint64_t hash,
+                              const char* key, size_t key_length,
+                              const char* value, size_t value_length,
+                              uint64_t expires_at) {
+  size_t size = sizeof(user_cache_entry_t) + key_length + value_length;
+
+  if (size > shard->memory_budget) return false;
+
+  user_cache_entry_t* entry = user_cache__shard_find(shard, hash, key, key_length);
+  if (entry) {
+    user_cache__shard_unlink(shard, entry);
+  }
+
+  if (shard->memory_used + size > shard->memory_budget) {
+    user_cache_entry_t* victim = user_cache__shard_victim(shard);
+
+    /* TinyLFU admission: only replace the victim with something more popular */
+    if (victim->expires_at > user_cache__now_ms() &&
+        user_cache__sketch_frequency(shard, hash) <= user_cache__sketch_frequency(shard, victim->hash)) {
+      return false;
+    }
+
+    do {
+      user_cache__shard_unlink(shard, victim);
+      victim = user_cache__shard_victim(shard);
+    } while (shard->memory_used + size > shard->memory_budget);
+  }
+
+  entry = (user_cache_entry_t*)malloc(size);
+  entry->hash = hash;
+  entry->expires_at = expires_at;
+  entry->referenced = false;
+  entry->key_length = key_length;
+  entry->value_length = value_length;
+  memcpy(entry->data, key, key_length);
+  memcpy(entry->data + key_length, value, value_length);
+
+  user_cache__shard_link(shard, entry);
+
+  return true;
+}
+
+void user_cache__sketch_increment(user_cache_shard_t* shard, uint64_t hash) {
+  int i;
+  size_t width = shard->sketch_mask + 1;
+  for (i = 0; i < USER_CACHE_SKETCH_DEPTH; ++i) {
+    size_t index = i * width + (((hash * user_cache__sketch_seeds[i]) >> 32) & shard->sketch_mask);
+    if (shard->sketch[index] < USER_CACHE_MAX_FREQUENCY) {
+      shard->sketch[index]++;
+    }
+  }
+
+  /* Age the counters so that old popularity fades away */
+  if (++shard->sketch_additions >= shard->sketch_sample_size) {
+    size_t j;
+    for (j = 0; j < USER_CACHE_SKETCH_DEPTH * width; ++j) {
+      shard->sketch[j] >>= 1;
+    }
+    shard->sketch_additions /= 2;
+  }
+}
+
+int user_cache__sketch_frequency(user_cache_shard_t* shard, uint64_t hash) {
+  int i;
+  int frequency = USER_CACHE_MAX_FREQUENCY;
+  size_t width = shard->sketch_mask + 1;
+  for (i = 0; i < USER_CACHE_SKETCH_DEPTH; ++i) {
+    size_t index = i * width + (((hash * user_cache__sketch_seeds[i]) >> 32) & shard->sketch_mask);
+    if (shard->sketch[index] < frequency) {
+      frequency = shard->sketch[index];
+    }
+  }
+  return frequency;
+}
+
+
+/* Lookups stop once everything in the snapshot has expired */
+bool user_cache__snapshot_active(user_cache_t* cache, uint64_t now) {
+  return cache->snapshot.data && now < cache->snapshot.expires_at;
+}
+
+/* Records are only checked as they're used, checking them all on load
+ * would read the whole file */
+const user_cache_snapshot_record_t* user_cache__snapshot_record(const user_cache_snapshot_t* snapshot,
+                                                                uint64_t offset) {
+  const user_cache_snapshot_record_t* record;
+  if (offset % 8 != 0 || offset > snapshot->length - sizeof(user_cache_snapshot_record_t)) {
+    return NULL;
+  }
+  record = (const user_cache_snapshot_record_t*)(snapshot->data + offset);
+  if ((uint64_t)record->key_length + record->value_length >
+      snapshot->length - offset - sizeof(user_cache_snapshot_record_t)) {
+    return NULL;
+  }
+  return record;
+}
+
+user_cache_snapshot_slot_t* user_cache__snapshot_find(user_cache_snapshot_t* snapshot, uint64_t hash,
+                                                      const char* key, size_t key_length,
+                                                      const user_cache_snapshot_record_t** record) {
+  size_t index = hash & snapshot->slot_mask;
+  size_t probes;
+
+  for (probes = 0; probes <= snapshot->slot_mask; ++probes) {
+    user_cache_snapshot_slot_t* slot = &snapshot->slots[index];
+    uint64_t offset = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+
+    if (offset == USER_CACHE_SNAPSHOT_EMPTY) break;
+
+    if (offset != USER_CACHE_SNAPSHOT_REMOVED && slot->hash == hash) {
+      const user_cache_snapshot_record_t* found = user_cache__snapshot_record(snapshot, offset);
+      if (found &&
+          found->key_length == key_length &&
+          memcmp(found->data, key, key_length) == 0) {
+        *record = found;
+        return slot;
+      }
+    }
+
+    index = (index + 1) & snapshot->slot_mask;
+  }
+
+  return NULL;
+}
+
+/* The shard must be locked. The value is served even if the cache doesn't
+ * admit it, the record then stays in the snapshot for the next miss. */
+bool user_cache__snapshot_promote(user_cache_t* cache, user_cache_shard_t* shard, uint64_t hash,
+                                  const char* key, size_t key_length, fcgi_buffer_t* value) {
+  const user_cache_snapshot_record_t* record;
+  user_cache_snapshot_slot_t* slot = user_cache__snapshot_find(&cache->snapshot, hash,
+                                                               key, key_length, &record);
+  int64_t remaining_ms;
+
+  if (!slot) return false;
+
+  remaining_ms = record->expires_at - user_cache__wall_ms();
+  if (remaining_ms <= 0) {
+    __atomic_store_n(&slot->offset, USER_CACHE_SNAPSHOT_REMOVED, __ATOMIC_RELAXED);
+    return false;
+  }
+  /* A restart with a shorter TTL applies to the snapshot too */
+  if ((uint64_t)remaining_ms > cache->ttl_ms) {
+    remaining_ms = cache->ttl_ms;
+  }
+
+  fcgi_buffer_append(value, record->data + record->key_length, record->value_length);
+
+  if (user_cache__shard_insert(cache, shard, hash, key, key_length,
+                               record->data + record->key_length, record->value_length,
+                               user_cache__now_ms() + remaining_ms)) {
+    __atomic_store_n(&slot->offset, USER_CACHE_SNAPSHOT_REMOVED, __ATOMIC_RELAXED);
+  }
+
+  return true;
+}
+
+/* The shard must be locked */
+void user_cache__snapshot_remove(user_cache_t* cache, uint64_t hash,
+                                 const char* key, size_t key_length) {
+  const user_cache_snapshot_record_t* record;
+  user_cache_snapshot_slot_t* slot;
+
+  if (!user_cache__snapshot_active(cache, user_cache__now_ms())) return;
+
+  slot = user_cache__snapshot_find(&cache->snapshot, hash, key, key_length, &record);
+  if (slot) {
+    __atomic_store_n(&slot->offset, USER_CACHE_SNAPSHOT_REMOVED, __ATOMIC_RELAXED);
+  }
+}
+
+void user_cache__snapshot_append(fcgi_buffer_t* records, user_cache_snapshot_index_t* index,
+                                 uint64_t hash, uint64_t offset, int64_t expires_at,
+                                 const char* data, uint32_t key_length, uint32_t value_length) {
+  static const char padding[8] = { 0 };
+  user_cache_snapshot_record_t record;
+  size_t length = sizeof(record) + key_length + value_length;
+
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity > 0 ? 2 * index->capacity : 1024;
+    index->entries = (user_cache_snapshot_slot_t*)realloc(index->entries,
+                                                          index->capacity * sizeof(user_cache_snapshot_slot_t));
+  }
+  index->entries[index->count].hash = hash;
+  index->entries[index->count].offset = offset + records->length;
+  index->count++;
+  if (expires_at > index->expires_at) {
+    index->expires_at = expires_at;
+  }
+
+  record.expires_at = expires_at;
+  record.key_length = key_length;
+  record.value_length = value_length;
+  fcgi_buffer_append(records, (const char*)&record, sizeof(record));
+  fcgi_buffer_append(records, data, key_length + value_length);
+  fcgi_buffer_append(records, padding, (8 - length % 8) % 8);
+}
+
+/* Entries that were never looked up since the last restart are kept too.
+ * The mapping is read once here, with no shard locked, so a save doesn't
+ * fault in the file under the locks lookups take. */
+void user_cache__snapshot_carry(user_cache_t* cache, int64_t wall,
+                                user_cache_snapshot_carry_t* carry) {
+  user_cache_snapshot_t* snapshot = &cache->snapshot;
+  user_cache_snapshot_carried_t* found = NULL;
+  size_t next[USER_CACHE_SHARDS] = { 0 };
+  size_t count = 0;
+  size_t capacity = 0;
+  size_t i;
+
+  for (i = 0; i <= snapshot->slot_mask; ++i) {
+    user_cache_snapshot_slot_t* slot = &snapshot->slots[i];
+    uint64_t slot_offset = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+    const user_cache_snapshot_record_t* record;
+    user_cache_snapshot_carried_t* carried;
+
+    if (slot_offset == USER_CACHE_SNAPSHOT_EMPTY ||
+        slot_offset == USER_CACHE_SNAPSHOT_REMOVED) {
+      continue;
+    }
+    record = user_cache__snapshot_record(snapshot, slot_offset);
+    if (!record || record->expires_at <= wall) continue;
+
+    if (count == capacity) {
+      capacity = capacity > 0 ? 2 * capacity : 1024;
+      found = (user_cache_snapshot_carried_t*)realloc(found, capacity * sizeof(user_cache_snapshot_carried_t));
+    }
+    carried = &found[count++];
+    carried->slot = slot;
+    carried->slot_offset = slot_offset;
+    carried->hash = slot->hash;
+    carried->expires_at = record->expires_at;
+    carried->position = carry->data.length;
+    carried->key_length = record->key_length;
+    carried->value_length = record->value_length;
+    carried->kept = false;
+    fcgi_buffer_append(&carry->data, record->data, record->key_length + record->value_length);
+
+    next[user_cache__get_shard(cache, slot->hash) - cache->shards]++;
+  }
+
+  carry->starts[0] = 0;
+  for (i = 0; i < USER_CACHE_SHARDS; ++i) {
+    carry->starts[i + 1] = carry->starts[i] + next[i];
+    next[i] = carry->starts[i];
+  }
+
+  carry->entries = (user_cache_snapshot_carried_t*)malloc((count > 0 ? count : 1) *
+                                                          sizeof(user_cache_snapshot_carried_t));
+  for (i = 0; i < count; ++i) {
+    size_t shard = user_cache__get_shard(cache, found[i].hash) - cache->shards;
+    carry->entries[next[shard]++] = found[i];
+  }
+
+  free(found);
+}
+
+/* A shard is copied while it's locked and written out after, so lookups
+ * only wait for the copy */
+int user_cache__snapshot_write(user_cache_t* cache, FILE* file) {
+  user_cache_snapshot_header_t header;
+  user_cache_snapshot_index_t index = { NULL, 0, 0, 0 };
+  user_cache_snapshot_carry_t carry;
+  user_cache_snapshot_slot_t* slots = NULL;
+  fcgi_buffer_t records = { 0, 0, 0, NULL };
+  uint64_t offset = sizeof(header);
+  uint64_t now = user_cache__now_ms();
+  int64_t wall = user_cache__wall_ms();
+  size_t slot_count;
+  size_t i;
+  int rc = 0;
+
+  /* Written again once the slots are known */
+  memset(&header, 0, sizeof(header));
+  if (fwrite(&header, sizeof(header), 1, file) != 1) return -1;
+
+  memset(&carry, 0, sizeof(carry));
+  if (user_cache__snapshot_active(cache, now)) {
+    user_cache__snapshot_carry(cache, wall, &carry);
+  }
+
+  for (i = 0; i < USER_CACHE_SHARDS; ++i) {
+    user_cache_shard_t* shard = &cache->shards[i];
+    user_cache_entry_t* entry;
+    size_t j;
+
+    records.length = 0;
+
+    uv_mutex_lock(&shard->mutex);
+
+    entry = shard->hand;
+    if (entry) {
+      do {
+        if (entry->expires_at > now) {
+          user_cache__snapshot_append(&records, &index, entry->hash, offset,
+                                      wall + (int64_t)(entry->expires_at - now),
+                                      entry->data, entry->key_length, entry->value_length);
+        }
+        entry = entry->next_in_clock;
+      } while (entry != shard->hand);
+    }
+
+    /* Promoted or invalidated since they were copied out */
+    for (j = carry.starts[i]; j < carry.starts[i + 1]; ++j) {
+      user_cache_snapshot_carried_t* carried = &carry.entries[j];
+      carried->kept = __atomic_load_n(&carried->slot->offset, __ATOMIC_RELAXED) == carried->slot_offset;
+    }
+
+    uv_mutex_unlock(&shard->mutex);
+
+    for (j = carry.starts[i]; j < carry.starts[i + 1]; ++j) {
+      user_cache_snapshot_carried_t* carried = &carry.entries[j];
+      if (carried->kept) {
+        user_cache__snapshot_append(&records, &index, carried->hash, offset, carried->expires_at,
+                                    carry.data.data + carried->position,
+                                    carried->key_length, carried->value_length);
+      }
+    }
+
+    if (records.length > 0 && fwrite(records.data, records.length, 1, file) != 1) {
+      rc = -1;
+      break;
+    }
+    offset += records.length;
+  }
+
+  if (rc == 0) {
+    slot_count = user_cache__next_pow2(2 * index.count);
+    if (slot_count < 16) slot_count = 16;
+
+    slots = (user_cache_snapshot_slot_t*)calloc(slot_count, sizeof(user_cache_snapshot_slot_t));
+    for (i = 0; i < index.count; ++i) {
+      size_t position = index.entries[i].hash & (slot_count - 1);
+      while (slots[position].offset != USER_CACHE_SNAPSHOT_EMPTY) {
+        position = (position + 1) & (slot_count - 1);
+      }
+      slots[position] = index.entries[i];
+    }
+
+    header.magic = USER_CACHE_SNAPSHOT_MAGIC;
+    header.version = USER_CACHE_SNAPSHOT_VERSION;
+    header.slot_count = slot_count;
+    header.slots_offset = offset;
+    header.entry_count = index.count;
+    header.expires_at = index.expires_at;
+
+    if (fwrite(slots, sizeof(user_cache_snapshot_slot_t), slot_count, file) != slot_count ||
+        fseek(file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, file) != 1) {
+      rc = -1;
+    }
+  }
+
+  free(slots);
+  free(index.entries);
+  free(records.data);
+  free(carry.entries);
+  free(carry.data.data);
+
+  return rc;
+}
+
+/*****************************************************************************/
+
+int user_cache_init(user_cache_t* cache, size_t memory_budget, uint64_t ttl_ms) {
+  int i;
+
+  cache->enabled = memory_budget > 0;
+  cache->ttl_ms = ttl_ms;
+  memset(&cache->snapshot, 0, sizeof(cache->snapshot));
+
+  if (!cache->enabled) return 0;
+
+  uv_mutex_init(&cache->snapshot_mutex);
+
+  for (i = 0; i < USER_CACHE_SHARDS; ++i) {
+    user_cache__shard_init(&cache->shards[i], memory_budget / USER_CACHE_SHARDS);
+  }
+
+  return 0;
+}
+
+void user_cache_destroy(user_cache_t* cache) {
+  int i;
+
+  if (!cache->enabled) return;
+
+  for (i = 0; i < USER_CACHE_SHARDS; ++i) {
+    user_cache_shard_t* shard = &cache->shards[i];
+    while (shard->hand) {
+      user_cache__shard_unlink(shard, shard->hand);
+    }
+    free(shard->buckets);
+    free(shard->sketch);
+    uv_mutex_destroy(&shard->mutex);
+  }
+
+  if (cache->snapshot.data) {
+    munmap(cache->snapshot.data, cache->snapshot.length);
+    memset(&cache->snapshot, 0, sizeof(cache->snapshot));
+  }
+  uv_mutex_destroy(&cache->snapshot_mutex);
+
+  cache->enabled = false;
+}
+
+bool user_cache_get(user_cache_t* cache, const char* key, size_t key_length, fcgi_buffer_t* value) {
+  if (!cache->enabled) return false;
+
+  uint64_t hash = user_cache__hash(key, key_length);
+  user_cache_shard_t* shard = user_cache__get_shard(cache, hash);
+  uint64_t now = user_cache__now_ms();
+  bool found = false;
+
+  uv_mutex_lock(&shard->mutex);
+
+  user_cache__sketch_increment(shard, hash);
+
+  user_cache_entry_t* entry = user_cache__shard_find(shard, hash, key, key_length);
+  if (entry) {
+    if (entry->expires_at <= now) {
+      user_cache__shard_unlink(shard, entry);
+    } else {
+      entry->referenced = true;
+      fcgi_buffer_append(value, entry->data + entry->key_length, entry->value_length);
+      found = true;
+    }
+  } else if (user_cache__snapshot_active(cache, now)) {
+    found = user_cache__snapshot_promote(cache, shard, hash, key, key_length, value);
+  }
+
+  uv_mutex_unlock(&shard->mutex);
+
+  return found;
+}
+
+uint32_t user_cache_generation(user_cache_t* cache, const char* key, size_t key_length) {
+  if (!cache->enabled) return 0;
+
+  uint64_t hash = user_cache__hash(key, key_length);
+  user_cache_shard_t* shard = user_cache__get_shard(cache, hash);
+  return __atomic_load_n(user_cache__get_generation(shard, hash), __ATOMIC_ACQUIRE);
+}
+
+void user_cache_put(user_cache_t* cache, const char* key, size_t key_length,
+                    const char* value, size_t value_length, uint32_t generation) {
+  if (!cache->enabled) return;
+
+  uint64_t hash = user_cache__hash(key, key_length);
+  user_cache_shard_t* shard = user_cache__get_shard(cache, hash);
+
+  uv_mutex_lock(&shard->mutex);
+
+  /* An insert finished while the row was being read */
+  if (*user_cache__get_generation(shard, hash) != generation) {
+    uv_mutex_unlock(&shard->mutex);
+    return;
+  }
+
+  /* The snapshot's copy is older */
+  user_cache__snapshot_remove(cache, hash, key, key_length);
+  user_cache__shard_insert(cache, shard, hash, key, key_length, value, value_length,
+                           user_cache__now_ms() + cache->ttl_ms);
+
+  uv_mutex_unlock(&shard->mutex);
+}
+
+void user_cache_invalidate(user_cache_t* cache, const char* key, size_t key_length) {
+  if (!cache->enabled) return;
+
+  uint64_t hash = user_cache__hash(key, key_length);
+  user_cache_shard_t* shard = user_cache__get_shard(cache, hash);
+
+  uv_mutex_lock(&shard->mutex);
+
+  user_cache_entry_t* entry = user_cache__shard_find(shard, hash, key, key_length);
+  if (entry) {
+    user_cache__shard_unlink(shard, entry);
+  }
+  user_cache__snapshot_remove(cache, hash, key, key_length);
+  __atomic_add_fetch(user_cache__get_generation(shard, hash), 1, __ATOMIC_RELEASE);
+
+  uv_mutex_unlock(&shard->mutex);
+}
+
+int user_cache_snapshot_load(user_cache_t* cache, const char* path) {
+  user_cache_snapshot_t* snapshot = &cache->snapshot;
+  const user_cache_snapshot_header_t* header;
+  struct stat st;
+  char* data;
+  int64_t remaining_ms;
+  int fd;
+
+  if (!cache->enabled) return 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) return 0;
+    fprintf(stderr, "Unable to open cache snapshot %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(user_cache_snapshot_header_t)) {
+    fprintf(stderr, "Invalid cache snapshot %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  /* Private and writable so entries can be marked as removed without
+   * touching the file */
+  data = (char*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Unable to map cache snapshot %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  header = (const user_cache_snapshot_header_t*)data;
+  if (header->magic != USER_CACHE_SNAPSHOT_MAGIC ||
+      header->version != USER_CACHE_SNAPSHOT_VERSION ||
+      header->slot_count == 0 ||
+      (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->slots_offset % 8 != 0 ||
+      header->slots_offset > (uint64_t)st.st_size ||
+      (uint64_t)header->slot_count * sizeof(user_cache_snapshot_slot_t) >
+        (uint64_t)st.st_size - header->slots_offset) {
+    fprintf(stderr, "Invalid cache snapshot %s\n", path);
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  /* Records are faulted in one at a time as they're looked up */
+  madvise(data, st.st_size, MADV_RANDOM);
+
+  snapshot->data = data;
+  snapshot->length = st.st_size;
+  snapshot->slots = (user_cache_snapshot_slot_t*)(data + header->slots_offset);
+  snapshot->slot_mask = header->slot_count - 1;
+
+  remaining_ms = header->expires_at - user_cache__wall_ms();
+  if (remaining_ms > 0 && (uint64_t)remaining_ms > cache->ttl_ms) {
+    remaining_ms = cache->ttl_ms;
+  }
+  snapshot->expires_at = remaining_ms > 0 ? user_cache__now_ms() + remaining_ms : 0;
+
+  fprintf(stderr, "Cache snapshot %s: %llu entries\n",
+          path, (unsigned long long)header->entry_count);
+
+  return 0;
+}
+
+int user_cache_snapshot_save(user_cache_t* cache, const char* path) {
+  char temp_path[PATH_MAX];
+  FILE* file;
+  int rc;
+
+  if (!cache->enabled) return 0;
+
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+  uv_mutex_lock(&cache->snapshot_mutex);
+
+  file = fopen(temp_path, "wb");
+  if (!file) {
+    LOGGER_WRITE("Unable to write cache snapshot %s: %s\n", temp_path, strerror(errno));
+    uv_mutex_unlock(&cache->snapshot_mutex);
+    return -1;
+  }
+
+  /* Replaced in one step so a crash never leaves a partial snapshot */
+  rc = user_cache__snapshot_write(cache, file);
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) rc = -1;
+  if (fclose(file) != 0) rc = -1;
+  if (rc == 0 && rename(temp_path, path) != 0) rc = -1;
+
+  if (rc != 0) {
+    LOGGER_WRITE("Unable to write cache snapshot %s: %s\n", path, strerror(errno));
+    unlink(temp_path);
+  }
+
+  uv_mutex_unlock(&cache->snapshot_mutex);
+
+  return rc;
+}
@@ -0,0 +1,80 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include "fastercgi.h"
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define USER_CACHE_SHARDS 16
+#define USER_CACHE_SKETCH_DEPTH 4
+#define USER_CACHE_SHARD_GENERATIONS 64
+
+struct user_cache_entry_s;
+struct user_cache_snapshot_slot_s;
+
+typedef struct user_cache_shard_s {
+  uv_mutex_t mutex;
+
+  struct user_cache_entry_s** buckets;
+  size_t bucket_mask;
+
+  /* CLOCK ring, "hand" is the next eviction candidate */
+  struct user_cache_entry_s* hand;
+
+  size_t memory_used;
+  size_t memory_budget;
+
+  /* TinyLFU frequency sketch (4-bit counters stored in bytes) */
+  uint8_t* sketch;
+  size_t sketch_mask;
+  size_t sketch_additions;
+  size_t sketch_sample_size;
+
+  /* Bumped by every invalidate, per group of keys, so a read that started
+   * before an insert can't put the old row back once the insert is done */
+  uint32_t generations[USER_CACHE_SHARD_GENERATIONS];
+} user_cache_shard_t;
+
+/* A snapshot file mapped at startup. Nothing is read up front, entries are
+ * looked up in the mapping on a miss and moved into the cache. */
+typedef struct user_cache_snapshot_s {
+  char* data;
+  size_t length;
+  struct user_cache_snapshot_slot_s* slots;
+  size_t slot_mask;
+  uint64_t expires_at; /* When the last entry in it expires */
+} user_cache_snapshot_t;
+
+typedef struct user_cache_s {
+  bool enabled;
+  uint64_t ttl_ms;
+  user_cache_shard_t shards[USER_CACHE_SHARDS];
+  user_cache_snapshot_t snapshot;
+  uv_mutex_t snapshot_mutex; /* One save at a time */
+} user_cache_t;
+
+int user_cache_init(user_cache_t* cache, size_t memory_budget, uint64_t ttl_ms);
+void user_cache_destroy(user_cache_t* cache);
+
+bool user_cache_get(user_cache_t* cache, const char* key, size_t key_length, fcgi_buffer_t* value);
+/* Read before the key is looked up in the cluster, the put is skipped if
+ * the key was invalidated since */
+uint32_t user_cache_generation(user_cache_t* cache, const char* key, size_t key_length);
+void user_cache_put(user_cache_t* cache, const char* key, size_t key_length,
+                    const char* value, size_t value_length, uint32_t generation);
+void user_cache_invalidate(user_cache_t* cache, const char* key, size_t key_length);
+
+/* Maps a snapshot written by user_cache_snapshot_save(). A missing file
+ * isn't an error, the cache just starts cold. */
+int user_cache_snapshot_load(user_cache_t* cache, const char* path);
+
+/* Writes every live entry, including the ones still only in the loaded
+ * snapshot, to a temporary file that then replaces "path". Safe to call
+ * from any thread while the cache is in use. */
+int user_cache_snapshot_save(user_cache_t* cache, const char* path);
+
+#endif
@@ -0,0 +1,314 @@
+#include "user_row.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define USER_ROW_TEXT_COLUMNS 5
+#define USER_ROW_NULL_LENGTH 0xFFFF
+
+#define USER_ROW_INDICES_UNRESOLVED 0
+#define USER_ROW_INDICES_CLAIMED    1
+#define USER_ROW_INDICES_PUBLISHED  2
+
+static const char* user_row__columns[USER_ROW_COLUMNS] = {
+  "username", "firstname", "lastname", "password", "email", "created_date"
+};
+
+/* JSON keys with their separators so a row is a handful of appends */
+static const char* user_row__json_keys[] = {
+  "{\"username\":", ",\"firstname\":", ",\"lastname\":",
+  ",\"password\":", ",\"email\":", ",\"created_date\":"
+};
+
+/* Non-zero for the bytes that have to be escaped in a JSON string */
+static const uint8_t user_row__json_escape[256] = {
+  [0 ... 31] = 1, ['"'] = 1, ['\\'] = 1
+};
+
+/* Per projection, every variant of the query has its own column order */
+static int user_row__indices[USER_ROW_PROJECTIONS][USER_ROW_COLUMNS];
+static int user_row__resolved[USER_ROW_PROJECTIONS];
+
+/*****************************************************************************/
+
+static const int* user_row__get_indices(const CassResult* result, int columns, int* scratch);
+static void user_row__append_u16(fcgi_buffer_t* out, uint16_t value);
+
+static void user_row__json_string(const char* data, size_t length, fcgi_buffer_t* out);
+static void user_row__render_json(int columns, const char* row, size_t row_length, fcgi_buffer_t* out);
+
+/*****************************************************************************/
+
+/* Only the IO thread that claims a projection writes its shared indices.
+ * Threads that race it resolve into their own scratch array of
+ * USER_ROW_COLUMNS entries until the indices are published. */
+const int* user_row__get_indices(const CassResult* result, int columns, int* scratch) {
+  int state = __atomic_load_n(&user_row__resolved[columns], __ATOMIC_ACQUIRE);
+  bool claimed;
+  size_t count;
+  size_t i, j;
+
+  if (state == USER_ROW_INDICES_PUBLISHED) {
+    return user_row__indices[columns];
+  }
+
+  claimed = state == USER_ROW_INDICES_UNRESOLVED &&
+            __atomic_compare_exchange_n(&user_row__resolved[columns], &state,
+                                        USER_ROW_INDICES_CLAIMED, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+  if (!claimed && state == USER_ROW_INDICES_PUBLISHED) {
+    return user_row__indices[columns];
+  }
+
+  count = cass_result_column_count(result);
+  for (i = 0; i < USER_ROW_COLUMNS; ++i) {
+    scratch[i] = -1;
+    for (j = 0; j < count; ++j) {
+      CassString name = cass_result_column_name(result, j);
+      if (name.length == strlen(user_row__columns[i]) &&
+          memcmp(name.data, user_row__columns[i], name.length) == 0) {
+        scratch[i] = (int)j;
+        break;
+      }
+    }
+  }
+
+  if (claimed) {
+    memcpy(user_row__indices[columns], scratch, USER_ROW_COLUMNS * sizeof(int));
+    __atomic_store_n(&user_row__resolved[columns], USER_ROW_INDICES_PUBLISHED,
+                     __ATOMIC_RELEASE);
+  }
+
+  return scratch;
+}
+
+void user_row__append_u16(fcgi_buffer_t* out, uint16_t value) {
+  char bytes[2];
+  bytes[0] = (value >> 8) & 0xFF;
+  bytes[1] = value & 0xFF;
+  fcgi_buffer_append(out, bytes, 2);
+}
+
+void user_row__json_string(const char* data, size_t length, fcgi_buffer_t* out) {
+  static const char hex[] = "0123456789abcdef";
+  size_t start = 0;
+  size_t i;
+
+  fcgi_buffer_append(out, "\"", 1);
+  for (i = 0; i < length; ++i) {
+    uint8_t c = (uint8_t)data[i];
+    if (!user_row__json_escape[c]) continue;
+
+    /* Copy the run of plain bytes in one go */
+    fcgi_buffer_append(out, data + start, i - start);
+    start = i + 1;
+
+    if (c == '"' || c == '\\') {
+      char escaped[2] = { '\\', (char)c };
+      fcgi_buffer_append(out, escaped, 2);
+    } else {
+      char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+      fcgi_buffer_append(out, escaped, 6);
+    }
+  }
+  fcgi_buffer_append(out, data + start, length - start);
+  fcgi_buffer_append(out, "\"", 1);
+}
+
+/* The username is in every projection so it always opens the object */
+void user_row__render_json(int columns, const char* row, size_t row_length, fcgi_buffer_t* out) {
+  const uint8_t* pos = (const uint8_t*)row;
+  const uint8_t* end = pos + row_length;
+  size_t i;
+
+  for (i = 0; i < USER_ROW_TEXT_COLUMNS && pos + 2 <= end; ++i) {
+    size_t length = ((size_t)pos[0] << 8) | pos[1];
+    bool is_null = length == USER_ROW_NULL_LENGTH || pos + 2 + length > end;
+    pos += 2;
+    if (columns & (1 << i)) {
+      fcgi_buffer_append(out, user_row__json_keys[i], strlen(user_row__json_keys[i]));
+      if (is_null) {
+        fcgi_buffer_append(out, "null", 4);
+      } else {
+        user_row__json_string((const char*)pos, length, out);
+      }
+    }
+    if (!is_null) pos += length;
+  }
+
+  if (!(columns & USER_ROW_COLUMN_CREATED_DATE)) {
+    fcgi_buffer_append(out, "}", 1);
+    return;
+  }
+
+  fcgi_buffer_append(out, user_row__json_keys[USER_ROW_TEXT_COLUMNS],
+                     strlen(user_row__json_keys[USER_ROW_TEXT_COLUMNS]));
+  if (pos + 9 <= end && pos[0]) {
+    char temp[32];
+    uint64_t value = 0;
+    int j;
+    for (j = 1; j <= 8; ++j) {
+      value = (value << 8) | pos[j];
+    }
+    snprintf(temp, sizeof(temp), "%lld", (long long)(int64_t)value);
+    fcgi_buffer_append(out, temp, strlen(temp));
+  } else {
+    fcgi_buffer_append(out, "null", 4);
+  }
+  fcgi_buffer_append(out, "}", 1);
+}
+
+/*****************************************************************************/
+
+int user_row_parse_format(const char* format) {
+  if (strcmp(format, "json") == 0) return USER_ROW_FORMAT_JSON;
+  if (strcmp(format, "binary") == 0) return USER_ROW_FORMAT_BINARY;
+  return USER_ROW_FORMAT_TEXT;
+}
+
+const char* user_row_content_type(int format) {
+  switch (format) {
+    case USER_ROW_FORMAT_JSON:
+      return "Content-Type: application/json\r\n\r\n";
+    case USER_ROW_FORMAT_BINARY:
+      return "Content-Type: application/octet-stream\r\n\r\n";
+    default:
+      return "Content-Type: text/plain\r\n\r\n";
+  }
+}
+
+int user_row_parse_columns(const char* fields) {
+  int columns = USER_ROW_COLUMN_USERNAME;
+  const char* pos = fields;
+
+  while (*pos) {
+    const char* comma = strchr(pos, ',');
+    size_t length = comma ? (size_t)(comma - pos) : strlen(pos);
+    int i;
+
+    for (i = 0; i < USER_ROW_COLUMNS; ++i) {
+      if (strlen(user_row__columns[i]) == length &&
+          memcmp(user_row__columns[i], pos, length) == 0) {
+        break;
+      }
+    }
+    if (i == USER_ROW_COLUMNS) return -1;
+    columns |= 1 << i;
+
+    if (!comma) break;
+    pos = comma + 1;
+  }
+
+  return columns;
+}
+
+const char* user_row_column_name(int index) {
+  return user_row__columns[index];
+}
+
+void user_row_encode(const CassResult* result, const CassRow* row, int columns, fcgi_buffer_t* out) {
+  int scratch[USER_ROW_COLUMNS];
+  const int* indices = user_row__get_indices(result, columns, scratch);
+  char projection = (char)columns;
+  size_t i;
+
+  fcgi_buffer_append(out, &projection, 1);
+
+  for (i = 0; i < USER_ROW_TEXT_COLUMNS; ++i) {
+    CassString value;
+    if (indices[i] < 0 ||
+        cass_value_is_null(cass_row_get_column(row, indices[i])) ||
+        cass_value_get_string(cass_row_get_column(row, indices[i]), &value) != CASS_OK) {
+      user_row__append_u16(out, USER_ROW_NULL_LENGTH);
+      continue;
+    }
+    if (value.length >= USER_ROW_NULL_LENGTH) value.length = USER_ROW_NULL_LENGTH - 1;
+    user_row__append_u16(out, (uint16_t)value.length);
+    fcgi_buffer_append(out, value.data, value.length);
+  }
+
+  cass_int64_t created_date;
+  int index = indices[USER_ROW_TEXT_COLUMNS];
+  if (index >= 0 &&
+      !cass_value_is_null(cass_row_get_column(row, index)) &&
+      cass_value_get_int64(cass_row_get_column(row, index), &created_date) == CASS_OK) {
+    char bytes[9];
+    uint64_t value = (uint64_t)created_date;
+    int j;
+    bytes[0] = 1;
+    for (j = 8; j >= 1; --j) {
+      bytes[j] = value & 0xFF;
+      value >>= 8;
+    }
+    fcgi_buffer_append(out, bytes, 9);
+  } else {
+    fcgi_buffer_append(out, "\0", 1);
+  }
+}
+
+int user_row_columns(const char* row, size_t row_length) {
+  return row_length > 0 ? (uint8_t)row[0] : 0;
+}
+
+/* Scans select every column */
+size_t user_row_username_index(const CassResult* result) {
+  int scratch[USER_ROW_COLUMNS];
+  const int* indices = user_row__get_indices(result, USER_ROW_ALL_COLUMNS, scratch);
+  return indices[0] >= 0 ? (size_t)indices[0] : 0;
+}
+
+bool user_row_username(const char* row, size_t row_length, CassString* username) {
+  const uint8_t* pos = (const uint8_t*)row + 1;
+  if (row_length < 3) return false;
+
+  size_t length = ((size_t)pos[0] << 8) | pos[1];
+  if (length == USER_ROW_NULL_LENGTH || 3 + length > row_length) return false;
+
+  username->data = row + 3;
+  username->length = length;
+  return true;
+}
+
+void user_row_render(int format, int columns, const char* row, size_t row_length, fcgi_buffer_t* out) {
+  if (row_length == 0) return;
+
+  switch (format) {
+    case USER_ROW_FORMAT_JSON:
+      user_row__render_json(columns, row + 1, row_length - 1, out);
+      break;
+    case USER_ROW_FORMAT_BINARY:
+      {
+        /* Rows are length prefixed (u32, big-endian) so they can be concatenated */
+        size_t length = row_length - 1;
+        char bytes[4];
+        bytes[0] = (length >> 24) & 0xFF;
+        bytes[1] = (length >> 16) & 0xFF;
+        bytes[2] = (length >> 8) & 0xFF;
+        bytes[3] = length & 0xFF;
+        fcgi_buffer_append(out, bytes, 4);
+        fcgi_buffer_append(out, row + 1, length);
+      }
+      break;
+    default:
+      {
+        CassString username;
+        if (user_row_username(row, row_length, &username)) {
+          fcgi_buffer_append(out, username.data, username.length);
+        }
+      }
+      break;
+  }
+}
+
+void user_row_render_begin(int format, fcgi_buffer_t* out) {
+  if (format == USER_ROW_FORMAT_JSON) fcgi_buffer_append(out, "[", 1);
+}
+
+void user_row_render_separator(int format, fcgi_buffer_t* out) {
+  if (format != USER_ROW_FORMAT_BINARY) fcgi_buffer_append(out, ",", 1);
+}
+
+void user_row_render_end(int format, fcgi_buffer_t* out) {
+  if (format == USER_ROW_FORMAT_JSON) fcgi_buffer_append(out, "]", 1);
+}
@@ -0,0 +1,76 @@
+#ifndef USER_ROW_H
+#define USER_ROW_H
+
+#include "fastercgi.h"
+
+#include <cassandra.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+enum {
+  USER_ROW_FORMAT_TEXT,   /* Just the username */
+  USER_ROW_FORMAT_JSON,
+  USER_ROW_FORMAT_BINARY
+};
+
+/* Columns of videodb.users, as bits of a projection. The username is the
+ * key and is part of every projection. */
+enum {
+  USER_ROW_COLUMN_USERNAME = 1 << 0,
+  USER_ROW_COLUMN_FIRSTNAME = 1 << 1,
+  USER_ROW_COLUMN_LASTNAME = 1 << 2,
+  USER_ROW_COLUMN_PASSWORD = 1 << 3,
+  USER_ROW_COLUMN_EMAIL = 1 << 4,
+  USER_ROW_COLUMN_CREATED_DATE = 1 << 5
+};
+
+#define USER_ROW_COLUMNS 6
+#define USER_ROW_ALL_COLUMNS ((1 << USER_ROW_COLUMNS) - 1)
+#define USER_ROW_PROJECTIONS (1 << USER_ROW_COLUMNS)
+
+/* Rows of videodb.users are kept (in the cache, in request slots) in a
+ * compact binary encoding that is rendered in the requested format when the
+ * response is written:
+ *
+ *   u8 projection the row was read with (USER_ROW_COLUMN_* bits)
+ *   username, firstname, lastname, password, email:
+ *     u16 length (big-endian, 0xFFFF for null) followed by the bytes
+ *   created_date:
+ *     u8 1 followed by the i64 milliseconds (big-endian), or u8 0 for null
+ *
+ * Columns outside the projection are encoded as null. The binary response
+ * format is this encoding without the projection byte, with each row
+ * prefixed by its u32 length (big-endian). */
+
+int user_row_parse_format(const char* format);
+const char* user_row_content_type(int format);
+
+/* Parses a comma separated list of column names ("firstname,email") into a
+ * projection, always including the username. Returns -1 for an unknown
+ * column. */
+int user_row_parse_columns(const char* fields);
+
+const char* user_row_column_name(int index);
+
+/* Encodes a row of a result read with the given projection, column indices
+ * are resolved once per projection from its first result */
+void user_row_encode(const CassResult* result, const CassRow* row, int columns, fcgi_buffer_t* out);
+
+/* The projection an encoded row was read with, 0 if it's empty */
+int user_row_columns(const char* row, size_t row_length);
+
+/* Index of the username column for rows that are only scanned for it */
+size_t user_row_username_index(const CassResult* result);
+
+bool user_row_username(const char* row, size_t row_length, CassString* username);
+
+/* JSON objects only have the keys in "columns" */
+void user_row_render(int format, int columns, const char* row, size_t row_length, fcgi_buffer_t* out);
+
+/* Separators for responses with more than one row */
+void user_row_render_begin(int format, fcgi_buffer_t* out);
+void user_row_render_separator(int format, fcgi_buffer_t* out);
+void user_row_render_end(int format, fcgi_buffer_t* out);
+
+#endif